@@ -0,0 +1,1940 @@
+// Times every layer type over a grid of shapes and whole training steps of both
+// networks, and prints the results as JSON. Forward, backward and update of a
+// layer run through the same batched entry points training uses; infer is the
+// single-sample path serving uses. The int8 rows time quantized inference
+// against the fp32 model it was made from, the optimizer rows one update of a
+// large layer and how far the small CNN trains under each optimizer. The
+// inference rows show the heap a network loaded for serving holds, the
+// memory_plan rows the training workspace with and without shared buffers,
+// the checkpoint rows what gradient checkpointing trades for it, the
+// train_checkpoint rows what saving training state costs a step, and the
+// evaluate rows a pass over a holdout set.
+//
+// Layers run on one thread except in the intra_op rows, which split single
+// sample inference of a layer across 1 and --threads threads of the intra-op
+// pool, see Parallel/task_pool.h.
+//
+//   sharpnet_benchmark [--quick] [--filter text] [--min-time seconds]
+//                      [--batch n] [--threads n] [--output file] [--trace file]
+//
+// --trace writes the Chrome trace of the cnn/train_step runs on the most
+// threads, which only has events in a SHARPNET_PROFILING build.
+//
+// Rows with a reference path also check it: the run exits with 1 when a path
+// differs from its reference by more than it may, see check().
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "SharPNet.h"
+#include "SharPNetConv.h"
+#include "IO/model_format.h"
+#include "Math/int8.h"
+#include "Math/simd.h"
+
+#ifdef SHARPNET_PROFILING
+
+// the library counts allocations itself in profiling builds, and the heap in
+// use isn't tracked
+static long long allocations() { return (long long)allocation_count(); }
+static long long heap_bytes() { return -1; }
+
+#else
+
+// Every allocation of the process goes through here, so a benchmark can report
+// how many happen per iteration and, with glibc, how many bytes are in use
+static std::atomic<long long> g_allocations(0);
+static std::atomic<long long> g_heap_bytes(0);
+
+static long long allocations() { return g_allocations.load(); }
+
+#ifdef __GLIBC__
+static long long heap_bytes() { return g_heap_bytes.load(); }
+static size_t usable_size(void* memory) { return malloc_usable_size(memory); }
+#else
+static long long heap_bytes() { return -1; }
+static size_t usable_size(void*) { return 0; }
+#endif
+
+void* operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+
+	if (void* memory = malloc(size == 0 ? 1 : size)) {
+		g_heap_bytes.fetch_add((long long)usable_size(memory), std::memory_order_relaxed);
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+	if (memory) {
+		g_heap_bytes.fetch_sub((long long)usable_size(memory), std::memory_order_relaxed);
+	}
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept { operator delete(memory); }
+
+#endif
+
+struct options
+{
+	bool quick = false;
+	std::string filter;
+	double min_time = 0.25;
+	int min_iterations = 5;
+	int batch_size = 16;
+	int nr_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+	std::string output;
+	std::string trace;
+};
+
+struct measurement
+{
+	long long iterations;
+	double ns_per_iteration;
+	double allocations_per_iteration;
+};
+
+struct result
+{
+	std::string name;
+	std::string shape;
+	std::string simd;
+	int batch;
+	int threads;
+	measurement time;
+	double samples_per_iteration;
+	double flops_per_iteration;	// 0 where GFLOP/s means nothing
+	double max_abs_diff = -1;	// against the reference path, only where there is one
+	std::string reference;
+	double agreement = -1;		// share of samples with the reference's argmax
+	double accuracy = -1;		// SharPNetConv::evaluate() of the network
+	double workspace_bytes = -1;	// size of a model's planned workspace
+	double intermediate_bytes = -1;	// activations written out whole and read back, per iteration
+	double loss = -1;			// mean loss per sample of evaluate(), see Learning/metrics.h
+	double target_accuracy = -1;	// test accuracy the training time is taken to
+	double seconds_to_target = -1;	// training time until the target was first reached, -1: never
+	double resident_bytes = -1;	// heap a loaded network and its workspace hold, besides the weights
+	double weight_bytes = -1;
+};
+
+static const char* int8_name(int8_kernel_t level)
+{
+	switch (level) {
+	case int8_kernel_t::VNNI: return "int8 vnni";
+	case int8_kernel_t::AVX2: return "int8 avx2";
+	default: return "int8 scalar";
+	}
+}
+
+static const char* simd_name(simd_t level)
+{
+	switch (level) {
+	case simd_t::AVX512: return "avx512";
+	case simd_t::AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+// One untimed warm-up run, then as many as fit in min_time (at least
+// min_iterations). Allocations are counted over the timed runs only.
+template<typename F>
+static measurement measure(const options& opt, F run)
+{
+	using clock = std::chrono::steady_clock;
+
+	run();
+
+	long long allocations_before = allocations();
+	long long iterations = 0;
+	clock::time_point start = clock::now();
+	double elapsed = 0.0;
+
+	do {
+		run();
+		iterations++;
+		elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	} while (iterations < opt.min_iterations || elapsed < opt.min_time);
+
+	measurement m;
+	m.iterations = iterations;
+	m.ns_per_iteration = elapsed * 1e9 / iterations;
+	m.allocations_per_iteration = double(allocations() - allocations_before) / iterations;
+	return m;
+}
+
+static bool selected(const options& opt, const std::string& name)
+{
+	return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+}
+
+static std::string size_string(td_size size)
+{
+	std::stringstream ss;
+	ss << size._x << "x" << size._y << "x" << size._z;
+	return ss.str();
+}
+
+static void fill_random(float* data, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		data[i] = rand() / float(RAND_MAX) - 0.5f;
+	}
+}
+
+static int volume(td_size size)
+{
+	return size._x * size._y * size._z;
+}
+
+// Multiply-adds of one sample's forward pass, counted as two flops each
+static double forward_flops(const layer& l)
+{
+	td_size in = l.get_input_size();
+	td_size out = l.get_output_size();
+
+	if (l.type() == layer_t::Convolutional) {
+		int filter_dem = static_cast<const ConvLayer&>(l).get_filter_dem();
+		return 2.0 * out._z * (filter_dem * filter_dem * in._z) * (out._x * out._y);
+	}
+	if (l.type() == layer_t::FullConnected) {
+		return 2.0 * volume(in) * out._x;
+	}
+	return 0.0;
+}
+
+// Forward, backward and update over a batch, and single-sample infer, of one
+// layer. Weighted layers have twice the forward work in their backward pass:
+// one product for the weight gradients and one for the input gradients.
+static void bench_layer(const options& opt, const std::string& kind, layer& l, const std::string& shape, std::vector<result>& results)
+{
+	td_size in_size = l.get_input_size();
+	td_size out_size = l.get_output_size();
+	int batch_size = opt.batch_size;
+
+	std::vector<float> inputs((size_t)batch_size * volume(in_size));
+	std::vector<float> grads((size_t)batch_size * volume(out_size));
+	fill_random(inputs.data(), inputs.size());
+	fill_random(grads.data(), grads.size());
+
+	std::vector<tensor_view<float>> batch;
+	std::vector<tensor_view<float>> grad_batch;
+	bind_views(batch, inputs.data(), batch_size, in_size, l.get_layout());
+	bind_views(grad_batch, grads.data(), batch_size, out_size, l.get_layout());
+
+	std::unique_ptr<layer_context> ctx = l.create_context();
+	arena memory;
+	memory.plan([&](arena& a) { l.plan(*ctx, a, batch_size, true); });
+
+	double flops = forward_flops(l) * batch_size;
+	const char* simd = simd_name(simd_level());
+
+	if (selected(opt, kind + "/forward")) {
+		measurement m = measure(opt, [&] { l.activate(batch, *ctx); });
+		results.push_back({ kind + "/forward", shape, simd, batch_size, 1, m, (double)batch_size, flops });
+	}
+
+	l.activate(batch, *ctx);
+
+	if (selected(opt, kind + "/backward")) {
+		measurement m = measure(opt, [&] { l.calc_grads(grad_batch, *ctx); });
+		results.push_back({ kind + "/backward", shape, simd, batch_size, 1, m, (double)batch_size, 2 * flops });
+	}
+
+	if (l.weight_count() > 0 && selected(opt, kind + "/update")) {
+		l.calc_grads(grad_batch, *ctx);
+
+		// a tiny rate keeps the weights from drifting over thousands of updates
+		sgd_optimizer sgd(1e-6f);
+		sgd.add_layer(&l);
+
+		measurement m = measure(opt, [&] {
+			l.set_weight_grads(ctx->_weight_grads, 1.0f / batch_size);
+			sgd.step();
+		});
+		results.push_back({ kind + "/update", shape, simd, batch_size, 1, m, (double)batch_size, 0.0 });
+	}
+
+	if (selected(opt, kind + "/infer")) {
+		std::unique_ptr<layer_context> infer_ctx = l.create_context();
+		arena infer_memory;
+		infer_memory.plan([&](arena& a) { l.plan(*infer_ctx, a, 1, false); });
+
+		std::vector<float> out(volume(out_size));
+		tensor_view<float> out_view(out.data(), out_size, l.get_layout());
+
+		measurement m = measure(opt, [&] { l.infer(batch[0], out_view, *infer_ctx); });
+		results.push_back({ kind + "/infer", shape, simd, 1, 1, m, 1.0, forward_flops(l) });
+	}
+}
+
+// Every path checked against a reference that differs from it by more than
+// the tolerance is reported on stderr, and the run exits with 1
+static int failures = 0;
+
+static void check(const std::string& what, double diff, double tolerance)
+{
+	if (!(diff <= tolerance)) {
+		std::cerr << "FAILED " << what << ": max_abs_diff " << diff << " above " << tolerance << std::endl;
+		failures++;
+	}
+}
+
+static void check(const std::string& what, bool passed)
+{
+	if (!passed) {
+		std::cerr << "FAILED " << what << std::endl;
+		failures++;
+	}
+}
+
+static double max_abs_diff(const std::vector<float>& a, const std::vector<float>& b)
+{
+	double diff = 0.0;
+
+	for (size_t i = 0; i < a.size(); i++) {
+		diff = std::max(diff, (double)std::fabs(a[i] - b[i]));
+	}
+	return diff;
+}
+
+// infer and update of a FullConnected layer under every SIMD level the CPU has,
+// with the largest output difference to the scalar kernels on the same weights.
+// The vector kernels only sum in another order, see Math/simd.h, so an output
+// may be off by the bound on reordering a sum of as many terms, n ulps of 1,
+// and a weight after an update, which fuses multiply-adds, by a few ulps of 1.
+static void bench_fc_simd(const options& opt, FullConnected& fc, const std::string& shape, std::vector<result>& results)
+{
+	td_size in_size = fc.get_input_size();
+	td_size out_size = fc.get_output_size();
+	simd_t detected = detect_simd();
+
+	std::vector<float> input(volume(in_size));
+	fill_random(input.data(), input.size());
+	tensor_view<float> in_view(input.data(), in_size);
+
+	std::unique_ptr<layer_context> ctx = fc.create_context();
+	arena memory;
+	memory.plan([&](arena& a) { fc.plan(*ctx, a, 1, false); });
+
+	std::vector<float> reference(volume(out_size));
+	std::vector<float> out(volume(out_size));
+	tensor_view<float> out_view(out.data(), out_size);
+
+	set_simd_level(simd_t::Scalar);
+	fc.infer(in_view, tensor_view<float>(reference.data(), out_size), *ctx);
+
+	std::vector<float> weight_grads(fc.weight_count());
+	fill_random(weight_grads.data(), weight_grads.size());
+
+	std::vector<simd_t> levels;
+	for (simd_t level : { simd_t::Scalar, simd_t::AVX2, simd_t::AVX512 }) {
+		if ((int)level <= (int)detected) {
+			levels.push_back(level);
+		}
+	}
+
+	// every infer before any update, which moves the weights
+	for (simd_t level : levels) {
+		if (!selected(opt, "fc/simd_infer")) {
+			break;
+		}
+
+		set_simd_level(level);
+		fc.infer(in_view, out_view, *ctx);
+
+		double diff = 0.0;
+		for (size_t i = 0; i < out.size(); i++) {
+			diff = std::max(diff, (double)std::fabs(out[i] - reference[i]));
+		}
+
+		check("fc/simd_infer " + shape + " " + simd_name(level), diff, volume(in_size) * FLT_EPSILON);
+
+		measurement m = measure(opt, [&] { fc.infer(in_view, out_view, *ctx); });
+		results.push_back({ "fc/simd_infer", shape, simd_name(level), 1, 1, m, 1.0, forward_flops(fc), diff, "scalar" });
+	}
+
+	// one step from the same weights under every level, which are then restored
+	tensor_view<float> weights = fc.get_weights();
+	std::vector<float> initial(weights._data, weights._data + fc.weight_count());
+	std::vector<float> stepped[3];
+
+	for (simd_t level : levels) {
+		if (!selected(opt, "fc/simd_update")) {
+			break;
+		}
+
+		set_simd_level(level);
+
+		sgd_optimizer sgd(0.01f);
+		sgd.add_layer(&fc);
+		fc.set_weight_grads(weight_grads.data(), 1.0f);
+		sgd.step();
+
+		stepped[(int)level].assign(weights._data, weights._data + fc.weight_count());
+		std::copy(initial.begin(), initial.end(), weights._data);
+		fc.weights_changed();
+	}
+
+	for (simd_t level : levels) {
+		if (!selected(opt, "fc/simd_update")) {
+			break;
+		}
+
+		set_simd_level(level);
+
+		double diff = max_abs_diff(stepped[(int)simd_t::Scalar], stepped[(int)level]);
+		check("fc/simd_update " + shape + " " + simd_name(level), diff, 4 * FLT_EPSILON);
+
+		sgd_optimizer sgd(1e-6f);
+		sgd.add_layer(&fc);
+
+		measurement m = measure(opt, [&] {
+			fc.set_weight_grads(weight_grads.data(), 1.0f);
+			sgd.step();
+		});
+		results.push_back({ "fc/simd_update", shape, simd_name(level), 1, 1, m, 0.0, 0.0, diff, "scalar" });
+	}
+
+	set_simd_level(detected);
+}
+
+// Largest difference between two ways a layer can run, in the outputs and the
+// input gradients of a batch, on the same weights. select(path) switches the
+// layer to path 0 or 1; results are compared in CHW whatever the layout.
+template<typename F>
+static void path_error(layer& l, int batch_size, const F& select, double& forward_diff, double& backward_diff)
+{
+	td_size in_size = l.get_input_size();
+	td_size out_size = l.get_output_size();
+	int in_volume = volume(in_size);
+	int out_volume = volume(out_size);
+
+	std::vector<float> inputs((size_t)batch_size * in_volume);
+	std::vector<float> grads((size_t)batch_size * out_volume);
+	fill_random(inputs.data(), inputs.size());
+	fill_random(grads.data(), grads.size());
+
+	std::vector<float> outputs[2];
+	std::vector<float> input_grads[2];
+
+	for (int path = 0; path < 2; path++) {
+		select(path);
+
+		std::vector<float> layout_inputs(inputs.size());
+		std::vector<float> layout_grads(grads.size());
+		std::vector<tensor_view<float>> batch;
+		std::vector<tensor_view<float>> grad_batch;
+		bind_views(batch, layout_inputs.data(), batch_size, in_size, l.get_layout());
+		bind_views(grad_batch, layout_grads.data(), batch_size, out_size, l.get_layout());
+
+		for (int b = 0; b < batch_size; b++) {
+			copy_view(tensor_view<float>(inputs.data() + b * in_volume, in_size), batch[b]);
+			copy_view(tensor_view<float>(grads.data() + b * out_volume, out_size), grad_batch[b]);
+		}
+
+		std::unique_ptr<layer_context> ctx = l.create_context();
+		arena memory;
+		memory.plan([&](arena& a) { l.plan(*ctx, a, batch_size, true); });
+
+		l.activate(batch, *ctx);
+		l.calc_grads(grad_batch, *ctx);
+
+		outputs[path].resize(grads.size());
+		input_grads[path].resize(inputs.size());
+
+		for (int b = 0; b < batch_size; b++) {
+			copy_view(ctx->_output[b], tensor_view<float>(outputs[path].data() + b * out_volume, out_size));
+			copy_view(ctx->_gradients[b], tensor_view<float>(input_grads[path].data() + b * in_volume, in_size));
+		}
+	}
+
+	forward_diff = max_abs_diff(outputs[0], outputs[1]);
+	backward_diff = max_abs_diff(input_grads[0], input_grads[1]);
+}
+
+// Benchmarks path 1 of a layer, see path_error(), with its difference from
+// path 0 as the reference. With a tolerance the run fails where either
+// difference is larger.
+template<typename F>
+static void bench_path(const options& opt, const std::string& kind, layer& l, const std::string& shape, const F& select,
+	const std::string& reference, std::vector<result>& results, double tolerance = -1)
+{
+	double forward_diff = 0.0;
+	double backward_diff = 0.0;
+	path_error(l, opt.batch_size, select, forward_diff, backward_diff);
+
+	if (tolerance >= 0) {
+		check(kind + "/forward " + shape, forward_diff, tolerance);
+		check(kind + "/backward " + shape, backward_diff, tolerance);
+	}
+
+	size_t first = results.size();
+	select(1);
+	bench_layer(opt, kind, l, shape, results);
+
+	for (size_t i = first; i < results.size(); i++) {
+		bool backward = results[i].name == kind + "/backward";
+
+		if (results[i].name != kind + "/update") {
+			results[i].max_abs_diff = backward ? backward_diff : forward_diff;
+			results[i].reference = reference;
+		}
+	}
+}
+
+// Winograd and im2col differ only in rounding, which for these inputs in
+// [-0.5, 0.5] stays around 1e-5 even at 64 channels
+static const double winograd_tolerance = 1e-4;
+
+// Winograd against im2col after an optimizer step taken on the Winograd path,
+// so the cached filter transforms have to follow the new weights, see
+// ConvLayer::weights_changed()
+static void check_winograd_update(ConvLayer& conv, int batch_size, const std::string& shape)
+{
+	td_size in_size = conv.get_input_size();
+	td_size out_size = conv.get_output_size();
+
+	std::vector<float> inputs((size_t)batch_size * volume(in_size));
+	std::vector<float> grads((size_t)batch_size * volume(out_size));
+	fill_random(inputs.data(), inputs.size());
+	fill_random(grads.data(), grads.size());
+
+	std::vector<tensor_view<float>> batch;
+	std::vector<tensor_view<float>> grad_batch;
+	bind_views(batch, inputs.data(), batch_size, in_size, conv.get_layout());
+	bind_views(grad_batch, grads.data(), batch_size, out_size, conv.get_layout());
+
+	conv.use_winograd(true);
+
+	std::unique_ptr<layer_context> ctx = conv.create_context();
+	arena memory;
+	memory.plan([&](arena& a) { conv.plan(*ctx, a, batch_size, true); });
+
+	conv.activate(batch, *ctx);
+	conv.calc_grads(grad_batch, *ctx);
+	conv.set_weight_grads(ctx->_weight_grads, 1.0f / batch_size);
+
+	sgd_optimizer sgd(0.1f);
+	sgd.add_layer(&conv);
+	sgd.step();
+
+	// path 0 runs on whatever filters the step left, only path 1 switches
+	double forward_diff = 0.0;
+	double backward_diff = 0.0;
+	path_error(conv, batch_size, [&](int path) { if (path == 1) { conv.use_winograd(false); } },
+		forward_diff, backward_diff);
+
+	check("conv/forward " + shape + " winograd after update", forward_diff, winograd_tolerance);
+	check("conv/backward " + shape + " winograd after update", backward_diff, winograd_tolerance);
+}
+
+static void bench_layers(const options& opt, std::vector<result>& results)
+{
+	struct conv_shape { td_size in; int filter_dem; int stride; int nr_filters; };
+	struct pool_shape { td_size in; int filter_dem; int stride; };
+	struct fc_shape { int in; int out; };
+
+	std::vector<conv_shape> conv_shapes = {
+		{ { 28, 28, 1 }, 5, 1, 8 },
+		{ { 32, 32, 3 }, 3, 1, 16 },
+		{ { 32, 32, 16 }, 3, 1, 32 },
+		{ { 56, 56, 64 }, 3, 1, 64 },
+		{ { 65, 65, 8 }, 3, 2, 16 },
+		{ { 16, 16, 64 }, 1, 1, 64 },
+	};
+	std::vector<pool_shape> pool_shapes = {
+		{ { 24, 24, 8 }, 2, 2 },
+		{ { 32, 32, 32 }, 2, 2 },
+		{ { 31, 31, 16 }, 3, 2 },
+	};
+	std::vector<td_size> relu_shapes = {
+		{ 24, 24, 8 },
+		{ 32, 32, 32 },
+		{ 64, 64, 16 },
+	};
+	std::vector<fc_shape> fc_shapes = {
+		{ 1152, 10 },
+		{ 1024, 512 },
+		{ 4096, 1024 },
+	};
+
+	if (opt.quick) {
+		conv_shapes.resize(2);
+		pool_shapes.resize(1);
+		relu_shapes.resize(1);
+		fc_shapes.resize(2);
+	}
+
+	for (const conv_shape& s : conv_shapes) {
+		ConvLayer conv(s.stride, s.filter_dem, s.nr_filters, s.in);
+		std::stringstream shape;
+		shape << size_string(s.in) << " k" << s.filter_dem << " s" << s.stride << " f" << s.nr_filters;
+
+		// both paths of every layer Winograd applies to, whether or not it is
+		// picked by default, the im2col one as the reference
+		if (s.filter_dem == 3 && s.stride == 1) {
+			conv.use_winograd(false);
+			bench_layer(opt, "conv", conv, shape.str() + " im2col", results);
+			bench_path(opt, "conv", conv, shape.str() + " winograd",
+				[&](int path) { conv.use_winograd(path == 1); }, "im2col", results, winograd_tolerance);
+			check_winograd_update(conv, opt.batch_size, shape.str());
+		}
+		else {
+			bench_layer(opt, "conv", conv, shape.str(), results);
+		}
+
+		bench_path(opt, "conv", conv, shape.str() + " hwc",
+			[&](int path) { conv.set_layout(path == 1 ? layout_t::HWC : layout_t::CHW); }, "chw", results);
+
+		// a forced path has to survive a trip through HWC, which has none
+		if (s.filter_dem == 3 && s.stride == 1) {
+			for (bool forced : { false, true }) {
+				conv.use_winograd(forced);
+				conv.set_layout(layout_t::HWC);
+				conv.set_layout(layout_t::CHW);
+				check("conv " + shape.str() + (forced ? " winograd" : " im2col") + " kept over set_layout", conv.uses_winograd() == forced);
+			}
+		}
+	}
+
+	for (const pool_shape& s : pool_shapes) {
+		PoolingLayer pool(s.stride, s.filter_dem, s.in);
+		std::stringstream shape;
+		shape << size_string(s.in) << " k" << s.filter_dem << " s" << s.stride;
+		bench_layer(opt, "pool", pool, shape.str(), results);
+		bench_path(opt, "pool", pool, shape.str() + " hwc",
+			[&](int path) { pool.set_layout(path == 1 ? layout_t::HWC : layout_t::CHW); }, "chw", results);
+	}
+
+	for (td_size s : relu_shapes) {
+		ReluLayer relu(s);
+		bench_layer(opt, "relu", relu, size_string(s), results);
+		bench_path(opt, "relu", relu, size_string(s) + " hwc",
+			[&](int path) { relu.set_layout(path == 1 ? layout_t::HWC : layout_t::CHW); }, "chw", results);
+	}
+
+	for (const fc_shape& s : fc_shapes) {
+		FullConnected fc({ s.in, 1, 1 }, s.out, activation_t::Tanh);
+		std::stringstream shape;
+		shape << s.in << "->" << s.out;
+		bench_layer(opt, "fc", fc, shape.str(), results);
+		bench_fc_simd(opt, fc, shape.str(), results);
+	}
+}
+
+// 28x28x1 -> conv 5x5x8 -> relu -> 2x2 max pool -> 10 sigmoid outputs
+static std::vector<layer*> small_cnn(activation_t output = activation_t::Sigmoid)
+{
+	return {
+		new ConvLayer(1, 5, 8, { 28, 28, 1 }),
+		new ReluLayer({ 24, 24, 8 }),
+		new PoolingLayer(2, 2, { 24, 24, 8 }),
+		new FullConnected({ 12, 12, 8 }, 10, output),
+	};
+}
+
+// 32x32x3 -> two 3x3x16 convs -> pool -> two 3x3x32 convs -> pool -> 10 softmax
+// outputs, each conv followed by a relu
+static std::vector<layer*> deep_cnn()
+{
+	return {
+		new ConvLayer(1, 3, 16, { 32, 32, 3 }),
+		new ReluLayer({ 30, 30, 16 }),
+		new ConvLayer(1, 3, 16, { 30, 30, 16 }),
+		new ReluLayer({ 28, 28, 16 }),
+		new PoolingLayer(2, 2, { 28, 28, 16 }),
+		new ConvLayer(1, 3, 32, { 14, 14, 16 }),
+		new ReluLayer({ 12, 12, 32 }),
+		new ConvLayer(1, 3, 32, { 12, 12, 32 }),
+		new ReluLayer({ 10, 10, 32 }),
+		new PoolingLayer(2, 2, { 10, 10, 32 }),
+		new FullConnected({ 5, 5, 32 }, 10, activation_t::Softmax),
+	};
+}
+
+static void bench_training(const options& opt, std::vector<result>& results)
+{
+	const int nr_samples = opt.quick ? 64 : 256;
+	const std::string shape = "28x28x1 c5x8 relu pool2 fc10";
+
+	srand(1);
+	std::vector<tensor<float>> inputs;
+	std::vector<tensor<float>> expected;
+	std::vector<image_sample> samples;
+
+	for (int i = 0; i < nr_samples; i++) {
+		inputs.emplace_back(28, 28, 1);
+		expected.emplace_back(10, 1, 1);
+		fill_random(inputs.back()._data, 28 * 28);
+		memset(expected.back()._data, 0, 10 * sizeof(float));
+		expected.back()._data[i % 10] = 1.0f;
+
+		image_sample sample;
+		sample.image_shape = { 28, 28, 1 };
+		sample.data.assign(28, std::vector<std::vector<float>>(28, std::vector<float>(1)));
+		for (int x = 0; x < 28; x++) {
+			for (int y = 0; y < 28; y++) {
+				sample.data[x][y][0] = inputs.back()(x, y, 0);
+			}
+		}
+		sample.expected.assign(expected.back()._data, expected.back()._data + 10);
+		samples.push_back(sample);
+	}
+
+	// the same samples as a shard, for epochs that stream them from disk
+	std::string shard_path = (std::filesystem::temp_directory_path() / "sharpnet_benchmark.shard").string();
+	shard_dataset shard;
+
+	if (selected(opt, "cnn/train_epoch") && (!save_shard(memory_dataset(samples), shard_path) || !shard.add_shard(shard_path))) {
+		std::cerr << "can't write " << shard_path << std::endl;
+	}
+
+	std::vector<layer*> probe = small_cnn();
+	double flops_per_sample = 0.0;
+	for (layer* l : probe) {
+		flops_per_sample += 3 * forward_flops(*l);
+		delete l;
+	}
+
+	std::vector<int> thread_counts = { 1 };
+	if (opt.nr_threads > 1) {
+		thread_counts.push_back(opt.nr_threads);
+	}
+
+	int batch_size = 32;
+	const char* simd = simd_name(simd_level());
+
+	for (int nr_threads : thread_counts) {
+		for (layout_t layout : { layout_t::CHW, layout_t::HWC }) {
+			std::string layout_shape = layout == layout_t::HWC ? shape + " hwc" : shape;
+
+			if (selected(opt, "cnn/train_step")) {
+				SharPNetConv net(small_cnn(), loss_t::MeanSquaredError, 0.01f);
+				net.set_layout(layout);
+				net.prepare_training(batch_size, nr_threads);
+
+				std::vector<tensor<float>> batch(inputs.begin(), inputs.begin() + batch_size);
+				std::vector<tensor<float>> batch_expected(expected.begin(), expected.begin() + batch_size);
+
+				measurement m = measure(opt, [&] { net.train_batch(batch, batch_expected); });
+				results.push_back({ "cnn/train_step", layout_shape, simd, batch_size, nr_threads, m, (double)batch_size, flops_per_sample * batch_size });
+
+				if (!opt.trace.empty() && layout == layout_t::CHW && nr_threads == thread_counts.back() && !net.save_trace(opt.trace)) {
+					std::cerr << "can't write " << opt.trace << std::endl;
+				}
+			}
+
+			if (selected(opt, "cnn/train_epoch")) {
+				SharPNetConv net(small_cnn(), loss_t::MeanSquaredError, 0.01f);
+				net.set_layout(layout);
+
+				measurement m = measure(opt, [&] { net.train(samples, 1, batch_size, nr_threads); });
+				results.push_back({ "cnn/train_epoch", layout_shape, simd, batch_size, nr_threads, m, (double)nr_samples, flops_per_sample * nr_samples });
+
+				if (shard.size() == samples.size()) {
+					SharPNetConv streamed(small_cnn(), loss_t::MeanSquaredError, 0.01f);
+					streamed.set_layout(layout);
+
+					m = measure(opt, [&] { streamed.train(shard, 1, batch_size, nr_threads); });
+					results.push_back({ "cnn/train_epoch", layout_shape + " shard", simd, batch_size, nr_threads, m, (double)nr_samples, flops_per_sample * nr_samples });
+				}
+
+				// shuffled, cropped and flipped on two workers of their own
+				if (layout == layout_t::CHW) {
+					pipeline_options pipeline;
+					pipeline.nr_workers = 2;
+					pipeline.shuffle = true;
+					pipeline.augment.crop_padding = 2;
+					pipeline.augment.flip = true;
+
+					SharPNetConv augmented(small_cnn(), loss_t::MeanSquaredError, 0.01f);
+					augmented.set_pipeline(pipeline);
+
+					m = measure(opt, [&] { augmented.train(samples, 1, batch_size, nr_threads); });
+					results.push_back({ "cnn/train_epoch", layout_shape + " augment", simd, batch_size, nr_threads, m, (double)nr_samples, flops_per_sample * nr_samples });
+				}
+			}
+		}
+	}
+
+	shard = shard_dataset();
+	std::filesystem::remove(shard_path);
+}
+
+// One SharPNet epoch per iteration, from a narrow net up to wide hidden layers
+static void bench_mlp(const options& opt, std::vector<result>& results)
+{
+	if (!selected(opt, "mlp/train_epoch")) {
+		return;
+	}
+
+	const int nr_samples = opt.quick ? 64 : 256;
+	std::vector<std::vector<int>> topologies = {
+		{ 64, 128, 10 },
+		{ 784, 1024, 10 },
+		{ 1024, 1024, 1024, 10 },
+	};
+
+	if (opt.quick) {
+		topologies.resize(2);
+	}
+
+	for (std::vector<int>& topology : topologies) {
+		int nr_inputs = topology.front();
+		int nr_outputs = topology.back();
+
+		std::vector<std::vector<float>> inputs(nr_samples, std::vector<float>(nr_inputs));
+		std::vector<std::vector<float>> outputs(nr_samples, std::vector<float>(nr_outputs, 0.0f));
+
+		for (int i = 0; i < nr_samples; i++) {
+			fill_random(inputs[i].data(), nr_inputs);
+			outputs[i][i % nr_outputs] = 1.0f;
+		}
+
+		// every weight, bias included, is used once forward and twice backward
+		std::stringstream shape;
+		double flops = 0.0;
+
+		for (unsigned int i = 0; i < topology.size(); i++) {
+			shape << (i > 0 ? "-" : "") << topology[i];
+
+			if (i > 0) {
+				flops += 3 * 2.0 * (topology[i - 1] + 1) * topology[i];
+			}
+		}
+
+		SharPNet net(topology, activation_t::Sigmoid);
+		measurement m = measure(opt, [&] { net.train(inputs, outputs, 1); });
+		results.push_back({ "mlp/train_epoch", shape.str(), simd_name(simd_level()), 1, 1, m, (double)nr_samples, flops * nr_samples });
+	}
+}
+
+// Deterministic samples drawn from their index: random inputs, each with a one
+// hot expected output of class index % classes
+class random_dataset : public dataset
+{
+private:
+	size_t _size;
+	td_size _input_size;
+	int _classes;
+
+public:
+	random_dataset(size_t size, td_size input_size, int classes) : _size(size), _input_size(input_size), _classes(classes) { }
+
+	size_t size() const { return _size; }
+	td_size input_size() const { return _input_size; }
+	td_size output_size() const { return { _classes, 1, 1 }; }
+
+	void read(size_t index, float* input, float* expected) const
+	{
+		random_stream rng(7, 0, index);
+
+		for (int i = 0; i < volume(_input_size); i++) {
+			input[i] = (rng.next() >> 40) / float(1 << 24) - 0.5f;
+		}
+
+		for (int i = 0; i < _classes; i++) {
+			expected[i] = i == (int)(index % _classes) ? 1.0f : 0.0f;
+		}
+	}
+};
+
+static int argmax(tensor_view<float> output)
+{
+	int count = volume(output._size);
+	return (int)(std::max_element(output._data, output._data + count) - output._data);
+}
+
+// fp32 against int8 inference of a compiled model, and the largest difference
+// between their outputs over the samples of data
+static void bench_quantized(const options& opt, const std::string& kind, const SharPNetModel& model,
+	const SharPNetQuantizedModel& quantized, const dataset& data, const std::string& shape, double flops,
+	std::vector<result>& results)
+{
+	model_workspace workspace = model.create_workspace();
+	quantized_workspace quantized_workspace = quantized.create_workspace();
+	td_size in_size = data.input_size();
+	td_size out_size = data.output_size();
+	tensor<float> input(in_size._x, in_size._y, in_size._z);
+	tensor<float> expected(out_size._x, out_size._y, out_size._z);
+	tensor<float> reference(model.get_output_size()._x, model.get_output_size()._y, model.get_output_size()._z);
+
+	double diff = 0.0;
+	size_t agreeing = 0;
+
+	for (size_t i = 0; i < data.size(); i++) {
+		data.read(i, input._data, expected._data);
+		copy_view(model.predict(input, workspace), tensor_view<float>(reference));
+		tensor_view<float> output = quantized.predict(input, quantized_workspace);
+
+		for (int j = 0; j < volume(reference._size); j++) {
+			diff = std::max(diff, (double)std::fabs(output._data[j] - reference._data[j]));
+		}
+
+		agreeing += argmax(output) == argmax(reference);
+	}
+
+	data.read(0, input._data, expected._data);
+
+	measurement m = measure(opt, [&] { model.predict(input, workspace); });
+	results.push_back({ kind, shape, simd_name(simd_level()), 1, 1, m, 1.0, flops });
+
+	m = measure(opt, [&] { quantized.predict(input, quantized_workspace); });
+	results.push_back({ kind, shape, int8_name(int8_level()), 1, 1, m, 1.0, flops, diff, "fp32", (double)agreeing / data.size() });
+}
+
+// Single-sample inference of int8 post-training quantized convolutions and of
+// the small CNN against the fp32 model they come from
+static void bench_int8(const options& opt, std::vector<result>& results)
+{
+	struct conv_shape { td_size in; int filter_dem; int stride; int nr_filters; };
+
+	std::vector<conv_shape> conv_shapes = {
+		{ { 28, 28, 1 }, 5, 1, 8 },
+		{ { 32, 32, 16 }, 3, 1, 32 },
+		{ { 56, 56, 64 }, 3, 1, 64 },
+		{ { 16, 16, 64 }, 1, 1, 64 },
+	};
+
+	if (opt.quick) {
+		conv_shapes.resize(2);
+	}
+
+	const size_t nr_calibration = opt.quick ? 16 : 64;
+
+	if (selected(opt, "int8/conv")) {
+		for (const conv_shape& s : conv_shapes) {
+			ConvLayer conv(s.stride, s.filter_dem, s.nr_filters, s.in);
+			SharPNetModel model({ &conv });
+			random_dataset data(nr_calibration, s.in, 1);
+			SharPNetQuantizedModel quantized(model, data);
+
+			std::stringstream shape;
+			shape << size_string(s.in) << " k" << s.filter_dem << " s" << s.stride << " f" << s.nr_filters;
+			bench_quantized(opt, "int8/conv", model, quantized, data, shape.str(), forward_flops(conv), results);
+		}
+	}
+
+	if (selected(opt, "int8/cnn")) {
+		const std::string shape = "28x28x1 c5x8 relu pool2 fc10";
+		random_dataset train(opt.quick ? 128 : 512, { 28, 28, 1 }, 10);
+		random_dataset calibration(nr_calibration, { 28, 28, 1 }, 10);
+
+		SharPNetConv net(small_cnn(), loss_t::MeanSquaredError, 0.01f);
+		net.train(train, opt.quick ? 2 : 5, 32, 1);
+
+		SharPNetModel model = net.compile();
+		SharPNetQuantizedModel quantized = net.quantize(calibration);
+
+		double flops = 0.0;
+		for (const layer* l : model.get_layers()) {
+			flops += forward_flops(*l);
+		}
+
+		bench_quantized(opt, "int8/cnn", model, quantized, train, shape, flops, results);
+		results[results.size() - 2].accuracy = net.evaluate(train);
+		results.back().accuracy = net.evaluate(train, quantized);
+	}
+}
+
+// Bytes of the activations one predict() writes out whole and the next step
+// reads back: every step's output but the last, and the convolution output a
+// fused Winograd layer buffers before pooling it. A fused band stays in cache.
+static double intermediate_bytes(const SharPNetModel& model)
+{
+	const std::vector<const layer*>& layers = model.get_layers();
+	double bytes = 0.0;
+
+	for (const model_step& step : model.get_steps()) {
+		if (step._last + 1 < layers.size()) {
+			bytes += 2.0 * sizeof(float) * volume(layers[step._last]->get_output_size());
+		}
+
+		const ConvLayer* conv = static_cast<const ConvLayer*>(layers[step._first]);
+		if (step.fused() && step._epilogue.pool_dem > 0 && conv->uses_winograd()) {
+			bytes += 2.0 * sizeof(float) * volume(conv->get_output_size());
+		}
+	}
+
+	return bytes;
+}
+
+// Conv -> relu -> max pool chains run layer by layer and fused, see
+// SharPNetModel, in both layouts
+static void bench_fusion(const options& opt, std::vector<result>& results)
+{
+	struct chain_shape { td_size in; int filter_dem; int nr_filters; };
+
+	std::vector<chain_shape> chain_shapes = {
+		{ { 28, 28, 1 }, 5, 8 },
+		{ { 56, 56, 16 }, 3, 32 },
+		{ { 112, 112, 16 }, 3, 64 },
+	};
+
+	if (opt.quick) {
+		chain_shapes.resize(2);
+	}
+
+	if (!selected(opt, "fusion/conv_relu_pool")) {
+		return;
+	}
+
+	for (const chain_shape& s : chain_shapes) {
+		for (layout_t layout : { layout_t::CHW, layout_t::HWC }) {
+			ConvLayer conv(1, s.filter_dem, s.nr_filters, s.in);
+			ReluLayer relu(conv.get_output_size());
+			PoolingLayer pool(2, 2, conv.get_output_size());
+
+			conv.set_layout(layout);
+			relu.set_layout(layout);
+			pool.set_layout(layout);
+
+			std::stringstream shape;
+			shape << size_string(s.in) << " k" << s.filter_dem << " f" << s.nr_filters << " relu pool2"
+				<< (layout == layout_t::HWC ? " hwc" : "") << (conv.uses_winograd() ? " winograd" : "");
+
+			std::vector<const layer*> chain = { &conv, &relu, &pool };
+			SharPNetModel unfused(chain, false);
+			SharPNetModel fused(chain, true);
+			model_workspace unfused_workspace = unfused.create_workspace();
+			model_workspace fused_workspace = fused.create_workspace();
+
+			tensor<float> input(s.in._x, s.in._y, s.in._z);
+			fill_random(input._data, volume(s.in));
+
+			std::vector<float> reference(volume(pool.get_output_size()));
+			tensor_view<float> expected = unfused.predict(input, unfused_workspace);
+			std::copy(expected._data, expected._data + reference.size(), reference.begin());
+
+			tensor_view<float> output = fused.predict(input, fused_workspace);
+			double diff = max_abs_diff(reference, std::vector<float>(output._data, output._data + reference.size()));
+
+			measurement m = measure(opt, [&] { unfused.predict(input, unfused_workspace); });
+			results.push_back({ "fusion/conv_relu_pool", shape.str() + " unfused", simd_name(simd_level()), 1, 1, m, 1.0, forward_flops(conv) });
+			results.back().workspace_bytes = (double)unfused_workspace._memory.size_in_bytes();
+			results.back().intermediate_bytes = intermediate_bytes(unfused);
+
+			m = measure(opt, [&] { fused.predict(input, fused_workspace); });
+			results.push_back({ "fusion/conv_relu_pool", shape.str() + " fused", simd_name(simd_level()), 1, 1, m, 1.0, forward_flops(conv), diff, "unfused" });
+			results.back().workspace_bytes = (double)fused_workspace._memory.size_in_bytes();
+			results.back().intermediate_bytes = intermediate_bytes(fused);
+		}
+	}
+}
+
+// Every optimizer the network can train with, made at a given learning rate
+struct optimizer_kind
+{
+	const char* name;
+	float learning_rate;
+	std::unique_ptr<optimizer> (*make)(float learning_rate);
+};
+
+static const optimizer_kind optimizer_kinds[] = {
+	{ "sgd", 0.01f, [](float lr) { return std::unique_ptr<optimizer>(new sgd_optimizer(lr)); } },
+	{ "nesterov", 0.01f, [](float lr) { return std::unique_ptr<optimizer>(new sgd_optimizer(lr, MOMENTUM, WEIGHT_DECAY, true)); } },
+	{ "rmsprop", 0.001f, [](float lr) { return std::unique_ptr<optimizer>(new rmsprop_optimizer(lr)); } },
+	{ "adam", 0.001f, [](float lr) { return std::unique_ptr<optimizer>(new adam_optimizer(lr)); } },
+	{ "adamw", 0.001f, [](float lr) { return std::unique_ptr<optimizer>(new adamw_optimizer(lr)); } },
+};
+
+// Samples a network can learn: noise with a bright 6x6 patch whose position
+// gives the class, drawn from their index and seed
+class pattern_dataset : public dataset
+{
+private:
+	size_t _size;
+	uint64_t _seed;
+
+public:
+	pattern_dataset(size_t size, uint64_t seed) : _size(size), _seed(seed) { }
+
+	size_t size() const { return _size; }
+	td_size input_size() const { return { 28, 28, 1 }; }
+	td_size output_size() const { return { 10, 1, 1 }; }
+
+	void read(size_t index, float* input, float* expected) const
+	{
+		random_stream rng(_seed, 0, index);
+		int label = (int)(index % 10);
+
+		for (int i = 0; i < 28 * 28; i++) {
+			input[i] = ((rng.next() >> 40) / float(1 << 24) - 0.5f) * 0.5f;
+		}
+
+		int x0 = 1 + (label % 5) * 5;
+		int y0 = 4 + (label / 5) * 12;
+		for (int y = y0; y < y0 + 6; y++) {
+			for (int x = x0; x < x0 + 6; x++) {
+				input[y * 28 + x] += 1.0f;
+			}
+		}
+
+		for (int i = 0; i < 10; i++) {
+			expected[i] = i == label ? 1.0f : 0.0f;
+		}
+	}
+};
+
+// One step of every optimizer on a large FullConnected layer under every SIMD
+// level, which is a pass over weights, gradients and state, and how long the
+// small CNN trains under each until it classifies held out samples well
+static void bench_optimizers(const options& opt, std::vector<result>& results)
+{
+	simd_t detected = detect_simd();
+
+	if (selected(opt, "optimizer/step")) {
+		FullConnected fc({ 4096, 1, 1 }, opt.quick ? 256 : 1024, activation_t::Sigmoid);
+		int count = fc.weight_count();
+		float* weights = fc.get_weights()._data;
+
+		std::vector<float> initial(weights, weights + count);
+		std::vector<float> grads(count);
+		fill_random(grads.data(), grads.size());
+		fc.set_weight_grads(grads.data(), 1.0f);
+
+		std::stringstream shape;
+		shape << count << " weights";
+
+		std::vector<simd_t> levels;
+		for (simd_t level : { simd_t::Scalar, simd_t::AVX2, simd_t::AVX512 }) {
+			if ((int)level <= (int)detected) {
+				levels.push_back(level);
+			}
+		}
+
+		for (const optimizer_kind& kind : optimizer_kinds) {
+			std::vector<float> reference;
+
+			for (simd_t level : levels) {
+				set_simd_level(level);
+
+				// a few steps from the same weights, against the scalar ones
+				std::copy(initial.begin(), initial.end(), weights);
+				std::unique_ptr<optimizer> o = kind.make(kind.learning_rate);
+				o->add_layer(&fc);
+				for (int i = 0; i < 3; i++) {
+					o->step();
+				}
+
+				std::vector<float> updated(weights, weights + count);
+				if (reference.empty()) {
+					reference = updated;
+				}
+
+				// the samples of a row are the weights updated
+				measurement m = measure(opt, [&] { o->step(); });
+				results.push_back({ "optimizer/step", shape.str() + " " + kind.name, simd_name(level), 1, 1, m,
+					(double)count, 0.0, max_abs_diff(reference, updated), "scalar" });
+			}
+		}
+
+		set_simd_level(detected);
+	}
+
+	// Time to a test accuracy rather than how far a fixed number of epochs
+	// gets: the network trains an epoch at a time and is evaluated on samples
+	// it doesn't train on after each, outside the timing. Softmax outputs with
+	// crossentropy, sigmoid outputs of this network saturate and stall short
+	// of any useful accuracy under every optimizer.
+	if (selected(opt, "optimizer/convergence")) {
+		const std::string shape = "28x28x1 c5x8 relu pool2 fc10 softmax";
+		const int max_epochs = opt.quick ? 8 : 20;
+		const double target = opt.quick ? 0.90 : 0.95;
+		pattern_dataset train(1024, 11);
+		pattern_dataset test(256, 12);
+
+		for (const optimizer_kind& kind : optimizer_kinds) {
+			srand(1);
+			SharPNetConv net(small_cnn(activation_t::Softmax), loss_t::CategoricalCrossentropy);
+			net.set_optimizer(kind.make(kind.learning_rate));
+
+			double ns = 0.0;
+			double to_target = -1;
+			int epochs = 0;
+			evaluation metrics;
+
+			while (epochs < max_epochs && to_target < 0) {
+				auto start = std::chrono::steady_clock::now();
+				net.train(train, 1, 32, 1);
+				ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+				epochs++;
+
+				metrics = net.evaluate(test, evaluation_options());
+				if (metrics.accuracy() >= target) {
+					to_target = ns * 1e-9;
+				}
+			}
+
+			// a row is one epoch, timed over all of them
+			measurement m = { epochs, ns / epochs, 0.0 };
+			results.push_back({ "optimizer/convergence", shape + " " + kind.name, simd_name(detected), 32, 1, m, (double)train.size(), 0.0 });
+			results.back().accuracy = 100.0 * metrics.accuracy();
+			results.back().loss = metrics.mean_loss();
+			results.back().target_accuracy = 100.0 * target;
+			results.back().seconds_to_target = to_target;
+		}
+	}
+}
+
+// Single sample inference of convolutions and pooling layers with their loops
+// split across the intra-op pool, against the same layer on one thread
+static void bench_intra_op(const options& opt, std::vector<result>& results)
+{
+	struct conv_shape { td_size in; int filter_dem; int nr_filters; };
+
+	std::vector<conv_shape> conv_shapes = {
+		{ { 28, 28, 1 }, 5, 8 },
+		{ { 56, 56, 32 }, 3, 64 },
+		{ { 112, 112, 16 }, 3, 32 },
+		{ { 7, 7, 256 }, 3, 256 },
+	};
+
+	std::vector<td_size> pool_shapes = { { 24, 24, 8 }, { 112, 112, 64 } };
+
+	if (opt.quick) {
+		conv_shapes.resize(2);
+		pool_shapes.resize(1);
+	}
+
+	std::vector<int> thread_counts = { 1 };
+	if (opt.nr_threads > 1) {
+		thread_counts.push_back(opt.nr_threads);
+	}
+
+	auto bench = [&](const std::string& kind, layer& l, const std::string& shape) {
+		if (!selected(opt, kind)) {
+			return;
+		}
+
+		std::unique_ptr<layer_context> ctx = l.create_context();
+		arena memory;
+		memory.plan([&](arena& a) { l.plan(*ctx, a, 1, false); });
+
+		std::vector<float> input(volume(l.get_input_size()));
+		fill_random(input.data(), input.size());
+		tensor_view<float> in(input.data(), l.get_input_size(), l.get_layout());
+
+		std::vector<float> reference(volume(l.get_output_size()));
+		std::vector<float> out(reference.size());
+		tensor_view<float> out_view(out.data(), l.get_output_size(), l.get_layout());
+
+		for (int nr_threads : thread_counts) {
+			set_intra_op_threads(nr_threads);
+			l.infer(in, out_view, *ctx);
+
+			if (nr_threads == 1) {
+				reference = out;
+			}
+
+			measurement m = measure(opt, [&] { l.infer(in, out_view, *ctx); });
+			results.push_back({ kind, shape, simd_name(simd_level()), 1, nr_threads, m, 1.0, forward_flops(l),
+				max_abs_diff(reference, out), "1 thread" });
+		}
+	};
+
+	for (const conv_shape& s : conv_shapes) {
+		for (layout_t layout : { layout_t::CHW, layout_t::HWC }) {
+			ConvLayer conv(1, s.filter_dem, s.nr_filters, s.in);
+			conv.set_layout(layout);
+
+			std::stringstream shape;
+			shape << size_string(s.in) << " k" << s.filter_dem << " f" << s.nr_filters
+				<< (layout == layout_t::HWC ? " hwc" : "") << (conv.uses_winograd() ? " winograd" : "");
+			bench("intra_op/conv", conv, shape.str());
+		}
+	}
+
+	for (td_size s : pool_shapes) {
+		for (layout_t layout : { layout_t::CHW, layout_t::HWC }) {
+			PoolingLayer pool(2, 2, s);
+			pool.set_layout(layout);
+			bench("intra_op/pool", pool, size_string(s) + " pool2" + (layout == layout_t::HWC ? " hwc" : ""));
+		}
+	}
+
+	set_intra_op_threads(1);
+}
+
+// Training steps of a deeper CNN with its workspace planned from the buffers'
+// lifetimes and with a buffer apart for each. Both start from the same weights,
+// and the difference is in the weights after a few steps.
+static void bench_memory_plan(const options& opt, std::vector<result>& results)
+{
+	if (!selected(opt, "memory_plan/train_step")) {
+		return;
+	}
+
+	const std::string shape = "32x32x3 c3x16 relu c3x16 relu pool2 c3x32 relu c3x32 relu pool2 fc10";
+	int batch_size = 16;
+
+	std::vector<tensor<float>> inputs;
+	std::vector<tensor<float>> expected;
+	for (int i = 0; i < batch_size; i++) {
+		inputs.emplace_back(32, 32, 3);
+		expected.emplace_back(10, 1, 1);
+		fill_random(inputs.back()._data, 32 * 32 * 3);
+		memset(expected.back()._data, 0, 10 * sizeof(float));
+		expected.back()._data[i % 10] = 1.0f;
+	}
+
+	double flops_per_sample = 0.0;
+	for (layer* l : deep_cnn()) {
+		flops_per_sample += 3 * forward_flops(*l);
+		delete l;
+	}
+
+	std::vector<float> reference;
+
+	for (bool share : { false, true }) {
+		srand(1);
+		SharPNetConv net(deep_cnn(), loss_t::CategoricalCrossentropy, 0.01f);
+		net.share_workspace_memory(share);
+		net.prepare_training(batch_size, 1);
+
+		for (int step = 0; step < 3; step++) {
+			net.train_batch(inputs, expected);
+		}
+
+		std::vector<float> weights;
+		SharPNetModel model = net.compile();
+		for (const layer* l : model.get_layers()) {
+			tensor_view<float> w = l->get_weights();
+			weights.insert(weights.end(), w._data, w._data + l->weight_count());
+		}
+
+		if (reference.empty()) {
+			reference = weights;
+		}
+
+		measurement m = measure(opt, [&] { net.train_batch(inputs, expected); });
+		results.push_back({ "memory_plan/train_step", shape + (share ? " shared" : " unshared"), simd_name(simd_level()),
+			batch_size, 1, m, (double)batch_size, flops_per_sample * batch_size, max_abs_diff(reference, weights), "unshared" });
+		results.back().workspace_bytes = (double)net.workspace_bytes();
+	}
+}
+
+// 64x64x3 -> eight 3x3x16 convs, each followed by a relu -> 10 softmax outputs
+static std::vector<layer*> conv_stack()
+{
+	std::vector<layer*> layers;
+	td_size size = { 64, 64, 3 };
+
+	for (int i = 0; i < 8; i++) {
+		layers.push_back(new ConvLayer(1, 3, 16, size));
+		size = layers.back()->get_output_size();
+		layers.push_back(new ReluLayer(size));
+	}
+
+	layers.push_back(new FullConnected(size, 10, activation_t::Softmax));
+	return layers;
+}
+
+// Training steps of a deep conv stack keeping the outputs of every k-th layer
+// only, against keeping all of them: the workspace and the heap a network
+// holds once it has trained a step, and the time a step takes. The weights
+// after a few steps are the same for every k.
+static void bench_checkpointing(const options& opt, std::vector<result>& results)
+{
+	if (!selected(opt, "checkpoint/train_step")) {
+		return;
+	}
+
+	const std::string shape = "64x64x3 8x(c3x16 relu) fc10";
+	int batch_size = 8;
+
+	std::vector<tensor<float>> inputs;
+	std::vector<tensor<float>> expected;
+	for (int i = 0; i < batch_size; i++) {
+		inputs.emplace_back(64, 64, 3);
+		expected.emplace_back(10, 1, 1);
+		fill_random(inputs.back()._data, 64 * 64 * 3);
+		memset(expected.back()._data, 0, 10 * sizeof(float));
+		expected.back()._data[i % 10] = 1.0f;
+	}
+
+	double flops_per_sample = 0.0;
+	for (layer* l : conv_stack()) {
+		flops_per_sample += 3 * forward_flops(*l);
+		delete l;
+	}
+
+	std::vector<float> reference;
+
+	for (int every : { 0, 2, 4, 8 }) {
+		long long before = heap_bytes();
+
+		srand(1);
+		SharPNetConv net(conv_stack(), loss_t::CategoricalCrossentropy, 0.01f);
+		net.set_checkpointing(every);
+		net.prepare_training(batch_size, 1);
+
+		for (int step = 0; step < 2; step++) {
+			net.train_batch(inputs, expected);
+		}
+
+		long long held = heap_bytes() - before;
+
+		std::vector<float> weights;
+		double weight_bytes = 0.0;
+		SharPNetModel model = net.compile();
+		for (const layer* l : model.get_layers()) {
+			tensor_view<float> w = l->get_weights();
+			weights.insert(weights.end(), w._data, w._data + l->weight_count());
+			weight_bytes += sizeof(float) * l->weight_count();
+		}
+
+		if (reference.empty()) {
+			reference = weights;
+		}
+
+		measurement m = measure(opt, [&] { net.train_batch(inputs, expected); });
+		results.push_back({ "checkpoint/train_step", shape + (every > 0 ? " every " + std::to_string(every) : " off"),
+			simd_name(simd_level()), batch_size, 1, m, (double)batch_size, flops_per_sample * batch_size,
+			max_abs_diff(reference, weights), "off" });
+		results.back().workspace_bytes = (double)net.workspace_bytes();
+		results.back().resident_bytes = held >= 0 ? (double)held : -1;
+		results.back().weight_bytes = weight_bytes;
+	}
+}
+
+// 28x28x1 -> conv 5x5x8 -> relu -> 2x2 max pool -> 512 relu -> 10 softmax outputs
+static std::vector<layer*> wide_cnn()
+{
+	return {
+		new ConvLayer(1, 5, 8, { 28, 28, 1 }),
+		new ReluLayer({ 24, 24, 8 }),
+		new PoolingLayer(2, 2, { 24, 24, 8 }),
+		new FullConnected({ 12, 12, 8 }, 512, activation_t::Relu),
+		new FullConnected({ 512, 1, 1 }, 10, activation_t::Softmax),
+	};
+}
+
+// Training steps under Adam that save the network every few steps: as text,
+// as a checkpoint written before training goes on, and as one written in the
+// background, against steps that save nothing. The resume row trains two
+// epochs with shuffling and augmentation in one go and in two runs resumed
+// from the checkpoint of the first epoch, which have to end with the same
+// weights.
+static void bench_training_checkpoints(const options& opt, std::vector<result>& results)
+{
+	const std::string shape = "28x28x1 c5x8 relu pool2 fc512 fc10 adam";
+	const char* simd = simd_name(simd_level());
+	std::filesystem::path directory = std::filesystem::temp_directory_path();
+	std::string text_path = (directory / "sharpnet_benchmark.txt").string();
+	std::string checkpoint_path = (directory / "sharpnet_benchmark.checkpoint").string();
+
+	int batch_size = 32;
+	pattern_dataset data(opt.quick ? 256 : 1024, 13);
+
+	if (selected(opt, "train_checkpoint/step")) {
+		std::vector<tensor<float>> inputs;
+		std::vector<tensor<float>> expected;
+		for (int i = 0; i < batch_size; i++) {
+			inputs.emplace_back(28, 28, 1);
+			expected.emplace_back(10, 1, 1);
+			data.read(i, inputs.back()._data, expected.back()._data);
+		}
+
+		SharPNetConv net(wide_cnn(), loss_t::MeanSquaredError);
+		net.set_optimizer(std::unique_ptr<optimizer>(new adam_optimizer(0.001f)));
+		net.prepare_training(batch_size, 1);
+
+		// a save every few steps, like a long run would
+		const int save_every = 8;
+		struct save_kind { const char* name; std::function<void()> save; };
+		std::vector<save_kind> kinds = {
+			{ "no saves", [] { } },
+			{ "save text every 8", [&] { net.save(text_path); } },
+			{ "save checkpoint every 8", [&] { net.save_checkpoint(checkpoint_path); net.wait_for_checkpoints(); } },
+			{ "save checkpoint async every 8", [&] { net.save_checkpoint(checkpoint_path); } },
+		};
+
+		for (const save_kind& kind : kinds) {
+			int step = 0;
+			measurement m = measure(opt, [&] {
+				net.train_batch(inputs, expected);
+
+				if (++step % save_every == 0) {
+					kind.save();
+				}
+			});
+			net.wait_for_checkpoints();
+
+			results.push_back({ "train_checkpoint/step", shape + " " + kind.name, simd, batch_size, 1, m, (double)batch_size, 0.0 });
+		}
+	}
+
+	if (selected(opt, "train_checkpoint/resume")) {
+		pipeline_options pipeline;
+		pipeline.shuffle = true;
+		pipeline.seed = 5;
+		pipeline.augment.crop_padding = 2;
+
+		std::vector<float> weights[2];
+		std::vector<std::pair<float, float>> history[2];
+		measurement m;
+
+		for (int run = 0; run < 2; run++) {
+			srand(1);
+			SharPNetConv net(wide_cnn(), loss_t::MeanSquaredError);
+			net.set_optimizer(std::unique_ptr<optimizer>(new adam_optimizer(0.001f)));
+			net.set_pipeline(pipeline);
+
+			if (run == 0) {
+				net.train(data, 2, batch_size, 1);
+			}
+			else {
+				// the first epoch saves a checkpoint, which a new network resumes from
+				{
+					srand(1);
+					SharPNetConv first(wide_cnn(), loss_t::MeanSquaredError);
+					first.set_optimizer(std::unique_ptr<optimizer>(new adam_optimizer(0.001f)));
+					first.set_pipeline(pipeline);
+					first.set_checkpoint_file(checkpoint_path);
+					first.train(data, 1, batch_size, 1);
+
+					if (!first.wait_for_checkpoints()) {
+						std::cerr << "can't write " << checkpoint_path << std::endl;
+						return;
+					}
+				}
+
+				m = measure(opt, [&] { net.resume(checkpoint_path); });
+				net.train(data, 1, batch_size, 1);
+			}
+
+			SharPNetModel model = net.compile();
+			for (const layer* l : model.get_layers()) {
+				tensor_view<float> w = l->get_weights();
+				weights[run].insert(weights[run].end(), w._data, w._data + l->weight_count());
+			}
+			history[run] = net.train(data, 0, batch_size, 1);
+		}
+
+		std::stringstream epochs;
+		epochs << " " << history[1].size() << " epochs" << (history[0] == history[1] ? "" : " history differs");
+
+		results.push_back({ "train_checkpoint/resume", shape + epochs.str(), simd, batch_size, 1, m, 1.0, 0.0,
+			max_abs_diff(weights[0], weights[1]), "uninterrupted" });
+	}
+
+	std::filesystem::remove(text_path);
+	std::filesystem::remove(checkpoint_path);
+}
+
+// A network read back from its binary file for training and for inference
+// only, serving single samples from a workspace of its compiled model: one
+// activation per step against two ping-pong buffers
+// A network saved in binary and loaded both for training and inference only,
+// timed on a single sample. The heap each load holds and the outputs of the
+// two have to agree.
+static void bench_serve(const options& opt, const std::string& shape, std::vector<layer*> topology, std::vector<result>& results)
+{
+	std::string path = (std::filesystem::temp_directory_path() / "sharpnet_benchmark.model").string();
+	td_size in_size = topology.front()->get_input_size();
+
+	double weight_bytes = 0.0;
+	{
+		SharPNetConv trained(topology, loss_t::CategoricalCrossentropy);
+
+		if (!trained.save_binary(path)) {
+			std::cerr << "can't write " << path << std::endl;
+			return;
+		}
+
+		SharPNetModel model = trained.compile();
+		for (const layer* l : model.get_layers()) {
+			weight_bytes += sizeof(float) * l->weight_count();
+		}
+	}
+
+	tensor<float> input(in_size._x, in_size._y, in_size._z);
+	fill_random(input._data, volume(in_size));
+
+	std::vector<float> reference;
+
+	for (bool inference_only : { false, true }) {
+		long long before = heap_bytes();
+
+		SharPNetConv net;
+		if (!net.load_binary(path, inference_only)) {
+			std::cerr << "can't read " << path << std::endl;
+			break;
+		}
+
+		SharPNetModel model = net.compile();
+		model_workspace workspace = model.create_workspace(!inference_only);
+		long long held = heap_bytes() - before;
+
+		tensor_view<float> output = model.predict(input, workspace);
+		std::vector<float> values(output._data, output._data + volume(output._size));
+		if (reference.empty()) {
+			reference = values;
+		}
+
+		double diff = max_abs_diff(reference, values);
+		check("inference/serve " + shape, diff, 0.0);
+
+		measurement m = measure(opt, [&] { model.predict(input, workspace); });
+		results.push_back({ "inference/serve", shape + (inference_only ? " inference only" : " training"), simd_name(simd_level()),
+			1, 1, m, 1.0, 0.0, diff, "training" });
+		results.back().workspace_bytes = (double)workspace._memory.size_in_bytes();
+		results.back().intermediate_bytes = intermediate_bytes(model);
+		results.back().resident_bytes = held >= 0 ? (double)held : -1;
+		results.back().weight_bytes = weight_bytes;
+	}
+
+	std::filesystem::remove(path);
+}
+
+// load_binary() has to turn down a file whose first record says something no
+// layer can be made of, rather than make the layer from it
+static void check_corrupt_records()
+{
+	std::string path = (std::filesystem::temp_directory_path() / "sharpnet_corrupt.model").string();
+	std::vector<char> bytes;
+	{
+		SharPNetConv net({ new ConvLayer(1, 3, 4, { 8, 8, 1 }), new FullConnected({ 6, 6, 4 }, 10, activation_t::Sigmoid) },
+			loss_t::MeanSquaredError);
+
+		if (!net.save_binary(path)) {
+			std::cerr << "can't write " << path << std::endl;
+			return;
+		}
+
+		std::ifstream in(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	// the untouched file first, which has to load
+	struct corruption { const char* name; void (*apply)(layer_record& record); };
+	const corruption corruptions[] = {
+		{ "no corruption", [](layer_record&) { } },
+		{ "filter_dem above the input", [](layer_record& r) { r.filter_dem = r.in_size[0] + 1; } },
+		{ "filter_dem out of range", [](layer_record& r) { r.filter_dem = 65536 + 3; } },
+		{ "stride 0", [](layer_record& r) { r.stride = 0; } },
+		{ "input volume overflows int", [](layer_record& r) { r.in_size[0] = r.in_size[1] = 65536; } },
+	};
+
+	for (size_t i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); i++) {
+		std::vector<char> corrupt = bytes;
+		layer_record record;
+		memcpy(&record, corrupt.data() + sizeof(model_header), sizeof(record));
+		corruptions[i].apply(record);
+		memcpy(corrupt.data() + sizeof(model_header), &record, sizeof(record));
+
+		std::ofstream(path, std::ios::binary | std::ios::trunc).write(corrupt.data(), corrupt.size());
+
+		SharPNetConv net;
+		check(std::string("load_binary with ") + corruptions[i].name, net.load_binary(path) == (i == 0));
+	}
+
+	std::filesystem::remove(path);
+}
+
+// Reloading an inference-only network for training keeps the optimizer it
+// was given, learning rate included, rather than starting a default one
+static void check_reload_keeps_optimizer()
+{
+	std::string path = (std::filesystem::temp_directory_path() / "sharpnet_reload.model").string();
+	SharPNetConv net({ new ConvLayer(1, 3, 4, { 8, 8, 1 }), new FullConnected({ 6, 6, 4 }, 10, activation_t::Sigmoid) },
+		loss_t::MeanSquaredError);
+	net.set_optimizer(std::unique_ptr<optimizer>(new adam_optimizer(0.003f)));
+
+	if (!net.save_binary(path)) {
+		std::cerr << "can't write " << path << std::endl;
+		return;
+	}
+
+	bool loaded = net.load_binary(path, true) && net.load_binary(path);
+	check("load_binary after inference only", loaded && !net.is_inference_only());
+	check("optimizer kept after inference only", loaded && dynamic_cast<adam_optimizer*>(&net.get_optimizer()) != nullptr
+		&& net.get_optimizer().get_learning_rate() == 0.003f);
+
+	std::filesystem::remove(path);
+}
+
+static void bench_inference_only(const options& opt, std::vector<result>& results)
+{
+	if (!selected(opt, "inference/serve")) {
+		return;
+	}
+
+	check_corrupt_records();
+	check_reload_keeps_optimizer();
+
+	bench_serve(opt, "64x64x3 c3x32 relu c3x32 relu pool2 c3x64 relu c3x64 relu pool2 fc10", {
+		new ConvLayer(1, 3, 32, { 64, 64, 3 }),
+		new ReluLayer({ 62, 62, 32 }),
+		new ConvLayer(1, 3, 32, { 62, 62, 32 }),
+		new ReluLayer({ 60, 60, 32 }),
+		new PoolingLayer(2, 2, { 60, 60, 32 }),
+		new ConvLayer(1, 3, 64, { 30, 30, 32 }),
+		new ReluLayer({ 28, 28, 64 }),
+		new ConvLayer(1, 3, 64, { 28, 28, 64 }),
+		new ReluLayer({ 26, 26, 64 }),
+		new PoolingLayer(2, 2, { 26, 26, 64 }),
+		new FullConnected({ 13, 13, 64 }, 10, activation_t::Softmax),
+	}, results);
+
+	// a convolution nothing is fused into, which plans its patch matrix itself
+	ConvLayer* unfused = new ConvLayer(1, 3, 8, { 16, 16, 3 });
+	unfused->use_winograd(false);
+
+	bench_serve(opt, "16x16x3 c3x8 fc10", {
+		unfused,
+		new FullConnected({ 14, 14, 8 }, 10, activation_t::Softmax),
+	}, results);
+}
+
+// Largest difference between the metrics of two evaluations, the counts of
+// the confusion matrix included
+static double evaluation_diff(const evaluation& a, const evaluation& b)
+{
+	double diff = std::fabs(a.mean_loss() - b.mean_loss());
+	diff = std::max(diff, std::fabs(a.accuracy() - b.accuracy()));
+	diff = std::max(diff, std::fabs(a.top_k_accuracy() - b.top_k_accuracy()));
+
+	for (size_t i = 0; i < a._confusion.size() && i < b._confusion.size(); i++) {
+		diff = std::max(diff, std::fabs((double)a._confusion[i] - (double)b._confusion[i]));
+	}
+
+	return a._confusion.size() == b._confusion.size() ? diff : INFINITY;
+}
+
+// A pass over a holdout set: the smoothed accuracy of evaluate(), one sample
+// after the other, against the streamed metrics of evaluate(options) on one
+// and on opt.nr_threads threads. Their metrics are checked against a plain
+// loop that adds every sample to a single evaluation in order.
+static void bench_evaluation(const options& opt, std::vector<result>& results)
+{
+	if (!selected(opt, "evaluate/holdout")) {
+		return;
+	}
+
+	const std::string shape = "32x32x3 c3x16 relu c3x16 relu pool2 c3x32 relu c3x32 relu pool2 fc10";
+	random_dataset holdout(opt.quick ? 64 : 512, { 32, 32, 3 }, 10);
+
+	double flops_per_sample = 0.0;
+	for (layer* l : deep_cnn()) {
+		flops_per_sample += forward_flops(*l);
+		delete l;
+	}
+
+	srand(1);
+	SharPNetConv net(deep_cnn(), loss_t::CategoricalCrossentropy, 0.01f);
+	double samples = (double)holdout.size();
+
+	evaluation_options eval;
+	eval.batch_size = 64;
+	eval.top_k = 3;
+
+	evaluation reference(10, eval.top_k);
+	{
+		SharPNetModel model = net.compile();
+		model_workspace workspace = model.create_workspace();
+		tensor<float> input(32, 32, 3);
+		tensor<float> expected(10, 1, 1);
+
+		for (size_t i = 0; i < holdout.size(); i++) {
+			holdout.read(i, input._data, expected._data);
+			tensor_view<float> output = model.predict(input, workspace);
+			reference.add(output._data, expected._data, sample_loss(loss_t::CategoricalCrossentropy, output._data, expected._data, 10));
+		}
+	}
+
+	measurement m = measure(opt, [&] { net.evaluate(holdout); });
+	results.push_back({ "evaluate/holdout", shape + " smoothed", simd_name(simd_level()), 1, 1, m, samples, flops_per_sample * samples });
+	results.back().accuracy = net.evaluate(holdout);
+
+	std::vector<int> thread_counts = { 1 };
+	if (opt.nr_threads > 1) {
+		thread_counts.push_back(opt.nr_threads);
+	}
+
+	for (int nr_threads : thread_counts) {
+		eval.nr_threads = nr_threads;
+		evaluation metrics = net.evaluate(holdout, eval);
+
+		m = measure(opt, [&] { net.evaluate(holdout, eval); });
+		results.push_back({ "evaluate/holdout", shape + " streamed top3", simd_name(simd_level()), eval.batch_size, nr_threads, m,
+			samples, flops_per_sample * samples, evaluation_diff(reference, metrics), "sequential" });
+		results.back().accuracy = metrics.accuracy() * 100;
+		results.back().loss = metrics.mean_loss();
+	}
+}
+
+static void write_json(std::ostream& out, const options& opt, const std::vector<result>& results)
+{
+	out << "{\n";
+	out << "  \"simd\": \"" << simd_name(detect_simd()) << "\",\n";
+	out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "  \"quick\": " << (opt.quick ? "true" : "false") << ",\n";
+	out << "  \"results\": [\n";
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const result& r = results[i];
+		double seconds = r.time.ns_per_iteration * 1e-9;
+
+		out << "    {";
+		out << "\"name\": \"" << r.name << "\", ";
+		out << "\"shape\": \"" << r.shape << "\", ";
+		out << "\"simd\": \"" << r.simd << "\", ";
+		out << "\"batch\": " << r.batch << ", ";
+		out << "\"threads\": " << r.threads << ", ";
+		out << "\"iterations\": " << r.time.iterations << ", ";
+		out << "\"ns_per_iter\": " << r.time.ns_per_iteration << ", ";
+
+		if (r.samples_per_iteration > 0) {
+			out << "\"samples_per_sec\": " << r.samples_per_iteration / seconds << ", ";
+		}
+		else {
+			out << "\"samples_per_sec\": null, ";
+		}
+
+		if (r.flops_per_iteration > 0) {
+			out << "\"gflops\": " << r.flops_per_iteration / seconds * 1e-9 << ", ";
+		}
+		else {
+			out << "\"gflops\": null, ";
+		}
+
+		if (r.max_abs_diff >= 0) {
+			out << "\"max_abs_diff\": " << r.max_abs_diff << ", ";
+			out << "\"reference\": \"" << r.reference << "\", ";
+		}
+
+		if (r.agreement >= 0) {
+			out << "\"argmax_agreement\": " << r.agreement << ", ";
+		}
+
+		if (r.accuracy >= 0) {
+			out << "\"accuracy\": " << r.accuracy << ", ";
+		}
+
+		if (r.workspace_bytes >= 0) {
+			out << "\"workspace_bytes\": " << r.workspace_bytes << ", ";
+			out << "\"intermediate_bytes\": " << r.intermediate_bytes << ", ";
+		}
+
+		if (r.resident_bytes >= 0) {
+			out << "\"resident_bytes\": " << r.resident_bytes << ", ";
+			out << "\"weight_bytes\": " << r.weight_bytes << ", ";
+		}
+
+		if (r.loss >= 0) {
+			out << "\"loss\": " << r.loss << ", ";
+		}
+
+		if (r.target_accuracy >= 0) {
+			out << "\"target_accuracy\": " << r.target_accuracy << ", ";
+			out << "\"seconds_to_target\": ";
+			if (r.seconds_to_target >= 0) {
+				out << r.seconds_to_target << ", ";
+			}
+			else {
+				out << "null, ";
+			}
+		}
+
+		out << "\"allocs_per_iter\": " << r.time.allocations_per_iteration;
+		out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+
+	out << "  ]\n";
+	out << "}\n";
+}
+
+int main(int argc, char** argv)
+{
+	options opt;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--quick") {
+			opt.quick = true;
+			opt.min_time = 0.02;
+			opt.min_iterations = 2;
+		}
+		else if (arg == "--filter" && has_value) {
+			opt.filter = argv[++i];
+		}
+		else if (arg == "--min-time" && has_value) {
+			opt.min_time = atof(argv[++i]);
+		}
+		else if (arg == "--batch" && has_value) {
+			opt.batch_size = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--threads" && has_value) {
+			opt.nr_threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--output" && has_value) {
+			opt.output = argv[++i];
+		}
+		else if (arg == "--trace" && has_value) {
+			opt.trace = argv[++i];
+		}
+		else {
+			std::cerr << "usage: " << argv[0] << " [--quick] [--filter text] [--min-time seconds]"
+				" [--batch n] [--threads n] [--output file] [--trace file]" << std::endl;
+			return 1;
+		}
+	}
+
+	// every row but the intra_op ones times layers on a single thread
+	set_intra_op_threads(1);
+
+	std::vector<result> results;
+	bench_layers(opt, results);
+	bench_training(opt, results);
+	bench_mlp(opt, results);
+	bench_int8(opt, results);
+	bench_fusion(opt, results);
+	bench_optimizers(opt, results);
+	bench_intra_op(opt, results);
+	bench_inference_only(opt, results);
+	bench_memory_plan(opt, results);
+	bench_checkpointing(opt, results);
+	bench_training_checkpoints(opt, results);
+	bench_evaluation(opt, results);
+
+	if (opt.output.empty()) {
+		write_json(std::cout, opt, results);
+		return failures > 0 ? 1 : 0;
+	}
+
+	std::ofstream out(opt.output);
+	if (!out.is_open()) {
+		std::cerr << "can't write " << opt.output << std::endl;
+		return 1;
+	}
+
+	write_json(out, opt, results);
+	return failures > 0 ? 1 : 0;
+}
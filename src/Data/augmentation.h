@@ -0,0 +1,93 @@
+#ifndef AUGMENTATION_H
+#define AUGMENTATION_H
+
+#include <cstdint>
+#include <vector>
+#include "../Layers/tensor.h"
+
+// splitmix64: tiny, fast, and the same stream on every platform and standard
+// library, which std::shuffle and the <random> distributions don't promise
+struct random_stream
+{
+	uint64_t _state;
+
+	explicit random_stream(uint64_t seed) { _state = seed; }
+
+	// Independent stream for the given position of the stream seeded with seed
+	random_stream(uint64_t seed, uint64_t a, uint64_t b)
+	{
+		_state = seed;
+		_state = next() ^ a;
+		_state = next() ^ b;
+	}
+
+	uint64_t next()
+	{
+		uint64_t z = (_state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	// in [0, n), n > 0
+	uint64_t below(uint64_t n) { return next() % n; }
+};
+
+// Fisher-Yates over order with the given stream
+inline void shuffle_order(std::vector<size_t>& order, random_stream& rng)
+{
+	for (size_t i = order.size(); i > 1; i--) {
+		std::swap(order[i - 1], order[rng.below(i)]);
+	}
+}
+
+// Random transformations of an input image, applied in this order:
+//
+//   crop       shift the image by up to crop_padding pixels along x and y and
+//              fill the uncovered border with zeros, the same as padding it
+//              by crop_padding and cropping the original size back out
+//   flip       mirror it along x, every other sample on average
+//   normalize  (value - mean[c]) / std[c] for every channel c, skipped when
+//              mean is empty
+struct augmentation
+{
+	int crop_padding = 0;
+	bool flip = false;
+	std::vector<float> mean;
+	std::vector<float> std;
+
+	bool enabled() const { return crop_padding > 0 || flip || !mean.empty(); }
+};
+
+// Writes the augmented copy of sample to out, both dense CHW tensors of the
+// given size, drawing the random choices from rng
+inline void augment(const augmentation& options, const float* sample, float* out, td_size size, random_stream& rng)
+{
+	assert(options.mean.empty() || ((int)options.mean.size() == size._z && options.std.size() == options.mean.size()));
+
+	int pad = options.crop_padding;
+	int dx = pad > 0 ? (int)rng.below(2 * pad + 1) - pad : 0;
+	int dy = pad > 0 ? (int)rng.below(2 * pad + 1) - pad : 0;
+	bool flip = options.flip && (rng.next() & 1);
+
+	for (int z = 0; z < size._z; z++) {
+		float scale = options.mean.empty() ? 1.0f : 1.0f / options.std[z];
+		float shift = options.mean.empty() ? 0.0f : -options.mean[z] * scale;
+		const float* plane = sample + z * size._x * size._y;
+		float* to = out + z * size._x * size._y;
+
+		for (int y = 0; y < size._y; y++) {
+			int from_y = y + dy;
+
+			for (int x = 0; x < size._x; x++) {
+				int from_x = (flip ? size._x - 1 - x : x) + dx;
+				bool inside = from_x >= 0 && from_x < size._x && from_y >= 0 && from_y < size._y;
+				float value = inside ? plane[from_y * size._x + from_x] : 0.0f;
+
+				to[y * size._x + x] = value * scale + shift;
+			}
+		}
+	}
+}
+
+#endif // !AUGMENTATION_H
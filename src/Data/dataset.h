@@ -0,0 +1,283 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../IO/dataset_format.h"
+#include "../Layers/tensor.h"
+#include "../Memory/mapped_file.h"
+
+struct image_sample
+{
+	td_size image_shape;
+	std::vector<std::vector<std::vector<float>>> data;
+	std::vector<float> expected;
+};
+
+// A source of training samples of one fixed shape. Samples are only ever read
+// one at a time into memory the caller owns, so a dataset doesn't have to fit
+// in memory. read() is called from the prefetcher's workers, several of them
+// at once, so it must not change the dataset.
+class dataset
+{
+public:
+	virtual ~dataset() { }
+
+	virtual size_t size() const = 0;
+	virtual td_size input_size() const = 0;
+	virtual td_size output_size() const = 0;
+
+	// Writes sample index to input and expected in CHW order. They hold the
+	// floats of input_size() and output_size().
+	virtual void read(size_t index, float* input, float* expected) const = 0;
+};
+
+// The samples of a vector, which has to outlive the dataset. Every read
+// converts one sample from its nested vectors.
+class memory_dataset : public dataset
+{
+private:
+	const std::vector<image_sample>& _samples;
+	td_size _input_size;
+	td_size _output_size;
+
+public:
+	explicit memory_dataset(const std::vector<image_sample>& samples) : _samples(samples)
+	{
+		_input_size = { 0, 0, 0 };
+		_output_size = { 0, 0, 0 };
+
+		if (!samples.empty()) {
+			const image_sample& first = samples.front();
+			_input_size = { (int)first.data.size(), (int)first.data[0].size(), (int)first.data[0][0].size() };
+			_output_size = { (int)first.expected.size(), 1, 1 };
+		}
+	}
+
+	size_t size() const override { return _samples.size(); }
+	td_size input_size() const override { return _input_size; }
+	td_size output_size() const override { return _output_size; }
+
+	void read(size_t index, float* input, float* expected) const override
+	{
+		const image_sample& sample = _samples[index];
+		tensor_view<float> to(input, _input_size);
+
+		for (int x = 0; x < _input_size._x; x++) {
+			for (int y = 0; y < _input_size._y; y++) {
+				for (int z = 0; z < _input_size._z; z++) {
+					to(x, y, z) = sample.data[x][y][z];
+				}
+			}
+		}
+
+		memcpy(expected, sample.expected.data(), _output_size._x * sizeof(float));
+	}
+};
+
+// Samples stored in one or more shard files, see IO/dataset_format.h. Shards
+// are mapped rather than read, so a sample costs a copy out of the page cache,
+// pages are only read from disk when a sample on them is first used, and the
+// kernel is free to drop them again: the files can be larger than memory.
+class shard_dataset : public dataset
+{
+private:
+	struct shard
+	{
+		std::unique_ptr<mapped_file> _file;
+		const float* _samples;
+		size_t _first;	// index of the shard's first sample in the dataset
+	};
+
+	std::vector<shard> _shards;
+	td_size _input_size;
+	td_size _output_size;
+	size_t _size;
+
+public:
+	shard_dataset()
+	{
+		_input_size = { 0, 0, 0 };
+		_output_size = { 0, 0, 0 };
+		_size = 0;
+	}
+
+	// Appends the samples of a shard. Returns false, changing nothing, when the
+	// file isn't a valid shard or its shapes differ from the shards before it.
+	bool add_shard(const std::string& filepath);
+
+	size_t size() const override { return _size; }
+	td_size input_size() const override { return _input_size; }
+	td_size output_size() const override { return _output_size; }
+
+	void read(size_t index, float* input, float* expected) const override;
+};
+
+// Writes a shard one sample at a time, so a dataset never has to be in memory
+// as a whole to be converted. The sample count in the header is only filled in
+// by close(); a shard that wasn't closed doesn't load.
+class shard_writer
+{
+private:
+	std::ofstream _file;
+	dataset_header _header;
+	size_t _input_count;
+	size_t _output_count;
+
+public:
+	shard_writer()
+	{
+		memset(&_header, 0, sizeof(_header));
+		_input_count = 0;
+		_output_count = 0;
+	}
+
+	~shard_writer() { close(); }
+
+	bool open(const std::string& filepath, td_size input_size, td_size output_size);
+
+	// input and expected in CHW order
+	bool write(const float* input, const float* expected);
+	bool close();
+};
+
+// Every sample of a dataset into one shard
+inline bool save_shard(const dataset& data, const std::string& filepath)
+{
+	td_size in_size = data.input_size();
+	td_size out_size = data.output_size();
+	std::vector<float> input((size_t)in_size._x * in_size._y * in_size._z);
+	std::vector<float> expected((size_t)out_size._x * out_size._y * out_size._z);
+
+	shard_writer writer;
+
+	if (!writer.open(filepath, in_size, out_size)) { return false; }
+
+	for (size_t i = 0; i < data.size(); i++) {
+		data.read(i, input.data(), expected.data());
+
+		if (!writer.write(input.data(), expected.data())) { return false; }
+	}
+
+	return writer.close();
+}
+
+inline bool shard_dataset::add_shard(const std::string& filepath)
+{
+	if (!is_little_endian()) { return false; }
+
+	std::unique_ptr<mapped_file> file(new mapped_file());
+
+	if (!file->open(filepath) || file->size() < sizeof(dataset_header)) { return false; }
+
+	dataset_header header;
+	memcpy(&header, file->data(), sizeof(header));
+
+	td_size in_size = { header.input_size[0], header.input_size[1], header.input_size[2] };
+	td_size out_size = { header.output_size[0], header.output_size[1], header.output_size[2] };
+
+	if (memcmp(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0 ||
+		header.version != DATASET_VERSION ||
+		in_size._x <= 0 || in_size._y <= 0 || in_size._z <= 0 ||
+		out_size._x <= 0 || out_size._y <= 0 || out_size._z <= 0) {
+		return false;
+	}
+
+	uint64_t sample_size = ((uint64_t)in_size._x * in_size._y * in_size._z +
+		(uint64_t)out_size._x * out_size._y * out_size._z) * sizeof(float);
+
+	if (header.nr_samples > (file->size() - sizeof(dataset_header)) / sample_size ||
+		file->size() != sizeof(dataset_header) + header.nr_samples * sample_size) {
+		return false;
+	}
+
+	if (!_shards.empty() && (in_size._x != _input_size._x || in_size._y != _input_size._y ||
+		in_size._z != _input_size._z || out_size._x != _output_size._x ||
+		out_size._y != _output_size._y || out_size._z != _output_size._z)) {
+		return false;
+	}
+
+	shard s;
+	s._samples = reinterpret_cast<const float*>(file->data() + sizeof(dataset_header));
+	s._first = _size;
+	s._file = std::move(file);
+
+	_shards.push_back(std::move(s));
+	_input_size = in_size;
+	_output_size = out_size;
+	_size += header.nr_samples;
+	return true;
+}
+
+inline void shard_dataset::read(size_t index, float* input, float* expected) const
+{
+	assert(index < _size);
+
+	// the last shard starting at or before index
+	auto next = std::upper_bound(_shards.begin(), _shards.end(), index,
+		[](size_t i, const shard& s) { return i < s._first; });
+	const shard& s = *(next - 1);
+
+	size_t input_count = (size_t)_input_size._x * _input_size._y * _input_size._z;
+	size_t output_count = (size_t)_output_size._x * _output_size._y * _output_size._z;
+	const float* sample = s._samples + (index - s._first) * (input_count + output_count);
+
+	memcpy(input, sample, input_count * sizeof(float));
+	memcpy(expected, sample + input_count, output_count * sizeof(float));
+}
+
+inline bool shard_writer::open(const std::string& filepath, td_size input_size, td_size output_size)
+{
+	close();
+
+	if (!is_little_endian()) { return false; }
+
+	_file.open(filepath, std::ios::binary | std::ios::trunc);
+
+	if (!_file.is_open()) { return false; }
+
+	memset(&_header, 0, sizeof(_header));
+	memcpy(_header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+	_header.version = DATASET_VERSION;
+	_header.input_size[0] = input_size._x;
+	_header.input_size[1] = input_size._y;
+	_header.input_size[2] = input_size._z;
+	_header.output_size[0] = output_size._x;
+	_header.output_size[1] = output_size._y;
+	_header.output_size[2] = output_size._z;
+
+	_input_count = (size_t)input_size._x * input_size._y * input_size._z;
+	_output_count = (size_t)output_size._x * output_size._y * output_size._z;
+
+	// the header is written again with the sample count by close()
+	_file.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+	return !_file.fail();
+}
+
+inline bool shard_writer::write(const float* input, const float* expected)
+{
+	if (!_file.is_open()) { return false; }
+
+	_file.write(reinterpret_cast<const char*>(input), _input_count * sizeof(float));
+	_file.write(reinterpret_cast<const char*>(expected), _output_count * sizeof(float));
+	_header.nr_samples++;
+
+	return !_file.fail();
+}
+
+inline bool shard_writer::close()
+{
+	if (!_file.is_open()) { return false; }
+
+	_file.seekp(0);
+	_file.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+	_file.close();
+
+	return !_file.fail();
+}
+
+#endif // !DATASET_H
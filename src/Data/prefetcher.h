@@ -0,0 +1,299 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "augmentation.h"
+#include "dataset.h"
+
+// Mini-batch of samples read from a dataset, as dense CHW views into memory
+// the prefetcher owns
+struct sample_batch
+{
+	std::vector<float> _memory;
+	std::vector<tensor_view<float>> _inputs;
+	std::vector<tensor_view<float>> _expected;
+};
+
+// How a prefetcher prepares the mini-batches. The defaults read the dataset in
+// order, untouched, on one thread.
+struct pipeline_options
+{
+	int nr_workers = 1;
+
+	// mini-batches that can be ready or in the works at once, at least 2 and
+	// by default one more than there are workers
+	int queue_depth = 0;
+
+	// every epoch in a new order, drawn from seed and the epoch alone
+	bool shuffle = false;
+	uint64_t seed = 0;
+
+	augmentation augment;
+};
+
+// Reads the mini-batches of nr_epochs passes over a dataset on threads of its
+// own, so reading, decoding and augmenting samples overlaps with training
+// instead of adding to it. The passes are epochs first_epoch and on, so a run
+// that resumes where another stopped gets the batches it would have.
+//
+// The batches of a run are numbered, and batch k goes into slot k % depth of a
+// ring of preallocated batches. A worker takes the next number, fills its slot
+// once the trainer has handed back batch k - depth, and publishes it; next()
+// hands out the slots in number order. Every slot carries a sequence number
+// that says which of these it is in, so neither side takes a lock to pass a
+// batch on. Numbers are taken from an atomic counter, so taking one doesn't
+// lock either. The order of an epoch and the random choices for every sample
+// are drawn from the seed, the epoch and the sample's place in the epoch, so
+// the batches are the same however many workers there are.
+//
+// Shuffled epochs take turns in two orders. The worker that takes the first
+// batch of an epoch draws its order once every batch of the epoch two before
+// has copied its samples' indices out, and the other batches of the epoch
+// wait for it to be published, again by a sequence number. Only they ever
+// wait, and only at the start of an epoch.
+class prefetcher
+{
+private:
+	struct slot
+	{
+		// k: free for batch k, k + 1: batch k is ready
+		std::atomic<size_t> _sequence;
+		sample_batch _batch;
+	};
+
+	const dataset& _data;
+	pipeline_options _options;
+	int _batch_size;
+	int _nr_epochs;
+	size_t _first_epoch;
+	size_t _batches_per_epoch;
+	size_t _nr_batches;
+
+	std::unique_ptr<slot[]> _slots;
+	size_t _depth;
+	size_t _consumed;	// batches next() has handed out
+	bool _holding;		// the caller still holds batch _consumed - 1
+
+	std::atomic<size_t> _next_batch;
+
+	// The order of the epochs with an even and odd number in the run. _drawn:
+	// e + 1 once the order of epoch e is published, _copied: batches of that
+	// epoch that took their indices from it
+	std::vector<size_t> _orders[2];
+	std::atomic<size_t> _drawn[2];
+	std::atomic<size_t> _copied[2];
+
+	std::atomic<bool> _stop;
+	std::vector<std::thread> _workers;
+
+	bool claim(size_t& number, std::vector<size_t>& indices);
+	void run();
+
+public:
+	prefetcher(const dataset& data, int batch_size, int nr_epochs, const pipeline_options& options = pipeline_options(),
+		size_t first_epoch = 0);
+	~prefetcher();
+
+	prefetcher(const prefetcher&) = delete;
+	prefetcher& operator=(const prefetcher&) = delete;
+
+	// The next mini-batch, the last one of an epoch holding what is left of
+	// the dataset, or nullptr once every epoch has been read. The batch stays
+	// valid until the next call.
+	const sample_batch* next();
+};
+
+// Spins briefly, then yields, then sleeps, so a side that waits long doesn't
+// take a core from the threads it waits for
+inline void backoff(int& attempt)
+{
+	if (attempt < 64) {
+		attempt++;
+	}
+	else if (attempt < 128) {
+		attempt++;
+		std::this_thread::yield();
+	}
+	else {
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+}
+
+inline prefetcher::prefetcher(const dataset& data, int batch_size, int nr_epochs, const pipeline_options& options,
+	size_t first_epoch)
+	: _data(data), _options(options)
+{
+	_options.nr_workers = std::max(_options.nr_workers, 1);
+	_batch_size = std::max(batch_size, 1);
+	_nr_epochs = std::max(nr_epochs, 0);
+	_first_epoch = first_epoch;
+	_batches_per_epoch = (data.size() + _batch_size - 1) / _batch_size;
+	_nr_batches = _batches_per_epoch * _nr_epochs;
+
+	_depth = _options.queue_depth > 0 ? _options.queue_depth : _options.nr_workers + 1;
+	_depth = std::max<size_t>(_depth, 2);
+	_slots.reset(new slot[_depth]);
+
+	td_size in_size = data.input_size();
+	td_size out_size = data.output_size();
+	size_t sample_size = (size_t)in_size._x * in_size._y * in_size._z + (size_t)out_size._x * out_size._y * out_size._z;
+
+	for (size_t i = 0; i < _depth; i++) {
+		_slots[i]._sequence.store(i, std::memory_order_relaxed);
+		_slots[i]._batch._memory.resize(sample_size * _batch_size);
+		_slots[i]._batch._inputs.reserve(_batch_size);
+		_slots[i]._batch._expected.reserve(_batch_size);
+	}
+
+	_consumed = 0;
+	_holding = false;
+	_next_batch = 0;
+	_stop = false;
+
+	for (int i = 0; i < 2; i++) {
+		_orders[i].resize(_options.shuffle ? data.size() : 0);
+		_drawn[i] = 0;
+		_copied[i] = _batches_per_epoch;
+	}
+
+	for (int i = 0; i < _options.nr_workers; i++) {
+		_workers.emplace_back(&prefetcher::run, this);
+	}
+}
+
+inline prefetcher::~prefetcher()
+{
+	_stop = true;
+
+	for (std::thread& worker : _workers) {
+		worker.join();
+	}
+}
+
+inline bool prefetcher::claim(size_t& number, std::vector<size_t>& indices)
+{
+	number = _next_batch.fetch_add(1, std::memory_order_relaxed);
+
+	if (number >= _nr_batches) {
+		return false;
+	}
+
+	size_t run_epoch = number / _batches_per_epoch;
+	size_t start = number % _batches_per_epoch * _batch_size;
+	size_t count = std::min<size_t>(_batch_size, _data.size() - start);
+
+	indices.resize(count);
+
+	if (!_options.shuffle) {
+		for (size_t i = 0; i < count; i++) {
+			indices[i] = start + i;
+		}
+		return true;
+	}
+
+	std::vector<size_t>& order = _orders[run_epoch % 2];
+
+	if (start == 0) {
+		// the batches of the epoch two before are done with the order
+		for (int attempt = 0; _copied[run_epoch % 2].load(std::memory_order_acquire) != _batches_per_epoch; backoff(attempt)) {
+			if (_stop) { return false; }
+		}
+
+		_copied[run_epoch % 2].store(0, std::memory_order_relaxed);
+
+		random_stream rng(_options.seed, 0, _first_epoch + run_epoch);
+
+		for (size_t i = 0; i < order.size(); i++) {
+			order[i] = i;
+		}
+
+		shuffle_order(order, rng);
+		_drawn[run_epoch % 2].store(run_epoch + 1, std::memory_order_release);
+	}
+	else {
+		for (int attempt = 0; _drawn[run_epoch % 2].load(std::memory_order_acquire) != run_epoch + 1; backoff(attempt)) {
+			if (_stop) { return false; }
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		indices[i] = order[start + i];
+	}
+
+	_copied[run_epoch % 2].fetch_add(1, std::memory_order_acq_rel);
+	return true;
+}
+
+inline void prefetcher::run()
+{
+	td_size in_size = _data.input_size();
+	td_size out_size = _data.output_size();
+	int input_count = in_size._x * in_size._y * in_size._z;
+	bool augmented = _options.augment.enabled();
+
+	std::vector<size_t> indices(_batch_size);
+	std::vector<float> scratch(augmented ? input_count : 0);
+	size_t number;
+
+	while (claim(number, indices)) {
+		slot& s = _slots[number % _depth];
+
+		// the trainer hands the slot back once it is done with batch number - depth
+		for (int attempt = 0; s._sequence.load(std::memory_order_acquire) != number; backoff(attempt)) {
+			if (_stop) { return; }
+		}
+
+		sample_batch& batch = s._batch;
+		int count = (int)indices.size();
+		size_t epoch = _first_epoch + number / _batches_per_epoch;
+		size_t start = number % _batches_per_epoch * _batch_size;
+
+		// the inputs of the batch first, then its expected outputs
+		bind_views(batch._inputs, batch._memory.data(), count, in_size);
+		bind_views(batch._expected, batch._memory.data() + (size_t)input_count * _batch_size, count, out_size);
+
+		for (int i = 0; i < count; i++) {
+			if (augmented) {
+				random_stream rng(_options.seed, epoch + 1, start + i);
+
+				_data.read(indices[i], scratch.data(), batch._expected[i]._data);
+				augment(_options.augment, scratch.data(), batch._inputs[i]._data, in_size, rng);
+			}
+			else {
+				_data.read(indices[i], batch._inputs[i]._data, batch._expected[i]._data);
+			}
+		}
+
+		s._sequence.store(number + 1, std::memory_order_release);
+	}
+}
+
+inline const sample_batch* prefetcher::next()
+{
+	// the caller is done with the batch it had, its slot is free for the
+	// batch depth further on
+	if (_holding) {
+		slot& held = _slots[(_consumed - 1) % _depth];
+		held._sequence.store(_consumed - 1 + _depth, std::memory_order_release);
+		_holding = false;
+	}
+
+	if (_consumed == _nr_batches) {
+		return nullptr;
+	}
+
+	slot& s = _slots[_consumed % _depth];
+
+	for (int attempt = 0; s._sequence.load(std::memory_order_acquire) != _consumed + 1; backoff(attempt)) { }
+
+	_consumed++;
+	_holding = true;
+	return &s._batch;
+}
+
+#endif // !PREFETCHER_H
@@ -0,0 +1,46 @@
+#ifndef CHECKPOINT_FORMAT_H
+#define CHECKPOINT_FORMAT_H
+
+#include <cstdint>
+#include "model_format.h"
+
+// Binary training checkpoint, version 1:
+//
+//   checkpoint_header
+//   checkpoint_record * nr_layers
+//   the weights of every layer with weights, in layer order
+//   the optimizer's state, state_count floats, see optimizer::state()
+//   the history, nr_epochs pairs of float loss and accuracy
+//
+// Little endian throughout. Unlike a model file a checkpoint holds no shapes,
+// only what training changes; it is resumed into a network of the same layers
+// and the same optimizer, see SharPNetConv::resume().
+
+static const char CHECKPOINT_MAGIC[8] = { 'S', 'H', 'R', 'P', 'C', 'K', 'P', '\0' };
+static const uint32_t CHECKPOINT_VERSION = 1;
+
+struct checkpoint_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_layers;
+	uint64_t file_size;
+	int64_t steps;				// of the optimizer
+	uint64_t state_count;
+	uint32_t nr_epochs;
+	float learning_rate;
+	float training_accuracy;
+	uint32_t reserved;
+};
+
+struct checkpoint_record
+{
+	uint32_t type;			// layer_t
+	uint32_t reserved;
+	uint64_t weight_count;
+};
+
+static_assert(sizeof(checkpoint_header) == 56, "checkpoint_header has to match the file layout");
+static_assert(sizeof(checkpoint_record) == 16, "checkpoint_record has to match the file layout");
+
+#endif // !CHECKPOINT_FORMAT_H
@@ -0,0 +1,214 @@
+#ifndef CHECKPOINT_WRITER_H
+#define CHECKPOINT_WRITER_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Writes files on a thread of its own, so training only waits for a snapshot
+// of its state to be copied, never for the disk. Of two buffers the caller
+// fills one while the other is written; it only waits when it comes back for a
+// third before the first is on disk. Every file goes to filepath + ".tmp"
+// first, is flushed to disk and then renamed over filepath, so a crash leaves
+// either the file before or the one after, never a part of one.
+class checkpoint_writer
+{
+private:
+	struct buffer
+	{
+		std::vector<char> _bytes;
+		std::string _filepath;
+	};
+
+	buffer _buffers[2];
+	int _filling;		// the buffer begin() hands out
+	bool _pending;		// the other one waits to be written
+	bool _writing;
+	bool _failed;
+	bool _stop;
+
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::thread _thread;
+
+	void run();
+
+public:
+	checkpoint_writer();
+
+	// Writes whatever was handed over before it returns
+	~checkpoint_writer();
+
+	checkpoint_writer(const checkpoint_writer&) = delete;
+	checkpoint_writer& operator=(const checkpoint_writer&) = delete;
+
+	// The buffer to fill with the next file. It keeps its capacity, so
+	// snapshots of the same size don't allocate after the first two.
+	std::vector<char>& begin();
+
+	// Hands the buffer begin() returned over to be written to filepath
+	void commit(const std::string& filepath);
+
+	// Waits until every file handed over is written. False if writing any of
+	// them failed since the last call.
+	bool wait();
+
+	// filepath + ".tmp", flushed and renamed over filepath
+	static bool write_file(const std::string& filepath, const std::vector<char>& bytes);
+};
+
+inline checkpoint_writer::checkpoint_writer()
+{
+	_filling = 0;
+	_pending = false;
+	_writing = false;
+	_failed = false;
+	_stop = false;
+	_thread = std::thread(&checkpoint_writer::run, this);
+}
+
+inline checkpoint_writer::~checkpoint_writer()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+
+	_changed.notify_all();
+	_thread.join();
+}
+
+inline std::vector<char>& checkpoint_writer::begin()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	// the buffer is free again once the writer took the last one handed over
+	_changed.wait(lock, [this] { return !_pending; });
+	return _buffers[_filling]._bytes;
+}
+
+inline void checkpoint_writer::commit(const std::string& filepath)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_buffers[_filling]._filepath = filepath;
+		_pending = true;
+	}
+
+	_changed.notify_all();
+}
+
+inline bool checkpoint_writer::wait()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_changed.wait(lock, [this] { return !_pending && !_writing; });
+
+	bool ok = !_failed;
+	_failed = false;
+	return ok;
+}
+
+inline void checkpoint_writer::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	for (;;) {
+		_changed.wait(lock, [this] { return _stop || _pending; });
+
+		if (!_pending) {
+			return;
+		}
+
+		// the caller fills the other buffer meanwhile
+		buffer& b = _buffers[_filling];
+		_filling = 1 - _filling;
+		_pending = false;
+		_writing = true;
+		_changed.notify_all();
+
+		lock.unlock();
+		bool ok = write_file(b._filepath, b._bytes);
+		lock.lock();
+
+		_failed = _failed || !ok;
+		_writing = false;
+		_changed.notify_all();
+	}
+}
+
+#ifdef _WIN32
+
+inline bool checkpoint_writer::write_file(const std::string& filepath, const std::vector<char>& bytes)
+{
+	std::string temp = filepath + ".tmp";
+
+	std::ofstream outfile(temp, std::ios::binary | std::ios::trunc);
+	if (!outfile.is_open()) { return false; }
+
+	outfile.write(bytes.data(), bytes.size());
+	outfile.close();
+
+	if (outfile.fail()) { return false; }
+
+	return MoveFileExA(temp.c_str(), filepath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+#else
+
+inline bool checkpoint_writer::write_file(const std::string& filepath, const std::vector<char>& bytes)
+{
+	std::string temp = filepath + ".tmp";
+
+	int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) { return false; }
+
+	size_t written = 0;
+	while (written < bytes.size()) {
+		ssize_t n = ::write(fd, bytes.data() + written, bytes.size() - written);
+
+		// a signal arriving before anything was written isn't an error
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			break;
+		}
+		written += (size_t)n;
+	}
+
+	bool ok = written == bytes.size() && fsync(fd) == 0;
+	ok = ::close(fd) == 0 && ok;
+
+	if (!ok || std::rename(temp.c_str(), filepath.c_str()) != 0) {
+		std::remove(temp.c_str());
+		return false;
+	}
+
+	// the rename itself is only durable once the directory is
+	size_t slash = filepath.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : filepath.substr(0, slash + 1);
+
+	int dir = ::open(directory.c_str(), O_RDONLY);
+	if (dir >= 0) {
+		fsync(dir);
+		::close(dir);
+	}
+
+	return true;
+}
+
+#endif
+
+#endif // !CHECKPOINT_WRITER_H
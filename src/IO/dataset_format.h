@@ -0,0 +1,32 @@
+#ifndef DATASET_FORMAT_H
+#define DATASET_FORMAT_H
+
+#include <cstdint>
+#include "model_format.h"
+
+// Binary dataset shard, version 1:
+//
+//   dataset_header
+//   sample * nr_samples
+//
+// where every sample is the input tensor followed by the expected output, both
+// as little endian floats in CHW order. Samples have a fixed size, so sample i
+// starts at sizeof(dataset_header) + i * (input + output floats) * 4 and a
+// reader can map the file and point straight at it.
+
+static const char DATASET_MAGIC[8] = { 'S', 'H', 'R', 'P', 'D', 'A', 'T', '\0' };
+static const uint32_t DATASET_VERSION = 1;
+
+struct dataset_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t nr_samples;
+	int32_t input_size[3];
+	int32_t output_size[3];
+};
+
+static_assert(sizeof(dataset_header) == 48, "dataset_header has to match the file layout");
+
+#endif // !DATASET_FORMAT_H
@@ -0,0 +1,58 @@
+#ifndef MODEL_FORMAT_H
+#define MODEL_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+
+// Binary model file, version 1:
+//
+//   model_header
+//   layer_record * nr_layers
+//   weight blobs, each starting at a multiple of MODEL_ALIGNMENT bytes
+//
+// Every field and every weight is little endian. Only what inference needs is
+// stored: layer types, shapes and hyper parameters in the records, and the
+// weights of each layer as one float blob in the layer's own memory layout, so
+// a loader can point the layer straight at the blob.
+
+static const char MODEL_MAGIC[8] = { 'S', 'H', 'R', 'P', 'N', 'E', 'T', '\0' };
+static const uint32_t MODEL_VERSION = 1;
+static const uint64_t MODEL_ALIGNMENT = 64;
+
+struct model_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_layers;
+	uint64_t file_size;
+};
+
+struct layer_record
+{
+	uint32_t type;			// layer_t
+	uint32_t activation;	// activation_t, FullConnected only
+	uint32_t stride;
+	uint32_t filter_dem;
+	int32_t in_size[3];
+	int32_t out_size[3];
+	uint64_t weight_offset;	// from the start of the file, 0 without weights
+	uint64_t weight_count;
+};
+
+static_assert(sizeof(model_header) == 24, "model_header has to match the file layout");
+static_assert(sizeof(layer_record) == 56, "layer_record has to match the file layout");
+
+static bool is_little_endian()
+{
+	uint32_t probe = 1;
+	unsigned char first;
+	memcpy(&first, &probe, 1);
+	return first == 1;
+}
+
+static uint64_t align_offset(uint64_t offset)
+{
+	return (offset + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+}
+
+#endif // !MODEL_FORMAT_H
@@ -0,0 +1,49 @@
+#ifndef QUANTIZED_FORMAT_H
+#define QUANTIZED_FORMAT_H
+
+#include <cstdint>
+#include "model_format.h"
+
+// Binary quantized model file, version 1:
+//
+//   quantized_header
+//   quantized_record * nr_layers
+//   per layer with weights, in layer order:
+//     int8 weights, rows * k4
+//     float scales, rows
+//     int32 row sums, rows
+//
+// Little endian throughout. rows is out_size[0] for FullConnected layers and
+// out_size[2] for convolutions; k4 is the number of inputs of a row rounded up
+// to a multiple of 4, the padding weights zero. See SharPNetQuantizedModel.
+
+static const char QUANTIZED_MAGIC[8] = { 'S', 'H', 'R', 'P', 'Q', 'N', 'T', '\0' };
+static const uint32_t QUANTIZED_VERSION = 1;
+
+struct quantized_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_layers;
+	float input_scale;
+	int32_t input_zero_point;
+};
+
+struct quantized_record
+{
+	uint32_t type;			// layer_t
+	uint32_t activation;	// activation_t, FullConnected only
+	uint32_t stride;
+	uint32_t filter_dem;
+	int32_t in_size[3];
+	int32_t out_size[3];
+	uint32_t k4;			// 0 without weights
+	float output_scale;
+	int32_t output_zero_point;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(quantized_header) == 24, "quantized_header has to match the file layout");
+static_assert(sizeof(quantized_record) == 56, "quantized_record has to match the file layout");
+
+#endif // !QUANTIZED_FORMAT_H
@@ -1,23 +1,95 @@
 #ifndef CONVLAYER_H
 #define CONVLAYER_H
 
+#include <algorithm>
+#include <cfloat>
 #include "layer.h"
 #include "tensor.h"
 #include "../Learning/learning.h"
+#include "../Math/gemm.h"
+#include "../Math/im2col.h"
+#include "../Math/winograd.h"
+#include "../Parallel/task_pool.h"
+
+// Scratch space one thread needs to run a ConvLayer over a batch
+struct conv_context : layer_context
+{
+	float* _columns = nullptr;
+	float* _column_gradients = nullptr;
+	float* _winograd = nullptr;
+
+	// convolution rows of one band of a fused chain, see infer_fused()
+	float* _band = nullptr;
+};
+
+// Layers that follow a convolution and run fused into it at inference time:
+// a relu, and a max pooling of pool_dem x pool_dem windows, 0 for none
+struct conv_epilogue
+{
+	bool relu = false;
+	int pool_dem = 0;
+	int pool_stride = 1;
+};
+
+// Patches and output of one band of a fused chain are kept within this many
+// floats, so the band is still in L2 when the epilogue reads it back
+constexpr int FUSED_BAND_FLOATS = 64 * 1024;
 
 class ConvLayer : public layer
 {
 private:
 
-	std::vector<tensor<float>> _filters;
-	std::vector<tensor<gradient>> _filter_gradients;
+	// All filters back to back, i.e. one nr_filters x (filter_dem * filter_dem * z)
+	// matrix with a filter per row, and a view of every filter into it
+	tensor<float> _weights;
+	std::vector<tensor_view<float>> _filters;
+
+	// The gradient of every weight, in the order of _weights
+	std::vector<float> _grads;
+
+	// im2col patch matrix of the current input, see activate()
+	std::vector<float> _columns;
+
+	// Gradient of the patch matrix and the filter gradients summed over a batch
+	// in the packed filter layout, see backward()
+	std::vector<float> _column_gradients;
+	std::vector<float> _filter_grad_sum;
 
 	unsigned short _stride;
 	unsigned short _filter_dem;
 
-	point map_to_input(point output, int z);
-	range map_to_output(int x, int y);
-	int normalize_range(float f, int max, bool lim_min);
+	// 3x3 stride 1 layers run forward and the input gradients through Winograd
+	// F(2x2, 3x3), see Math/winograd.h. The transformed filters of both are
+	// kept until the weights change, see weights_changed(). A choice forced by
+	// use_winograd() is kept over layout changes instead of picked again.
+	bool _winograd;
+	bool _winograd_forced = false;
+	bool _winograd_wanted = false;
+	std::vector<float> _winograd_filters;
+	std::vector<float> _winograd_grad_filters;
+	std::vector<float> _rotated_filters;
+	std::vector<float> _winograd_scratch;
+
+	// The filters with their weights in the column order of im2col_hwc(),
+	// (j * F + i) * z + c, while the layer runs in HWC
+	std::vector<float> _hwc_filters;
+
+	void init_buffers();
+	void apply_winograd(bool enable);
+	void transform_filters();
+	size_t winograd_buffer_size() const;
+	size_t columns_size() const;
+
+	void forward(tensor_view<float> in, tensor_view<float> out, float* columns, float* winograd) const;
+	void backward(tensor_view<float> in, tensor_view<float> grad_next_layer, tensor_view<float> grads,
+		float* columns, float* column_gradients, float* filter_grad_sum, float* winograd) const;
+	void forward_hwc(tensor_view<float> in, tensor_view<float> out, float* columns) const;
+
+	int fused_band_rows(const conv_epilogue& epilogue) const;
+	void finish_band(const float* band, int band_first, int band_rows, tensor_view<float> out, int first, int rows,
+		const conv_epilogue& epilogue) const;
+	void backward_hwc(tensor_view<float> in, tensor_view<float> grad_next_layer, tensor_view<float> grads,
+		float* columns, float* column_gradients, float* filter_grad_sum) const;
 
 	void activate();
 public:
@@ -25,13 +97,56 @@ public:
 	ConvLayer(unsigned short stride, unsigned short filter_dim, unsigned short nr_filters, td_size in_size);
 	ConvLayer(const tensor<float>& input, const tensor<float>& output, const tensor<float>& input_gradients, std::vector<tensor<float>> filters, unsigned short stride, unsigned short filter_dim);
 
-	void activate(tensor<float>& in) {
-		this->_input = in;
+	// weights holds nr_filters rows of filter_dim * filter_dim * in_size._z values
+	// and may be borrowed, see tensor::borrow()
+	ConvLayer(unsigned short stride, unsigned short filter_dim, td_size in_size, tensor<float>&& weights);
+
+	void activate(tensor_view<float> in) {
+		copy_view(in, get_input());
 		activate();
 	}
 
-	void fix_weights(float learning_rate);
-	void calc_grads(tensor<float>& grad_next_layer);
+	std::unique_ptr<layer_context> create_context() const { return std::unique_ptr<layer_context>(new conv_context()); }
+	void activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const;
+	void calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const;
+	void infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const;
+	void plan(layer_context& ctx, arena& memory, int max_batch, bool training,
+		const layer_schedule& steps = layer_schedule()) const;
+
+	// infer() followed by the layers of epilogue, which run on one band of
+	// output rows at a time while it is still in cache, so the convolution's
+	// output is never written out whole. out is the output of the last fused
+	// layer, and ctx has to be planned by plan_fused() instead of plan().
+	void infer_fused(tensor_view<float> in, tensor_view<float> out, layer_context& ctx, const conv_epilogue& epilogue) const;
+	void plan_fused(layer_context& ctx, arena& memory, const conv_epilogue& epilogue) const;
+
+	int weight_count() const { return _weights._size._x * _weights._size._y; }
+	tensor_view<float> get_weights() const { return tensor_view<float>(_weights._data, _weights._size); }
+	const float* get_weight_grads() const { return _grads.data(); }
+	void weights_changed() { transform_filters(); }
+	layer_t type() const { return layer_t::Convolutional; }
+
+	unsigned short get_stride() const { return _stride; }
+	unsigned short get_filter_dem() const { return _filter_dem; }
+
+	// Winograd is on by default where it is measurably faster than im2col, and
+	// can be forced on for any 3x3 stride 1 layer or off, e.g. to compare the
+	// two. Contexts planned before have to be planned again.
+	void use_winograd(bool enable);
+	bool winograd_pays_off() const;
+	bool uses_winograd() const { return _winograd; }
+
+	// In HWC a patch row is one copy of contiguous channel vectors and the
+	// product lands in HWC directly, but there is no Winograd path. Weight
+	// gradients in a context then follow the HWC filter order too.
+	bool set_layout(layout_t layout);
+	void set_weight_grads(const float* grads, float scale);
+
+	// Also drops the patch matrices and the Winograd filters and scratch of
+	// the backward pass; what infer() reads stays
+	void set_inference_only();
+
+	void calc_grads(tensor_view<float> grad_next_layer);
 	std::string to_string();
 };
 
@@ -56,156 +171,641 @@ inline ConvLayer::ConvLayer(unsigned short stride, unsigned short filter_dem, un
 		==
 		((in_size._y - filter_dem) / stride + 1));
 
-	for (int i = 0; i < nr_filters; i++) {
-		tensor<float> tensor(filter_dem, filter_dem, in_size._z);
+	_weights = tensor<float>(filter_dem * filter_dem * in_size._z, nr_filters, 1);
+
+	// drawn before init_buffers(), which derives the Winograd filters from them
+	for (int a = 0; a < nr_filters; a++) {
+		float* filter = _weights._data + a * _weights._size._x;
 
 		for (int i = 0; i < filter_dem; i++) {
 			for (int j = 0; j < filter_dem; j++) {
 				for (int k = 0; k < in_size._z; k++) {
-					tensor(i, j, k) = ((rand() / float(RAND_MAX)) * 2) - 1;
+					filter[(k * filter_dem + j) * filter_dem + i] = ((rand() / float(RAND_MAX)) * 2) - 1;
 				}
 			}
 		}
-
-		_filters.push_back(tensor);
 	}
 
-	for (unsigned int i = 0; i < nr_filters; i++) {
-		tensor<gradient> tensor(filter_dem, filter_dem, in_size._z);
-		_filter_gradients.push_back(tensor);
-	}
+	init_buffers();
 }
 
 inline ConvLayer::ConvLayer(const tensor<float>& input, const tensor<float>& output, const tensor<float>& input_gradients,
 	std::vector<tensor<float>> filters, unsigned short stride, unsigned short filter_dem)
 {
+	int filter_size = filter_dem * filter_dem * input._size._z;
+
 	_input = input;
 	_output = output;
 	_gradients = input_gradients;
-	_filters = std::move(filters);
 	_stride = stride;
 	_filter_dem = filter_dem;
+
+	_weights = tensor<float>(filter_size, (int)filters.size(), 1);
+	for (unsigned int f = 0; f < filters.size(); f++) {
+		memcpy(_weights._data + f * filter_size, filters[f]._data, filter_size * sizeof(float));
+	}
+
+	init_buffers();
 }
 
-inline point ConvLayer::map_to_input(point output, int z)
+inline ConvLayer::ConvLayer(unsigned short stride, unsigned short filter_dem, td_size in_size, tensor<float>&& weights)
 {
-	output._x *= _stride;
-	output._y *= _stride;
-	output._z = z;
-	return output;
+	int nr_filters = weights._size._y;
+
+	assert(weights._size._x == filter_dem * filter_dem * in_size._z);
+
+	_gradients = tensor<float>(in_size._x, in_size._y, in_size._z);
+	_input = tensor<float>(in_size._x, in_size._y, in_size._z);
+	_output = tensor<float>((in_size._x - filter_dem) / stride + 1,
+		(in_size._y - filter_dem) / stride + 1,
+		nr_filters);
+
+	_stride = stride;
+	_filter_dem = filter_dem;
+	_weights = std::move(weights);
+
+	init_buffers();
 }
 
-inline range ConvLayer::map_to_output(int x, int y)
+inline void ConvLayer::init_buffers()
 {
-	float a = x;
-	float b = y;
+	int nr_filters = _weights._size._y;
+	int filter_size = _filter_dem * _filter_dem * _input._size._z;
+
+	bind_views(_filters, _weights._data, nr_filters, { _filter_dem, _filter_dem, _input._size._z });
+
+	_grads.assign((size_t)nr_filters * filter_size, 0.0f);
+
+	_columns.resize(columns_size());
+	_column_gradients.resize(columns_size());
+	_filter_grad_sum.resize(nr_filters * filter_size);
 
-	return
-	{
-		normalize_range((a - _filter_dem + 1) / _stride, _output._size._x, true),
-		normalize_range((b - _filter_dem + 1) / _stride, _output._size._y, true),
-		0,
-		normalize_range(a / _stride, _output._size._x, false),
-		normalize_range(b / _stride, _output._size._y, false),
-		(int)_filters.size() - 1
-	};
+	apply_winograd(winograd_pays_off());
 }
 
-inline int ConvLayer::normalize_range(float f, int max, bool lim_min)
+// Its 16 GEMMs run over the input channels, so with few of them the transforms
+// cost more than the saved multiplies; with many more filters than channels
+// the output transform does
+inline bool ConvLayer::winograd_pays_off() const
 {
-	if (f <= 0)
-		return 0;
+	int nr_filters = _weights._size._y;
+	int channels = _input._size._z;
 
-	max -= 1;
-	if (f >= max)
-		return max;
+	return channels >= 32 && nr_filters <= channels;
+}
 
-	if (lim_min)
-		return ceil(f);
-	else
-		return floor(f);
+inline void ConvLayer::use_winograd(bool enable)
+{
+	_winograd_forced = true;
+	_winograd_wanted = enable;
+	apply_winograd(enable);
 }
 
-inline void ConvLayer::activate()
+inline void ConvLayer::apply_winograd(bool enable)
 {
-	for (int filter = 0; filter < _filters.size(); filter++) {
-		tensor<float>& filter_data = _filters[filter];
+	_winograd = enable && _layout == layout_t::CHW && _filter_dem == 3 && _stride == 1;
 
-		for (int x = 0; x < _output._size._x; x++) {
-			for (int y = 0; y < _output._size._y; y++) {
-				point mapped = map_to_input({ (uint16_t)x, (uint16_t)y, 0 }, 0);
-				float sum = 0;
+	int nr_filters = _weights._size._y;
+	int channels = _input._size._z;
 
-				for (int i = 0; i < _filter_dem; i++) {
-					for (int j = 0; j < _filter_dem; j++) {
-						for (int z = 0; z < _input._size._z; z++) {
-							float f = filter_data(i, j, z);
-							float v = _input(mapped._x + i, mapped._y + j, z);
-							sum += f * v;
-						}
-					}
-				}
+	if (_winograd) {
+		_winograd_filters.resize(16 * nr_filters * channels);
 
-				_output(x, y, filter) = sum;
-			}
+		if (!_inference_only) {
+			_winograd_grad_filters.resize(16 * nr_filters * channels);
+			_rotated_filters.resize(9 * nr_filters * channels);
+			_winograd_scratch.resize(winograd_buffer_size());
 		}
 	}
+	else {
+		_winograd_filters.clear();
+		_winograd_grad_filters.clear();
+		_rotated_filters.clear();
+		_winograd_scratch.clear();
+	}
+
+	transform_filters();
 }
 
-inline void ConvLayer::fix_weights(float learning_rate)
+inline bool ConvLayer::set_layout(layout_t layout)
 {
-	for (int a = 0; a < _filters.size(); a++) {
-		for (int i = 0; i < _filter_dem; i++) {
-			for (int j = 0; j < _filter_dem; j++) {
-				for (int z = 0; z < _input._size._z; z++) {
-					float& weight = _filters[a].get(i, j, z);
-					gradient& grad = _filter_gradients[a].get(i, j, z);
-					weight = update_weight(weight, grad, learning_rate);
-					update_gradient(grad);
+	_layout = layout;
+
+	if (layout == layout_t::HWC) {
+		_hwc_filters.resize(_weights._size._x * _weights._size._y);
+	}
+	else {
+		_hwc_filters.clear();
+	}
+
+	// back in CHW Winograd is picked the way a new layer picks it, unless it
+	// was forced
+	apply_winograd(_winograd_forced ? _winograd_wanted : winograd_pays_off());
+	return true;
+}
+
+// Refreshes the copies of the filters the current path runs on
+inline void ConvLayer::transform_filters()
+{
+	int nr_filters = _weights._size._y;
+	int channels = _input._size._z;
+	int filter_size = _weights._size._x;
+
+	if (_layout == layout_t::HWC) {
+		for (int f = 0; f < nr_filters; f++) {
+			const float* filter = _weights._data + f * filter_size;
+			float* hwc = _hwc_filters.data() + f * filter_size;
+
+			for (int c = 0; c < channels; c++) {
+				for (int k = 0; k < _filter_dem * _filter_dem; k++) {
+					hwc[k * channels + c] = filter[c * _filter_dem * _filter_dem + k];
 				}
 			}
 		}
 	}
+
+	if (!_winograd) {
+		return;
+	}
+
+	winograd_transform_filters(_weights._data, nr_filters, channels, _winograd_filters.data());
+
+	if (_inference_only) {
+		return;
+	}
+
+	// the input gradient is a convolution of the output gradient, padded by 2,
+	// with every filter channel rotated
+	winograd_rotate_filters(_weights._data, nr_filters, channels, _rotated_filters.data());
+	winograd_transform_filters(_rotated_filters.data(), channels, nr_filters, _winograd_grad_filters.data());
 }
 
-inline void ConvLayer::calc_grads(tensor<float>& next_layer_grad)
+// Scratch for the forward pass, which is the same as for the input gradients
+inline size_t ConvLayer::winograd_buffer_size() const
 {
-	for (unsigned int k = 0; k < _filter_gradients.size(); k++) {
-		for (unsigned int i = 0; i < _filter_dem; i++) {
-			for (unsigned int j = 0; j < _filter_dem; j++) {
-				for (unsigned int z = 0; z < _input._size._z; z++) {
-					_filter_gradients[k].get(i, j, z).grad = 0;
-				}
+	int nr_filters = _weights._size._y;
+	int channels = _input._size._z;
+
+	return winograd_scratch_size(channels, nr_filters);
+}
+
+// The patch matrix of one sample, and of its gradient, from the shapes, since
+// an inference-only layer no longer holds buffers of this size
+inline size_t ConvLayer::columns_size() const
+{
+	size_t filter_size = (size_t)_filter_dem * _filter_dem * _input._size._z;
+
+	return filter_size * _output._size._x * _output._size._y;
+}
+
+inline void ConvLayer::activate()
+{
+	forward(get_input(), get_output(), _columns.data(), _winograd_scratch.data());
+}
+
+inline void ConvLayer::plan(layer_context& ctx, arena& memory, int max_batch, bool training, const layer_schedule& steps) const
+{
+	conv_context& conv = static_cast<conv_context&>(ctx);
+
+	layer::plan(ctx, memory, max_batch, training, steps);
+
+	// the backward pass builds the patch matrix again, so nothing is kept in
+	// between. With Winograd it is only needed for the weight gradients.
+	if (training && _winograd) {
+		conv._columns = memory.allocate(columns_size(), steps.backward);
+	}
+	else if (training) {
+		conv._columns = memory.allocate(columns_size(), { steps.forward, steps.recompute, steps.backward });
+	}
+	else if (!_winograd) {
+		conv._columns = memory.allocate(columns_size(), steps.forward);
+	}
+
+	if (training && !_winograd) {
+		conv._column_gradients = memory.allocate(columns_size(), steps.backward);
+	}
+
+	if (_winograd) {
+		conv._winograd = training ? memory.allocate(winograd_buffer_size(), { steps.forward, steps.recompute, steps.backward }) :
+			memory.allocate(winograd_buffer_size(), steps.forward);
+	}
+}
+
+inline void ConvLayer::activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const
+{
+	conv_context& conv = static_cast<conv_context&>(ctx);
+
+	bind_views(conv._output, conv._output_memory, (int)batch.size(), _output._size, _layout);
+	conv._input.assign(batch.begin(), batch.end());
+
+	for (unsigned int b = 0; b < batch.size(); b++) {
+		forward(conv._input[b], conv._output[b], conv._columns, conv._winograd);
+	}
+}
+
+inline void ConvLayer::infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const
+{
+	conv_context& conv = static_cast<conv_context&>(ctx);
+	forward(in, out, conv._columns, conv._winograd);
+}
+
+inline void ConvLayer::forward(tensor_view<float> in, tensor_view<float> out, float* columns, float* winograd) const
+{
+	if (_winograd) {
+		winograd_conv(in._data, in._size, 0, _winograd_filters.data(), (int)_filters.size(), out._data, out._size, winograd);
+		return;
+	}
+
+	if (_layout == layout_t::HWC) {
+		forward_hwc(in, out, columns);
+		return;
+	}
+
+	// output(x, y, f) = sum over (i, j, z) of filter_f(i, j, z) * input(x * stride + i, y * stride + j, z)
+	// is the (nr_filters x K) * (K x X*Y) product of the filter matrix and the
+	// patch matrix, which lands directly in the planar layout of the output.
+	int positions = out._size._x * out._size._y;
+	int filter_size = _filter_dem * _filter_dem * in._size._z;
+	int nr_filters = (int)_filters.size();
+	task_pool& pool = intra_op_pool();
+
+	// bands of output rows are lowered and multiplied on their own, unless
+	// there are too few rows to go around and the filters are split instead
+	if (out._size._y >= 2 * pool.size()) {
+		pool.parallel_for(out._size._y, 2.0 * nr_filters * filter_size * out._size._x, [&](int first, int last) {
+			int band = (last - first) * out._size._x;
+			float* band_columns = columns + (size_t)first * out._size._x * filter_size;
+
+			im2col_rows(in._data, in._size, _filter_dem, _stride, out._size, first, last - first, band_columns);
+			sgemm(false, false, nr_filters, band, filter_size,
+				1.0f, _weights._data, filter_size,
+				band_columns, band,
+				0.0f, out._data + first * out._size._x, positions);
+		});
+		return;
+	}
+
+	im2col(in._data, in._size, _filter_dem, _stride, out._size, columns);
+
+	pool.parallel_for(nr_filters, 2.0 * filter_size * positions, [&](int first, int last) {
+		sgemm(false, false, last - first, positions, filter_size,
+			1.0f, _weights._data + first * filter_size, filter_size,
+			columns, positions,
+			0.0f, out._data + first * positions, positions);
+	});
+}
+
+// Output rows of a fused chain per band: as many as fit FUSED_BAND_FLOATS, at
+// least one
+inline int ConvLayer::fused_band_rows(const conv_epilogue& epilogue) const
+{
+	int nr_filters = (int)_filters.size();
+	int filter_size = _filter_dem * _filter_dem * _input._size._z;
+	int conv_rows = std::max(1, FUSED_BAND_FLOATS / ((nr_filters + filter_size) * _output._size._x));
+
+	if (epilogue.pool_dem == 0) {
+		return std::min(conv_rows, _output._size._y);
+	}
+
+	int pooled_rows = (_output._size._y - epilogue.pool_dem) / epilogue.pool_stride + 1;
+	int rows = conv_rows > epilogue.pool_dem ? (conv_rows - epilogue.pool_dem) / epilogue.pool_stride + 1 : 1;
+	return std::min(rows, pooled_rows);
+}
+
+inline void ConvLayer::plan_fused(layer_context& ctx, arena& memory, const conv_epilogue& epilogue) const
+{
+	conv_context& conv = static_cast<conv_context&>(ctx);
+	int nr_filters = (int)_filters.size();
+	int filter_size = _filter_dem * _filter_dem * _input._size._z;
+
+	// Winograd transforms the whole input at once, so its band is all of it
+	if (_winograd) {
+		conv._winograd = memory.allocate(winograd_buffer_size());
+		conv._band = epilogue.pool_dem > 0 ? memory.allocate(nr_filters * _output._size._x * _output._size._y) : nullptr;
+		return;
+	}
+
+	int rows = fused_band_rows(epilogue);
+	int conv_rows = epilogue.pool_dem > 0 ? (rows - 1) * epilogue.pool_stride + epilogue.pool_dem : rows;
+
+	conv._columns = memory.allocate(filter_size * conv_rows * _output._size._x);
+	conv._band = epilogue.pool_dem > 0 ? memory.allocate(nr_filters * conv_rows * _output._size._x) : nullptr;
+}
+
+inline void ConvLayer::infer_fused(tensor_view<float> in, tensor_view<float> out, layer_context& ctx, const conv_epilogue& epilogue) const
+{
+	conv_context& conv = static_cast<conv_context&>(ctx);
+	td_size size = _output._size;
+	int nr_filters = (int)_filters.size();
+	int filter_size = _filter_dem * _filter_dem * in._size._z;
+	bool pool = epilogue.pool_dem > 0;
+
+	if (_winograd) {
+		tensor_view<float> full = pool ? tensor_view<float>(conv._band, size, _layout) : out;
+		forward(in, full, conv._columns, conv._winograd);
+		finish_band(full._data, 0, size._y, out, 0, out._size._y, epilogue);
+		return;
+	}
+
+	int band = fused_band_rows(epilogue);
+
+	for (int first = 0; first < out._size._y; first += band) {
+		int rows = std::min(band, out._size._y - first);
+		int band_first = pool ? first * epilogue.pool_stride : first;
+		int band_rows = pool ? (rows - 1) * epilogue.pool_stride + epilogue.pool_dem : rows;
+		int positions = band_rows * size._x;
+
+		// without pooling the rows land in out right away, where in CHW the
+		// rows of the filters are a plane apart
+		if (_layout == layout_t::HWC) {
+			float* dst = pool ? conv._band : out._data + band_first * size._x * nr_filters;
+
+			im2col_hwc(in._data + band_first * _stride * in._size._x * in._size._z, in._size, _filter_dem, _stride,
+				{ size._x, band_rows, nr_filters }, conv._columns);
+			sgemm(false, true, positions, nr_filters, filter_size,
+				1.0f, conv._columns, filter_size,
+				_hwc_filters.data(), filter_size,
+				0.0f, dst, nr_filters);
+		}
+		else {
+			float* dst = pool ? conv._band : out._data + band_first * size._x;
+
+			im2col_rows(in._data, in._size, _filter_dem, _stride, size, band_first, band_rows, conv._columns);
+			sgemm(false, false, nr_filters, positions, filter_size,
+				1.0f, _weights._data, filter_size,
+				conv._columns, positions,
+				0.0f, dst, pool ? positions : size._x * size._y);
+		}
+
+		finish_band(pool ? conv._band : nullptr, band_first, band_rows, out, first, rows, epilogue);
+	}
+}
+
+// Runs the epilogue on output rows first .. first + rows - 1. With pooling,
+// band holds convolution rows band_first .. band_first + band_rows - 1 in the
+// layer's layout; a relu before it only raises the max to at least 0. Without,
+// the rows are already in out and the relu runs on them in place.
+inline void ConvLayer::finish_band(const float* band, int band_first, int band_rows, tensor_view<float> out, int first, int rows,
+	const conv_epilogue& epilogue) const
+{
+	int width = _output._size._x;
+	int channels = _output._size._z;
+	float floor = epilogue.relu ? 0.0f : -FLT_MAX;
+
+	if (epilogue.pool_dem == 0) {
+		auto relu = [](float* values, int count) {
+			for (int i = 0; i < count; i++) {
+				values[i] = values[i] < 0 ? 0 : values[i];
 			}
+		};
+
+		if (_layout == layout_t::HWC) {
+			relu(out._data + first * width * channels, rows * width * channels);
+			return;
+		}
+
+		for (int z = 0; z < channels; z++) {
+			relu(out._data + (z * _output._size._y + first) * width, rows * width);
 		}
+		return;
 	}
 
-	for (int x = 0; x < _input._size._x; x++) {
-		for (unsigned int y = 0; y < _input._size._y; y++) {
-			range rn = map_to_output(x, y);
+	int stride = epilogue.pool_stride;
 
-			for (unsigned int z = 0; z < _input._size._z; z++) {
-				float sum_error = 0;
-				for (unsigned int i = rn.min_x; i <= rn.max_x; i++) {
-					int minx = i * _stride;
+	if (_layout == layout_t::HWC) {
+		for (int y = first; y < first + rows; y++) {
+			for (int x = 0; x < out._size._x; x++) {
+				float* max = &out(x, y, 0);
+				std::fill(max, max + channels, floor);
 
-					for (unsigned int j = rn.min_y; j <= rn.max_y; j++) {
-						int miny = j * _stride;
+				for (int j = 0; j < epilogue.pool_dem; j++) {
+					for (int i = 0; i < epilogue.pool_dem; i++) {
+						const float* v = band + ((y * stride + j - band_first) * width + x * stride + i) * channels;
 
-						for (unsigned int k = rn.min_z; k <= rn.max_z; k++) {
-							int w_applied = _filters[k].get(x - minx, y - miny, z);
-							sum_error += w_applied * next_layer_grad(i, j, k);
-							_filter_gradients[k].get(x - minx, y - miny, z).grad += _input(x, y, z) * next_layer_grad(i, j, k);
+						for (int z = 0; z < channels; z++) {
+							max[z] = v[z] > max[z] ? v[z] : max[z];
 						}
 					}
 				}
+			}
+		}
+		return;
+	}
 
-				_gradients(x, y, z) = sum_error;
+	for (int z = 0; z < channels; z++) {
+		const float* plane = band + z * band_rows * width;
+
+		for (int y = first; y < first + rows; y++) {
+			for (int x = 0; x < out._size._x; x++) {
+				float max = floor;
+
+				for (int j = 0; j < epilogue.pool_dem; j++) {
+					const float* row = plane + (y * stride + j - band_first) * width + x * stride;
+
+					for (int i = 0; i < epilogue.pool_dem; i++) {
+						max = row[i] > max ? row[i] : max;
+					}
+				}
+
+				out(x, y, z) = max;
 			}
 		}
 	}
 }
 
+inline void ConvLayer::calc_grads(tensor_view<float> grad_next_layer)
+{
+	std::fill(_filter_grad_sum.begin(), _filter_grad_sum.end(), 0.0f);
+	backward(get_input(), grad_next_layer, get_gradients(), _columns.data(), _column_gradients.data(), _filter_grad_sum.data(),
+		_winograd_scratch.data());
+	set_weight_grads(_filter_grad_sum.data(), 1.0f);
+}
+
+inline void ConvLayer::calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const
+{
+	conv_context& conv = static_cast<conv_context&>(ctx);
+
+	bind_views(conv._gradients, conv._gradient_memory, (int)grad_next_layer.size(), _gradients._size, _layout);
+	std::fill(conv._weight_grads, conv._weight_grads + weight_count(), 0.0f);
+
+	for (unsigned int b = 0; b < grad_next_layer.size(); b++) {
+		backward(conv._input[b], grad_next_layer[b], conv._gradients[b],
+			conv._columns, conv._column_gradients, conv._weight_grads, conv._winograd);
+	}
+}
+
+inline void ConvLayer::backward(tensor_view<float> in, tensor_view<float> grad_next_layer, tensor_view<float> grads,
+	float* columns, float* column_gradients, float* filter_grad_sum, float* winograd) const
+{
+	if (_layout == layout_t::HWC) {
+		backward_hwc(in, grad_next_layer, grads, columns, column_gradients, filter_grad_sum);
+		return;
+	}
+
+	int positions = grad_next_layer._size._x * grad_next_layer._size._y;
+	int window = _filter_dem * _filter_dem;
+	int filter_size = window * in._size._z;
+	int nr_filters = (int)_filters.size();
+	int plane = in._size._x * in._size._y;
+	task_pool& pool = intra_op_pool();
+
+	// the rows of the patch matrix of a channel only read that channel's plane
+	pool.parallel_for(in._size._z, (double)window * positions, [&](int first, int last) {
+		im2col_rows(in._data + first * plane, { in._size._x, in._size._y, last - first }, _filter_dem, _stride,
+			grad_next_layer._size, 0, grad_next_layer._size._y, columns + (size_t)first * window * positions);
+	});
+
+	// dL/dfilters += dL/doutput * patches^T, a few filters at a time
+	pool.parallel_for(nr_filters, 2.0 * filter_size * positions, [&](int first, int last) {
+		sgemm(false, true, last - first, filter_size, positions,
+			1.0f, grad_next_layer._data + first * positions, positions,
+			columns, positions,
+			1.0f, filter_grad_sum + first * filter_size, filter_size);
+	});
+
+	if (_winograd) {
+		winograd_conv(grad_next_layer._data, grad_next_layer._size, 2, _winograd_grad_filters.data(), in._size._z,
+			grads._data, grads._size, winograd);
+		return;
+	}
+
+	// dL/dpatches = filters^T * dL/doutput, folded back onto the input
+	// positions a few channels at a time
+	pool.parallel_for(in._size._z, 2.0 * window * positions * nr_filters, [&](int first, int last) {
+		float* channel_gradients = column_gradients + (size_t)first * window * positions;
+
+		sgemm(true, false, (last - first) * window, positions, nr_filters,
+			1.0f, _weights._data + first * window, filter_size,
+			grad_next_layer._data, positions,
+			0.0f, channel_gradients, positions);
+
+		memset(grads._data + first * plane, 0, (last - first) * plane * sizeof(float));
+		col2im(channel_gradients, { in._size._x, in._size._y, last - first }, _filter_dem, _stride, grad_next_layer._size,
+			grads._data + first * plane);
+	});
+}
+
+// The transposed product of forward(): (X*Y x K) patches times the K x nr_filters
+// filters gives every output position its row of nr_filters channels, HWC
+inline void ConvLayer::forward_hwc(tensor_view<float> in, tensor_view<float> out, float* columns) const
+{
+	int positions = out._size._x * out._size._y;
+	int filter_size = _filter_dem * _filter_dem * in._size._z;
+	int nr_filters = (int)_filters.size();
+	task_pool& pool = intra_op_pool();
+
+	// bands of output rows or the filters, as in forward()
+	if (out._size._y >= 2 * pool.size()) {
+		pool.parallel_for(out._size._y, 2.0 * nr_filters * filter_size * out._size._x, [&](int first, int last) {
+			int band = (last - first) * out._size._x;
+			float* band_columns = columns + (size_t)first * out._size._x * filter_size;
+
+			im2col_hwc(in._data + first * _stride * in._size._x * in._size._z, in._size, _filter_dem, _stride,
+				{ out._size._x, last - first, nr_filters }, band_columns);
+			sgemm(false, true, band, nr_filters, filter_size,
+				1.0f, band_columns, filter_size,
+				_hwc_filters.data(), filter_size,
+				0.0f, out._data + first * out._size._x * nr_filters, nr_filters);
+		});
+		return;
+	}
+
+	im2col_hwc(in._data, in._size, _filter_dem, _stride, out._size, columns);
+
+	pool.parallel_for(nr_filters, 2.0 * filter_size * positions, [&](int first, int last) {
+		sgemm(false, true, positions, last - first, filter_size,
+			1.0f, columns, filter_size,
+			_hwc_filters.data() + first * filter_size, filter_size,
+			0.0f, out._data + first, nr_filters);
+	});
+}
+
+inline void ConvLayer::backward_hwc(tensor_view<float> in, tensor_view<float> grad_next_layer, tensor_view<float> grads,
+	float* columns, float* column_gradients, float* filter_grad_sum) const
+{
+	td_size out_size = grad_next_layer._size;
+	int positions = out_size._x * out_size._y;
+	int filter_size = _filter_dem * _filter_dem * in._size._z;
+	int nr_filters = (int)_filters.size();
+	int channels = in._size._z;
+	task_pool& pool = intra_op_pool();
+
+	pool.parallel_for(out_size._y, (double)filter_size * out_size._x, [&](int first, int last) {
+		im2col_hwc(in._data + first * _stride * in._size._x * channels, in._size, _filter_dem, _stride,
+			{ out_size._x, last - first, nr_filters }, columns + (size_t)first * out_size._x * filter_size);
+	});
+
+	// dL/dfilters += dL/doutput^T * patches, in the HWC filter order, a few
+	// filters at a time
+	pool.parallel_for(nr_filters, 2.0 * filter_size * positions, [&](int first, int last) {
+		sgemm(true, false, last - first, filter_size, positions,
+			1.0f, grad_next_layer._data + first, nr_filters,
+			columns, filter_size,
+			1.0f, filter_grad_sum + first * filter_size, filter_size);
+	});
+
+	// dL/dpatches = dL/doutput * filters, by bands of output rows
+	pool.parallel_for(out_size._y, 2.0 * out_size._x * filter_size * nr_filters, [&](int first, int last) {
+		sgemm(false, false, (last - first) * out_size._x, filter_size, nr_filters,
+			1.0f, grad_next_layer._data + first * out_size._x * nr_filters, nr_filters,
+			_hwc_filters.data(), filter_size,
+			0.0f, column_gradients + (size_t)first * out_size._x * filter_size, filter_size);
+	});
+
+	// overlapping windows add onto the same positions, so the gradients are
+	// folded back a few channels at a time
+	pool.parallel_for(channels, (double)_filter_dem * _filter_dem * positions, [&](int first, int last) {
+		if (first == 0 && last == channels) {
+			memset(grads._data, 0, in._size._x * in._size._y * channels * sizeof(float));
+			col2im_hwc(column_gradients, in._size, _filter_dem, _stride, out_size, grads._data);
+			return;
+		}
+
+		for (int p = 0; p < in._size._x * in._size._y; p++) {
+			memset(grads._data + p * channels + first, 0, (last - first) * sizeof(float));
+		}
+		col2im_hwc_channels(column_gradients, in._size, _filter_dem, _stride, out_size, first, last, grads._data);
+	});
+}
+
+inline void ConvLayer::set_inference_only()
+{
+	layer::set_inference_only();
+
+	std::vector<float>().swap(_grads);
+	std::vector<float>().swap(_columns);
+	std::vector<float>().swap(_column_gradients);
+	std::vector<float>().swap(_filter_grad_sum);
+	std::vector<float>().swap(_winograd_grad_filters);
+	std::vector<float>().swap(_rotated_filters);
+	std::vector<float>().swap(_winograd_scratch);
+}
+
+inline void ConvLayer::set_weight_grads(const float* grads, float scale)
+{
+	int channels = _input._size._z;
+	int window = _filter_dem * _filter_dem;
+	int filter_size = window * channels;
+
+	for (unsigned int f = 0; f < _filters.size(); f++) {
+		float* filter_grads = _grads.data() + f * filter_size;
+		const float* sum = grads + f * filter_size;
+
+		if (_layout == layout_t::HWC) {
+			for (int c = 0; c < channels; c++) {
+				for (int k = 0; k < window; k++) {
+					filter_grads[c * window + k] = sum[k * channels + c] * scale;
+				}
+			}
+			continue;
+		}
+
+		for (int i = 0; i < filter_size; i++) {
+			filter_grads[i] = sum[i] * scale;
+		}
+	}
+}
+
 inline std::string ConvLayer::to_string()
 {
 	std::stringstream ss;
@@ -214,7 +814,7 @@ inline std::string ConvLayer::to_string()
 	ss << tensor_to_string(_output) << std::endl;
 	ss << tensor_to_string(_gradients) << std::endl;
 
-	for (tensor<float> t : _filters) {
+	for (tensor_view<float> t : _filters) {
 		ss << tensor_to_string(t) << std::endl;
 	}
 
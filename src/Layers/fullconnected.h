@@ -1,69 +1,170 @@
 #ifndef FULLCONNECTED_H
 #define FULLCONNECTED_H
 
-#include <functional>
-#include "activation.h"
+#include "layer.h"
+#include "../Learning/activation.h"
+#include "../Learning/learning.h"
+#include "../Math/gemm.h"
+#include "../Math/simd.h"
+
+// Row-major batch x input and batch x output matrices one thread needs to run a
+// FullConnected layer over a batch. The input matrix is always in CHW order.
+struct fc_context : layer_context
+{
+	float* _matrix = nullptr;
+	float* _output_val = nullptr;
+	float* _deltas = nullptr;
+};
+
+// The activation dependent steps of a FullConnected layer, instantiated per
+// activation_t so the activation is inlined into the loop around it
+struct fc_kernels
+{
+	// output_val = weights * in and out = f(output_val), the activation
+	// running over the outputs while they are still in L1
+	void (*forward)(const float* weights, const float* in, float* output_val, float* out, int input_size, int output_size);
+
+	// out = f(output_val) for a row of the batched product
+	void (*activate)(const float* output_val, float* out, int n);
+
+	// Gradient of output_val from the gradient of out
+	void (*deltas)(const float* output_val, const float* out, const float* grads, float* deltas, int n);
+};
+
+template<activation_t A>
+inline void fc_activate(const float* output_val, float* out, int n)
+{
+	apply_activation<A>(output_val, out, n);
+}
+
+template<>
+inline void fc_activate<activation_t::Softmax>(const float* output_val, float* out, int n)
+{
+	softmax(output_val, out, n);
+}
+
+template<activation_t A>
+inline void fc_forward(const float* weights, const float* in, float* output_val, float* out, int input_size, int output_size)
+{
+	for (int n = 0; n < output_size; n++) {
+		output_val[n] = simd_dot(weights + n * input_size, in, input_size);
+	}
+
+	fc_activate<A>(output_val, out, output_size);
+}
+
+template<activation_t A>
+inline void fc_deltas(const float* output_val, const float* out, const float* grads, float* deltas, int n)
+{
+	for (int i = 0; i < n; i++) {
+		deltas[i] = activation_op<A>::df(output_val[i]) * grads[i];
+	}
+}
+
+// The tanh derivative is taken of the value tanh returned
+template<>
+inline void fc_deltas<activation_t::Tanh>(const float* output_val, const float* out, const float* grads, float* deltas, int n)
+{
+	for (int i = 0; i < n; i++) {
+		deltas[i] = activation_op<activation_t::Tanh>::df(out[i]) * grads[i];
+	}
+}
+
+template<>
+inline void fc_deltas<activation_t::Softmax>(const float* output_val, const float* out, const float* grads, float* deltas, int n)
+{
+	softmax_backward(out, grads, deltas, n);
+}
+
+// Softmax under categorical cross-entropy: the gradient of the loss by the
+// softmax inputs is output - expected, exactly the gradient the layer gets
+inline void fc_deltas_cross_entropy(const float* output_val, const float* out, const float* grads, float* deltas, int n)
+{
+	memcpy(deltas, grads, n * sizeof(float));
+}
+
+template<activation_t A>
+inline fc_kernels fc_kernels_for()
+{
+	return { fc_forward<A>, fc_activate<A>, fc_deltas<A> };
+}
 
 class FullConnected : public layer
 {
 private:
 	std::vector<float> _output_val;
+	std::vector<float> _deltas;
 	tensor<float> _weights;
-	std::vector<gradient> _grads;
-	std::function<tensor<float>(std::vector<float>)> _activation_function;
-	std::function<tensor<float>(std::vector<float>)> _activation_derivative;
 
+	// Gradient of every weight, in the same layout as _weights: one row of
+	// input_size values per output
+	std::vector<float> _grads;
+
+	fc_kernels _kernels;
 	activation_t _act_fcn;
 
-	int map(point d);
+	// The single-sample input in CHW order when it arrives in another layout
+	std::vector<float> _gathered;
+
 	void activate();
+	void forward(tensor_view<float> in, tensor_view<float> out, float* output_val, float* gathered) const;
+	void set_activation(activation_t act_fcn);
 public:
 
 	FullConnected(td_size in_size, int output_size, activation_t act_fcn = activation_t::Tanh);
 	FullConnected(const tensor<float>& in, const tensor<float>& out, const tensor<float>& weights, const tensor<float>& gradsIn, activation_t act_fcn = activation_t::Tanh);
 
-	void activate(tensor<float>& in) {
-		_input = in;
+	// weights holds one row of input values per output and may be borrowed,
+	// see tensor::borrow()
+	FullConnected(td_size in_size, tensor<float>&& weights, activation_t act_fcn);
+
+	void activate(tensor_view<float> in) {
+		copy_view(in, get_input());
 		activate();
 	}
 
-	void fix_weights(float learning_rate);
-	void calc_grads(tensor<float>& grad_next_layer);
+	std::unique_ptr<layer_context> create_context() const { return std::unique_ptr<layer_context>(new fc_context()); }
+	void activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const;
+	void calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const;
+	void infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const;
+	void plan(layer_context& ctx, arena& memory, int max_batch, bool training,
+		const layer_schedule& steps = layer_schedule()) const;
+
+	int weight_count() const { return _weights._size._x * _weights._size._y; }
+	tensor_view<float> get_weights() const { return tensor_view<float>(_weights._data, _weights._size); }
+	const float* get_weight_grads() const { return _grads.data(); }
+	layer_t type() const { return layer_t::FullConnected; }
+	activation_t get_activation() const { return _act_fcn; }
+
+	// The layout of the input and its gradients. The weights read the input in
+	// CHW order, so input in any other layout is gathered into CHW on the way in
+	// and its gradients are scattered back: where a network running in HWC
+	// converts back to CHW.
+	bool set_layout(layout_t layout);
+
+	// The loss whose gradient an output layer gets. Softmax under categorical
+	// cross-entropy then skips its own derivative, see fc_deltas_cross_entropy().
+	void set_loss(loss_t loss);
+	void set_weight_grads(const float* grads, float scale);
+
+	// Also drops the weight gradients and the single-sample buffers
+	void set_inference_only();
+
+	void calc_grads(tensor_view<float> grad_next_layer);
 	std::string to_string();
 };
 
 inline FullConnected::FullConnected(td_size in_size, int output_size, activation_t act_fcn)
 {
-	_act_fcn = act_fcn;
-
-	switch (act_fcn) {
-	case activation_t::Tanh:
-		_activation_function = net_tanh;
-		_activation_derivative = tanh_dev;
-		break;
-	case activation_t::Sigmoid:
-		_activation_function = sig;
-		_activation_derivative = sigmoid_dev;
-		break;
-	case activation_t::Relu:
-		_activation_function = relu;
-		_activation_derivative = relu_dev;
-		break;
-	case activation_t::LRelu:
-		_activation_function = lRelu;
-		_activation_derivative = lRelu_dev;
-		break;
-	case activation_t::Softmax:
-		_activation_function = softmax;
-		_activation_derivative = softmax_dev;
-	}
+	set_activation(act_fcn);
 
 	_input = tensor<float>(in_size._x, in_size._y, in_size._z);
 	_output = tensor<float>(output_size, 1, 1);
 	_gradients = tensor<float>(in_size._x, in_size._y, in_size._z);
 
 	_output_val = std::vector<float>(output_size);
-	_grads = std::vector<gradient>(output_size);
+	_deltas = std::vector<float>(output_size);
+	_grads = std::vector<float>(in_size._x * in_size._y * in_size._z * output_size);
 	_weights = tensor<float>(in_size._x * in_size._y * in_size._z, output_size, 1);
 
 	int max_index = in_size._x * in_size._y * in_size._z;
@@ -77,102 +178,226 @@ inline FullConnected::FullConnected(td_size in_size, int output_size, activation
 
 inline FullConnected::FullConnected(const tensor<float>& in, const tensor<float>& out, const tensor<float>& weights,
 	const tensor<float>& grads, activation_t act_fcn)
+{
+	set_activation(act_fcn);
+
+	_input = in;
+	_output = out;
+	_weights = weights;
+	_gradients = grads;
+
+	_output_val = std::vector<float>(_output._size._x);
+	_deltas = std::vector<float>(_output._size._x);
+	_grads = std::vector<float>(_weights._size._x * _weights._size._y);
+}
+
+inline FullConnected::FullConnected(td_size in_size, tensor<float>&& weights, activation_t act_fcn)
+{
+	int output_size = weights._size._y;
+
+	assert(weights._size._x == in_size._x * in_size._y * in_size._z);
+
+	set_activation(act_fcn);
+
+	_input = tensor<float>(in_size._x, in_size._y, in_size._z);
+	_output = tensor<float>(output_size, 1, 1);
+	_gradients = tensor<float>(in_size._x, in_size._y, in_size._z);
+
+	_output_val = std::vector<float>(output_size);
+	_deltas = std::vector<float>(output_size);
+	_grads = std::vector<float>(weights._size._x * output_size);
+	_weights = std::move(weights);
+}
+
+inline void FullConnected::set_activation(activation_t act_fcn)
 {
 	_act_fcn = act_fcn;
 
 	switch (act_fcn) {
 	case activation_t::Tanh:
-		_activation_function = net_tanh;
-		_activation_derivative = tanh_dev;
+		_kernels = fc_kernels_for<activation_t::Tanh>();
 		break;
 	case activation_t::Sigmoid:
-		_activation_function = sig;
-		_activation_derivative = sigmoid_dev;
+		_kernels = fc_kernels_for<activation_t::Sigmoid>();
 		break;
 	case activation_t::Relu:
-		_activation_function = relu;
-		_activation_derivative = relu_dev;
+		_kernels = fc_kernels_for<activation_t::Relu>();
 		break;
 	case activation_t::LRelu:
-		_activation_function = lRelu;
-		_activation_derivative = lRelu_dev;
+		_kernels = fc_kernels_for<activation_t::LRelu>();
+		break;
+	case activation_t::Softmax:
+		_kernels = fc_kernels_for<activation_t::Softmax>();
 		break;
 	}
+}
 
-	_input = in;
-	_output = out;
-	_weights = weights;
-	_gradients = grads;
+inline void FullConnected::set_loss(loss_t loss)
+{
+	set_activation(_act_fcn);
+
+	if (_act_fcn == activation_t::Softmax && loss == loss_t::CategoricalCrossentropy) {
+		_kernels.deltas = fc_deltas_cross_entropy;
+	}
 }
 
-inline int FullConnected::map(point d)
+inline bool FullConnected::set_layout(layout_t layout)
 {
-	return d._z * (_input._size._x * _input._size._y) +
-		d._y * (_input._size._x) +
-		d._x;
+	_layout = layout;
+	_gathered.resize(layout == layout_t::CHW || _inference_only ? 0 : _input._size._x * _input._size._y * _input._size._z);
+	return true;
 }
 
 inline void FullConnected::activate()
 {
-	for (int n = 0; n < _output._size._x; n++) {
-		float sum = 0;
-
-		for (int i = 0; i < _input._size._x; i++) {
-			for (int j = 0; j < _input._size._y; j++) {
-				for (int k = 0; k < _input._size._z; k++) {
-					int neuron = map({ i, j, k });
-					sum += _input(i, j, k) * _weights(neuron, n, 0);
-				}
-			}
+	forward(get_input(), tensor_view<float>(_output), _output_val.data(), _gathered.data());
+}
+
+inline void FullConnected::plan(layer_context& ctx, arena& memory, int max_batch, bool training, const layer_schedule& steps) const
+{
+	fc_context& fc = static_cast<fc_context&>(ctx);
+	int input_size = _input._size._x * _input._size._y * _input._size._z;
+	int output_size = _output._size._x;
+
+	// the values before the activation and the inputs are kept for the
+	// backward pass
+	layer::plan(ctx, memory, max_batch, training, steps);
+
+	if (training) {
+		fc._output_val = memory.allocate(max_batch * output_size, { steps.forward, steps.saved() });
+		fc._matrix = memory.allocate(max_batch * input_size, { steps.forward, steps.saved() });
+	}
+	else {
+		fc._output_val = memory.allocate(max_batch * output_size, steps.forward);
+
+		if (_layout != layout_t::CHW) {
+			fc._matrix = memory.allocate(max_batch * input_size, steps.forward);
 		}
+	}
 
-		_output_val[n] = sum;
+	if (training) {
+		fc._deltas = memory.allocate(max_batch * output_size, steps.backward);
 	}
+}
 
-	_output = _activation_function(_output_val);
+inline void FullConnected::activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const
+{
+	fc_context& fc = static_cast<fc_context&>(ctx);
+
+	int batch_size = (int)batch.size();
+	int input_size = _input._size._x * _input._size._y * _input._size._z;
+	int output_size = _output._size._x;
+
+	bind_views(fc._output, fc._output_memory, batch_size, _output._size);
+
+	for (int b = 0; b < batch_size; b++) {
+		copy_view(batch[b], tensor_view<float>(fc._matrix + b * input_size, _input._size));
+	}
+
+	// The whole batch in one product: outputs = inputs * weights^T
+	sgemm(false, true, batch_size, output_size, input_size,
+		1.0f, fc._matrix, input_size,
+		_weights._data, input_size,
+		0.0f, fc._output_val, output_size);
+
+	for (int b = 0; b < batch_size; b++) {
+		_kernels.activate(fc._output_val + b * output_size, fc._output[b]._data, output_size);
+	}
+}
+
+inline void FullConnected::infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const
+{
+	fc_context& fc = static_cast<fc_context&>(ctx);
+	forward(in, out, fc._output_val, fc._matrix);
+}
+
+inline void FullConnected::forward(tensor_view<float> in, tensor_view<float> out, float* output_val, float* gathered) const
+{
+	const float* input = in._data;
+
+	if (!in.is_dense()) {
+		copy_view(in, tensor_view<float>(gathered, in._size));
+		input = gathered;
+	}
+
+	// one dot product per output neuron over its row of _weights
+	int input_size = in._size._x * in._size._y * in._size._z;
+	_kernels.forward(_weights._data, input, output_val, out._data, input_size, out._size._x);
 }
 
-inline void FullConnected::fix_weights(float learning_rate)
+inline void FullConnected::calc_grads(tensor_view<float> grad_next_layer)
 {
+	int input_size = _input._size._x * _input._size._y * _input._size._z;
+	const float* input = _layout == layout_t::CHW ? _input._data : _gathered.data();
+	memset(_gradients._data, 0, input_size * sizeof(float));
+
+	_kernels.deltas(_output_val.data(), _output._data, grad_next_layer._data, _deltas.data(), _output._size._x);
+
 	for (int n = 0; n < _output._size._x; n++) {
-		gradient& grad = _grads[n];
-
-		for (int i = 0; i < _input._size._x; i++) {
-			for (int j = 0; j < _input._size._y; j++) {
-				for (int k = 0; k < _input._size._z; k++) {
-					int neuron = map({ i, j, k });
-					float& w = _weights(neuron, n, 0);
-					w = update_weight(w, grad, learning_rate, _input(i, j, k));
-				}
-			}
-		}
+		float delta = _deltas[n];
 
-		update_gradient(grad);
+		simd_scale(delta, input, _grads.data() + n * input_size, input_size);
+		simd_axpy(delta, _weights._data + n * input_size, _gradients._data, input_size);
+	}
+
+	// the gathered input is done with, so it can hold the CHW gradients
+	if (_layout != layout_t::CHW) {
+		memcpy(_gathered.data(), _gradients._data, input_size * sizeof(float));
+		copy_view(tensor_view<float>(_gathered.data(), _input._size), get_gradients());
 	}
 }
 
-inline void FullConnected::calc_grads(tensor<float>& grad_next_layer)
+inline void FullConnected::calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const
 {
-	int input_grad_size = _gradients._size._x * _gradients._size._y * _gradients._size._z;
-	memset(_gradients._data, 0, input_grad_size * sizeof(float));
+	fc_context& fc = static_cast<fc_context&>(ctx);
 
-	tensor<float> derivatives = _activation_derivative(_output_val);
+	int batch_size = (int)grad_next_layer.size();
+	int input_size = _input._size._x * _input._size._y * _input._size._z;
+	int output_size = _output._size._x;
 
-	for (unsigned int n = 0; n < _output._size._x; n++) {
-		gradient& grad = _grads[n];
-		grad.grad = grad_next_layer(n, 0, 0) * derivatives(n, 0, 0);
+	for (int b = 0; b < batch_size; b++) {
+		_kernels.deltas(fc._output_val + b * output_size, fc._output[b]._data, grad_next_layer[b]._data,
+			fc._deltas + b * output_size, output_size);
+	}
 
-		for (int i = 0; i < _input._size._x; i++) {
-			for (int j = 0; j < _input._size._y; j++) {
-				for (int k = 0; k < _input._size._z; k++) {
-					int m = map({ i, j, k });
-					_gradients(i, j, k) += grad.grad * _weights(m, n, 0);
-				}
-			}
+	// weight gradients = deltas^T * inputs, summed over the batch
+	sgemm(true, false, output_size, input_size, batch_size,
+		1.0f, fc._deltas, output_size,
+		fc._matrix, input_size,
+		0.0f, fc._weight_grads, input_size);
+
+	// input gradients = deltas * weights, straight into the batch's gradient
+	// slots, or in another layout through the input matrix, which is free now
+	bind_views(fc._gradients, fc._gradient_memory, batch_size, _gradients._size, _layout);
+	float* gradients = _layout == layout_t::CHW ? fc._gradient_memory : fc._matrix;
+
+	sgemm(false, false, batch_size, input_size, output_size,
+		1.0f, fc._deltas, output_size,
+		_weights._data, input_size,
+		0.0f, gradients, input_size);
+
+	if (_layout != layout_t::CHW) {
+		for (int b = 0; b < batch_size; b++) {
+			copy_view(tensor_view<float>(fc._matrix + b * input_size, _input._size), fc._gradients[b]);
 		}
 	}
 }
 
+inline void FullConnected::set_inference_only()
+{
+	layer::set_inference_only();
+
+	std::vector<float>().swap(_grads);
+	std::vector<float>().swap(_output_val);
+	std::vector<float>().swap(_deltas);
+	std::vector<float>().swap(_gathered);
+}
+
+inline void FullConnected::set_weight_grads(const float* grads, float scale)
+{
+	simd_scale(scale, grads, _grads.data(), (int)_grads.size());
+}
+
 inline std::string FullConnected::to_string()
 {
 	std::stringstream ss;
@@ -195,6 +420,9 @@ inline std::string FullConnected::to_string()
 	else if (_act_fcn == activation_t::LRelu) {
 		ss << "LRelu" << std::endl;
 	}
+	else if (_act_fcn == activation_t::Softmax) {
+		ss << "Softmax" << std::endl;
+	}
 
 	return ss.str();
 }
@@ -1,17 +1,17 @@
 #ifndef LAYER_H
 #define LAYER_H
 
+#include <memory>
+#include <vector>
 #include "tensor.h"
+#include "../Memory/arena.h"
 
-struct gradient
+enum class layer_t
 {
-	float grad;
-	float prev_grad;
-	gradient()
-	{
-		grad = 0;
-		prev_grad = 0;
-	}
+	Convolutional,
+	Pooling,
+	Relu,
+	FullConnected
 };
 
 struct range
@@ -20,27 +20,165 @@ struct range
 	int max_x, max_y, max_z;
 };
 
+// Everything a layer writes while running a mini-batch: the input, output and
+// input gradients of every sample, and the weight gradients summed over those
+// samples. The layer itself is only read while a context is in use, so several
+// threads can each run their own context against the same layer and add the
+// weight gradients together afterwards. Layers that need scratch space derive
+// their own context type, see create_context().
+//
+// All memory behind a context comes from an arena, see layer::plan(). _input
+// only views the batch that was passed to activate(), and _output and
+// _gradients view the first batch_size slots of _output_memory and
+// _gradient_memory, so running a batch never allocates.
+struct layer_context
+{
+	std::vector<tensor_view<float>> _input;
+	std::vector<tensor_view<float>> _output;
+	std::vector<tensor_view<float>> _gradients;
+
+	float* _output_memory = nullptr;
+	float* _gradient_memory = nullptr;
+	float* _weight_grads = nullptr;
+
+	virtual ~layer_context() { }
+};
+
+// When the buffers of one layer's context are in use, in the steps of a
+// training step numbered in the order they run. A layer's own scratch is in use
+// in its forward or backward pass, what it keeps for the backward pass from
+// the one to the other; buffers read by other layers get spans of their own.
+// With gradient checkpointing the forward pass may run a second time right
+// before the backward pass, and only what that run writes is kept.
+// By default every buffer is in use throughout and shares memory with none,
+// see arena::allocate().
+struct layer_schedule
+{
+	lifetime forward;
+	lifetime recompute = { 1, 0 };
+	lifetime backward;
+	lifetime output;					// until the last read of the output
+	lifetime recomputed_output = { 1, 0 };
+	lifetime gradients;					// of the input, until the layer before has read them
+	lifetime weight_grads;				// until they are summed into the layer
+
+	// kept for the backward pass from the forward pass that feeds it
+	lifetime saved() const
+	{
+		return forward.always() ? lifetime() : lifetime{ recompute.empty() ? forward.first : recompute.first, backward.last };
+	}
+};
+
 class layer
 {
 public:
-	virtual void activate(tensor<float>& input) = 0;
+	virtual ~layer() { }
+
+	virtual void activate(tensor_view<float> input) = 0;
 	virtual void activate() = 0;
 
-	virtual void fix_weights(float learning_rate) = 0;
-	virtual void calc_grads(tensor<float>& grad_next_layer) = 0;
+	virtual void calc_grads(tensor_view<float> grad_next_layer) = 0;
+
+	// Mini-batch entry points. activate(batch, ctx) keeps whatever the backward
+	// pass needs in ctx, and calc_grads(batch, ctx) fills ctx._gradients and sums
+	// the weight gradients of the batch into ctx._weight_grads. Neither touches
+	// the layer, set_weight_grads() hands the reduced sum over before an
+	// optimizer updates the weights, see Learning/optimizer.h.
+	// The batch views have to stay valid until calc_grads() is done with them.
+	virtual std::unique_ptr<layer_context> create_context() const { return std::unique_ptr<layer_context>(new layer_context()); }
+	virtual void activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const = 0;
+	virtual void calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const = 0;
+
+	// Forward pass for inference. Reads nothing but the weights and writes only
+	// out and ctx's scratch space, so any number of threads can run it on the
+	// same layer at once as long as each brings its own context.
+	virtual void infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const = 0;
+
+	// Takes every buffer ctx needs for batches of up to max_batch samples from
+	// memory. Without training only what infer() uses is set up. Buffers only
+	// share memory with those of other layers as far as steps allows.
+	virtual void plan(layer_context& ctx, arena& memory, int max_batch, bool training,
+		const layer_schedule& steps = layer_schedule()) const;
 
+	virtual int weight_count() const { return 0; }
+	virtual void set_weight_grads(const float* grads, float scale) { }
+
+	// The trainable parameters in one contiguous block, empty for layers
+	// without any, and the gradient of each in the same order as
+	// set_weight_grads() left it
+	virtual tensor_view<float> get_weights() const { return tensor_view<float>(); }
+	virtual const float* get_weight_grads() const { return nullptr; }
+
+	// Called whenever the weights were changed from outside, so a layer can
+	// refresh whatever it derives from them
+	virtual void weights_changed() { }
+
+	virtual layer_t type() const = 0;
 	virtual std::string to_string() = 0;
 
+	// Frees everything only training and the single-sample path use: the
+	// input, output and gradient tensors and whatever a layer keeps for its
+	// weight gradients. Shapes and weights stay, and the layer then only runs
+	// through infer() and contexts planned without training.
+	virtual void set_inference_only();
+	bool is_inference_only() const { return _inference_only; }
+
+	// Layout of every view the layer exchanges with its neighbours: inputs,
+	// outputs and both gradients. A network runs all of its layers in one
+	// layout, so data only changes layout where it enters or leaves the network.
+	// Returns false, and keeps the layout, when the layer can't run in it.
+	// Contexts planned before have to be planned again.
+	virtual bool set_layout(layout_t layout) { return layout == layout_t::CHW; }
+	layout_t get_layout() const { return _layout; }
+
+	td_size get_input_size() const { return _input._size; }
 	td_size get_output_size() const { return _output._size; }
 
-	tensor<float> get_input() const { return _input; }
-	tensor<float> get_output() const { return _output; }
-	tensor<float> get_gradients() const { return _gradients; }
+	// Views of the single-sample buffers, valid until the next activate() or
+	// calc_grads() on this layer
+	tensor_view<float> get_input() const { return tensor_view<float>(_input._data, _input._size, _layout); }
+	tensor_view<float> get_output() const { return tensor_view<float>(_output._data, _output._size, _layout); }
+	tensor_view<float> get_gradients() const { return tensor_view<float>(_gradients._data, _gradients._size, _layout); }
 
 protected:
 	tensor<float> _gradients;
 	tensor<float> _input;
 	tensor<float> _output;
+
+	layout_t _layout = layout_t::CHW;
+	bool _inference_only = false;
 };
 
+inline void layer::set_inference_only()
+{
+	_input = tensor<float>::shape(_input._size);
+	_output = tensor<float>::shape(_output._size);
+	_gradients = tensor<float>::shape(_gradients._size);
+	_inference_only = true;
+}
+
+inline void layer::plan(layer_context& ctx, arena& memory, int max_batch, bool training, const layer_schedule& steps) const
+{
+	assert(!training || !_inference_only);
+
+	if (!training) {
+		return;
+	}
+
+	td_size in_size = _input._size;
+	td_size out_size = _output._size;
+
+	ctx._output_memory = memory.allocate(max_batch * out_size._x * out_size._y * out_size._z, { steps.output, steps.recomputed_output });
+	ctx._gradient_memory = memory.allocate(max_batch * in_size._x * in_size._y * in_size._z, steps.gradients);
+	ctx._weight_grads = memory.allocate(weight_count(), steps.weight_grads);
+
+	ctx._input.reserve(max_batch);
+	ctx._output.reserve(max_batch);
+	ctx._gradients.reserve(max_batch);
+}
+
+// One context per layer of a network: the activations and gradients of one
+// worker or one inference request
+typedef std::vector<std::unique_ptr<layer_context>> network_context;
+
 #endif // !LAYER_H
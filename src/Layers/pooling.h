@@ -4,6 +4,7 @@
 #include "layer.h"
 #include "tensor.h"
 #include "../Learning/learning.h"
+#include "../Parallel/task_pool.h"
 
 class PoolingLayer : public layer
 {
@@ -11,23 +12,36 @@ private:
 	unsigned short _stride;
 	unsigned short _filter_dem;
 
-	int normalize_range(float f, int max, bool lim_min);
-	point map_to_input(point out, int z);
-	range map_to_output(int x, int y);
 	void activate();
 
+	void forward(tensor_view<float> in, tensor_view<float> out) const;
+	void backward(tensor_view<float> in, tensor_view<float> out, tensor_view<float> grad_next_layer, tensor_view<float> grads) const;
+
 public:
 
 	PoolingLayer(unsigned short stride, unsigned short filter_dem, td_size in_size);
 	PoolingLayer(const tensor<float>& in, const tensor<float>& out, const tensor<float>& gradsIn, unsigned short extend_filter, unsigned short stride);
 
-	void activate(tensor<float>& in) {
-		this->_input = in;
+	void activate(tensor_view<float> in) {
+		copy_view(in, get_input());
 		activate();
 	}
-		
-	void fix_weights(float learning_rate) { }
-	void calc_grads(tensor<float>& grad_next_layer);
+
+	void activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const;
+	void calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const;
+	void infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const { forward(in, out); }
+
+	void calc_grads(tensor_view<float> grad_next_layer);
+
+	layer_t type() const { return layer_t::Pooling; }
+
+	// In HWC the max over a window runs over the channel vectors of its
+	// positions, in CHW along the rows of every plane. Output rows, and the
+	// planes of the gradients, are split across the intra-op pool, see
+	// Parallel/task_pool.h.
+	bool set_layout(layout_t layout) { _layout = layout; return true; }
+	unsigned short get_stride() const { return _stride; }
+	unsigned short get_filter_dem() const { return _filter_dem; }
 	std::string to_string();
 };
 
@@ -53,95 +67,145 @@ inline PoolingLayer::PoolingLayer(const tensor<float>& in, const tensor<float>&
 	_stride = stride;
 }
 
-inline point PoolingLayer::map_to_input(point out, int z)
+inline void PoolingLayer::activate()
 {
-	out._x *= _stride;
-	out._y *= _stride;
-	out._z = z;
-	return out;
+	forward(get_input(), get_output());
 }
 
-inline int PoolingLayer::normalize_range(float f, int max, bool lim_min)
+inline void PoolingLayer::activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const
 {
-	if (f <= 0) {
-		return 0;
-	}
-
-	max -= 1;
-	if (f >= max) {
-		return max;
-	}
+	bind_views(ctx._output, ctx._output_memory, (int)batch.size(), _output._size, _layout);
+	ctx._input.assign(batch.begin(), batch.end());
 
-	if (lim_min) {
-		return (int)ceil(f);
-	}
-	else {
-		return (int)floor(f);
+	for (unsigned int b = 0; b < batch.size(); b++) {
+		forward(ctx._input[b], ctx._output[b]);
 	}
 }
 
-inline range PoolingLayer::map_to_output(int x, int y)
+inline void PoolingLayer::forward(tensor_view<float> in, tensor_view<float> out) const
 {
-	float a = (float)x;
-	float b = (float)y;
-
-	return
-	{
-		normalize_range((a - _filter_dem + 1) / _stride, _output._size._x, true),
-		normalize_range((b - _filter_dem + 1) / _stride, _output._size._y, true),
-		0,
-		normalize_range(a / _stride, _output._size._x, false),
-		normalize_range(b / _stride, _output._size._y, false),
-		(int)_output._size._z - 1,
-	};
-}
+	task_pool& pool = intra_op_pool();
+	double window = _filter_dem * _filter_dem;
 
-inline void PoolingLayer::activate()
-{
-	for (int x = 0; x < _output._size._x; x++) {
-		for (int y = 0; y < _output._size._y; y++) {
-			for (int z = 0; z < _output._size._z; z++) {
-				point mapped = map_to_input({ (uint16_t)x, (uint16_t)y, 0 }, 0);
+	if (_layout == layout_t::HWC && in._strides._z == 1 && out._strides._z == 1) {
+		int channels = out._size._z;
+
+		pool.parallel_for(out._size._y, window * out._size._x * channels, [&](int first, int last) {
+			for (int y = first; y < last; y++) {
+				for (int x = 0; x < out._size._x; x++) {
+					float* max = &out(x, y, 0);
+					std::fill(max, max + channels, -FLT_MAX);
+
+					for (int i = 0; i < _filter_dem; i++) {
+						for (int j = 0; j < _filter_dem; j++) {
+							const float* v = &in(x * _stride + i, y * _stride + j, 0);
+
+							for (int z = 0; z < channels; z++) {
+								max[z] = v[z] > max[z] ? v[z] : max[z];
+							}
+						}
+					}
+				}
+			}
+		});
+		return;
+	}
+
+	// every row of every plane on its own
+	int rows = out._size._y;
+
+	pool.parallel_for(out._size._z * rows, window * out._size._x, [&](int first, int last) {
+		for (int row = first; row < last; row++) {
+			int z = row / rows;
+			int y = row % rows;
+
+			for (int x = 0; x < out._size._x; x++) {
+				float max = -FLT_MAX;
 
-				float mval = -FLT_MAX;
 				for (int i = 0; i < _filter_dem; i++) {
 					for (int j = 0; j < _filter_dem; j++) {
-						float v = _input(mapped._x + i, mapped._y + j, z);
-						if (v > mval) {
-							mval = v;
-						}
+						float v = in(x * _stride + i, y * _stride + j, z);
+						max = v > max ? v : max;
 					}
 				}
 
-				_output(x, y, z) = mval;
+				out(x, y, z) = max;
 			}
 		}
-	}
+	});
 }
 
-inline void PoolingLayer::calc_grads(tensor<float>& grad_next_layer)
+inline void PoolingLayer::calc_grads(tensor_view<float> grad_next_layer)
 {
-	for (int x = 0; x < _input._size._x; x++) {
-		for (int y = 0; y < _input._size._y; y++) {
-			range rn = map_to_output(x, y);
+	backward(get_input(), get_output(), grad_next_layer, get_gradients());
+}
 
-			for (int z = 0; z < _input._size._z; z++) {
-				float sum_error = 0;
-				for (int i = rn.min_x; i <= rn.max_x; i++) {
-					int minx = i * _stride;
+inline void PoolingLayer::calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const
+{
+	bind_views(ctx._gradients, ctx._gradient_memory, (int)grad_next_layer.size(), _gradients._size, _layout);
 
-					for (int j = rn.min_y; j <= rn.max_y; j++) {
-						int miny = j * _stride;
+	for (unsigned int b = 0; b < grad_next_layer.size(); b++) {
+		backward(ctx._input[b], ctx._output[b], grad_next_layer[b], ctx._gradients[b]);
+	}
+}
 
-						int is_max = _input(x, y, z) == _output(i, j, z) ? 1 : 0;
-						sum_error += is_max * grad_next_layer(i, j, z);
+// Every input equal to the max of a window it is in gets that window's
+// gradient, summed over the windows where windows overlap
+inline void PoolingLayer::backward(tensor_view<float> in, tensor_view<float> out, tensor_view<float> grad_next_layer, tensor_view<float> grads) const
+{
+	task_pool& pool = intra_op_pool();
+	double cost = 2.0 * _filter_dem * _filter_dem * out._size._x * out._size._y;
+
+	// overlapping windows add onto the same inputs, so the work is split by
+	// channel, which no two channels share
+	pool.parallel_for(grads._size._z, cost, [&](int first, int last) {
+		for (int z = first; z < last; z++) {
+			for (int y = 0; y < grads._size._y; y++) {
+				for (int x = 0; x < grads._size._x; x++) {
+					grads(x, y, z) = 0;
+				}
+			}
+		}
+
+		if (_layout == layout_t::HWC && in._strides._z == 1 && out._strides._z == 1 &&
+			grad_next_layer._strides._z == 1 && grads._strides._z == 1) {
+			for (int y = 0; y < out._size._y; y++) {
+				for (int x = 0; x < out._size._x; x++) {
+					const float* max = &out(x, y, 0);
+					const float* grad = &grad_next_layer(x, y, 0);
+
+					for (int i = 0; i < _filter_dem; i++) {
+						for (int j = 0; j < _filter_dem; j++) {
+							const float* v = &in(x * _stride + i, y * _stride + j, 0);
+							float* sum = &grads(x * _stride + i, y * _stride + j, 0);
+
+							for (int z = first; z < last; z++) {
+								sum[z] += v[z] == max[z] ? grad[z] : 0.0f;
+							}
+						}
 					}
 				}
+			}
+			return;
+		}
 
-				_gradients(x, y, z) = sum_error;
+		for (int z = first; z < last; z++) {
+			for (int y = 0; y < out._size._y; y++) {
+				for (int x = 0; x < out._size._x; x++) {
+					float max = out(x, y, z);
+					float grad = grad_next_layer(x, y, z);
+
+					for (int i = 0; i < _filter_dem; i++) {
+						for (int j = 0; j < _filter_dem; j++) {
+							if (in(x * _stride + i, y * _stride + j, z) == max) {
+								grads(x * _stride + i, y * _stride + j, z) += grad;
+							}
+						}
+					}
+				}
 			}
 		}
-	}
+	});
 }
 
 inline std::string PoolingLayer::to_string()
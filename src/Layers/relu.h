@@ -11,6 +11,9 @@ class ReluLayer : public layer
 private:
 	void activate();
 
+	void forward(tensor_view<float> in, tensor_view<float> out) const;
+	void backward(tensor_view<float> in, tensor_view<float> grad_next_layer, tensor_view<float> grads) const;
+
 public:
 
 	explicit ReluLayer(td_size in_size);
@@ -21,14 +24,21 @@ public:
 		_gradients = grads;
 	}
 
-	void activate(tensor<float>& in) {
-		this->_input = in;
+	void activate(tensor_view<float> in) {
+		copy_view(in, get_input());
 		activate();
 	}
 
-	
-	void fix_weights(float learning_rate) { };
-	void calc_grads(tensor<float>& grad_next_layer);
+	void activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const;
+	void calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const;
+	void infer(tensor_view<float> in, tensor_view<float> out, layer_context& ctx) const { forward(in, out); }
+
+	void calc_grads(tensor_view<float> grad_next_layer);
+
+	layer_t type() const { return layer_t::Relu; }
+
+	// Elementwise, so every layout is as good as any other
+	bool set_layout(layout_t layout) { _layout = layout; return true; }
 	std::string to_string();
 };
 
@@ -41,26 +51,70 @@ inline ReluLayer::ReluLayer(td_size in_size)
 
 inline void ReluLayer::activate()
 {
-	for (int i = 0; i < _input._size._x; i++) {
-		for (int j = 0; j < _input._size._y; j++) {
-			for (int k = 0; k < _input._size._z; k++) {
-				float v = _input(i, j, k);
-				if (v < 0) {
-					v = 0;
-				}
-
-				_output(i, j, k) = v;
+	forward(get_input(), get_output());
+}
+
+inline void ReluLayer::activate(const std::vector<tensor_view<float>>& batch, layer_context& ctx) const
+{
+	bind_views(ctx._output, ctx._output_memory, (int)batch.size(), _output._size, _layout);
+	ctx._input.assign(batch.begin(), batch.end());
+
+	for (unsigned int b = 0; b < batch.size(); b++) {
+		forward(ctx._input[b], ctx._output[b]);
+	}
+}
+
+inline void ReluLayer::forward(tensor_view<float> in, tensor_view<float> out) const
+{
+	// dense views of one layout line up element by element, whatever it is
+	if (in.is_dense(_layout) && out.is_dense(_layout)) {
+		int count = in._size._x * in._size._y * in._size._z;
+
+		for (int i = 0; i < count; i++) {
+			out._data[i] = in._data[i] < 0 ? 0 : in._data[i];
+		}
+		return;
+	}
+
+	for (int k = 0; k < in._size._z; k++) {
+		for (int j = 0; j < in._size._y; j++) {
+			for (int i = 0; i < in._size._x; i++) {
+				float v = in(i, j, k);
+				out(i, j, k) = v < 0 ? 0 : v;
 			}
 		}
 	}
 }
 
-inline void ReluLayer::calc_grads(tensor<float>& grad_next_layer)
+inline void ReluLayer::calc_grads(tensor_view<float> grad_next_layer)
+{
+	backward(get_input(), grad_next_layer, get_gradients());
+}
+
+inline void ReluLayer::calc_grads(const std::vector<tensor_view<float>>& grad_next_layer, layer_context& ctx) const
+{
+	bind_views(ctx._gradients, ctx._gradient_memory, (int)grad_next_layer.size(), _gradients._size, _layout);
+
+	for (unsigned int b = 0; b < grad_next_layer.size(); b++) {
+		backward(ctx._input[b], grad_next_layer[b], ctx._gradients[b]);
+	}
+}
+
+inline void ReluLayer::backward(tensor_view<float> in, tensor_view<float> grad_next_layer, tensor_view<float> grads) const
 {
-	for (int i = 0; i < _input._size._x; i++) {
-		for (int j = 0; j < _input._size._y; j++) {
-			for (int k = 0; k < _input._size._z; k++) {
-				_gradients(i, j, k) = (_input(i, j, k) < 0) ? 0 : 1 * grad_next_layer(i, j, k);
+	if (in.is_dense(_layout) && grad_next_layer.is_dense(_layout) && grads.is_dense(_layout)) {
+		int count = in._size._x * in._size._y * in._size._z;
+
+		for (int i = 0; i < count; i++) {
+			grads._data[i] = in._data[i] < 0 ? 0 : grad_next_layer._data[i];
+		}
+		return;
+	}
+
+	for (int k = 0; k < in._size._z; k++) {
+		for (int j = 0; j < in._size._y; j++) {
+			for (int i = 0; i < in._size._x; i++) {
+				grads(i, j, k) = in(i, j, k) < 0 ? 0 : grad_next_layer(i, j, k);
 			}
 		}
 	}
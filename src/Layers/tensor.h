@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cassert>
+#include <cstring>
+#include <iterator>
 #include <sstream>
+#include <utility>
 #include <vector>
 #include <iostream>
 
@@ -16,12 +19,16 @@ struct tensor
 	T* _data;
 	td_size _size;
 
+	// false for tensors made by borrow(), whose memory belongs to someone else
+	bool _owner;
+
 	tensor() 
 	{
 		_data = nullptr;
 		_size._x = 0;
 		_size._y = 0;
 		_size._z = 0;
+		_owner = true;
 	}
 
 	tensor(int x, int y, int z) 
@@ -30,27 +37,70 @@ struct tensor
 		_size._x = x;
 		_size._y = y;
 		_size._z = z;
+		_owner = true;
 	}
 
+	// Copies always own their memory, even when other is borrowed. A copy of a
+	// tensor without memory, see shape(), has none either.
 	tensor(const tensor& other)
 	{
-		_data = new T[other._size._x * other._size._y * other._size._y];
-		memcpy(this->_data, 
-			   other._data, 
-			   other._size._x * other._size._y * other._size._z * sizeof(T));
-		this->_size = other._size;
+		int count = other._size._x * other._size._y * other._size._z;
+
+		if (other._data == nullptr) {
+			_data = nullptr;
+			_size = other._size;
+			_owner = true;
+			return;
+		}
+
+		_data = new T[count];
+		_size = other._size;
+		_owner = true;
+		memcpy(_data, other._data, count * sizeof(T));
+	}
+
+	tensor(tensor&& other) noexcept
+	{
+		_data = other._data;
+		_size = other._size;
+		_owner = other._owner;
+
+		other._data = nullptr;
+		other._size = { 0, 0, 0 };
+		other._owner = true;
+	}
+
+	// A tensor over memory that outlives it, e.g. a memory mapped model file.
+	// It reads and writes data in place and never frees it.
+	static tensor<T> borrow(T* data, td_size size)
+	{
+		tensor<T> t;
+		t._data = data;
+		t._size = size;
+		t._owner = false;
+		return t;
 	}
 
+	// A tensor of the given size without any memory, for a shape that is
+	// kept after the values are no longer needed
+	static tensor<T> shape(td_size size)
+	{
+		tensor<T> t;
+		t._size = size;
+		return t;
+	}
+
+	// Copy and swap, so the old buffer is released and a failed allocation
+	// leaves this tensor untouched
 	tensor<T>& operator=(const tensor<T>& rhs)
 	{
-		if (&rhs == this) {
-			return *this;
+		if (&rhs != this) {
+			tensor<T> copy(rhs);
+			std::swap(_data, copy._data);
+			std::swap(_size, copy._size);
+			std::swap(_owner, copy._owner);
 		}
 
-		this->_data = new T[rhs._size._x * rhs._size._y * rhs._size._y];
-		memcpy(this->_data, rhs._data, rhs._size._x * rhs._size._y * rhs._size._y * sizeof(T));
-		this->_size = rhs._size;
-
 		return *this;
 	}
 
@@ -60,11 +110,16 @@ struct tensor
 			return *this;
 		}
 
-		delete[] this->_data;
+		if (_owner) {
+			delete[] this->_data;
+		}
 
 		this->_data = rhs._data;
 		this->_size = rhs._size;
+		this->_owner = rhs._owner;
 		rhs._data = nullptr;
+		rhs._size = { 0, 0, 0 };
+		rhs._owner = true;
 
 		return *this;
 	}
@@ -124,11 +179,137 @@ struct tensor
 	}
 
 	~tensor() { 
-		delete[] _data;
+		if (_owner) {
+			delete[] _data;
+		}
 		this->_data = nullptr;
 	}
 };
 
+// Order of the elements of a dense tensor. CHW stores every channel as one
+// plane, the order of tensor::get() and of everything read from or written to
+// disk. HWC stores the channels of every position next to each other, so the
+// layers that walk over the channels of a position read contiguous vectors.
+enum class layout_t
+{
+	CHW,
+	HWC
+};
+
+// Distance in elements between neighbours along x, y and z in a dense tensor
+inline td_size layout_strides(td_size size, layout_t layout)
+{
+	if (layout == layout_t::HWC) {
+		return { size._z, size._x * size._z, 1 };
+	}
+
+	return { 1, size._x, size._x * size._y };
+}
+
+// Non-owning window onto tensor shaped memory, e.g. a tensor's own buffer or a
+// piece of an arena. Copying a view never copies the data. _strides holds the
+// distance in elements between neighbours along x, y and z, so a view can also
+// pick a sub-box out of a larger tensor or read memory in another layout_t.
+// Views built from a pointer and a size are dense in their layout, and only
+// dense views may be walked through _data directly.
+template<typename T>
+struct tensor_view
+{
+	T* _data;
+	td_size _size;
+	td_size _strides;
+
+	tensor_view()
+	{
+		_data = nullptr;
+		_size = { 0, 0, 0 };
+		_strides = { 0, 0, 0 };
+	}
+
+	tensor_view(T* data, td_size size)
+	{
+		_data = data;
+		_size = size;
+		_strides = { 1, size._x, size._x * size._y };
+	}
+
+	tensor_view(T* data, td_size size, layout_t layout)
+	{
+		_data = data;
+		_size = size;
+		_strides = layout_strides(size, layout);
+	}
+
+	tensor_view(T* data, td_size size, td_size strides)
+	{
+		_data = data;
+		_size = size;
+		_strides = strides;
+	}
+
+	tensor_view(tensor<T>& t) : tensor_view(t._data, t._size) { }
+
+	bool is_dense(layout_t layout = layout_t::CHW) const
+	{
+		td_size dense = layout_strides(_size, layout);
+		return _strides._x == dense._x && _strides._y == dense._y && _strides._z == dense._z;
+	}
+
+	// The box of the given size whose first element is at origin
+	tensor_view<T> slice(point origin, td_size size) const
+	{
+		return tensor_view<T>(&get(origin._x, origin._y, origin._z), size, _strides);
+	}
+
+	T& get(int x, int y, int z) const
+	{
+		assert(x >= 0 && y >= 0 && z >= 0);
+		assert(_size._x > x && _size._y > y && _size._z > z);
+
+		return _data[z * _strides._z + y * _strides._y + x * _strides._x];
+	}
+
+	T& operator()(int x, int y, int z) const
+	{
+		return this->get(x, y, z);
+	}
+};
+
+// Copies the elements of from into to, which must have the same size
+template<typename T>
+static void copy_view(tensor_view<T> from, tensor_view<T> to)
+{
+	assert(from._size._x == to._size._x && from._size._y == to._size._y && from._size._z == to._size._z);
+
+	for (layout_t layout : { layout_t::CHW, layout_t::HWC }) {
+		if (from.is_dense(layout) && to.is_dense(layout)) {
+			memmove(to._data, from._data, from._size._x * from._size._y * from._size._z * sizeof(T));
+			return;
+		}
+	}
+
+	for (int z = 0; z < from._size._z; z++) {
+		for (int y = 0; y < from._size._y; y++) {
+			for (int x = 0; x < from._size._x; x++) {
+				to(x, y, z) = from(x, y, z);
+			}
+		}
+	}
+}
+
+// Points views at count consecutive tensors of the given size and layout
+// starting at memory
+template<typename T>
+static void bind_views(std::vector<tensor_view<T>>& views, T* memory, int count, td_size size, layout_t layout = layout_t::CHW)
+{
+	int stride = size._x * size._y * size._z;
+	views.resize(count);
+
+	for (int i = 0; i < count; i++) {
+		views[i] = tensor_view<T>(memory + i * stride, size, layout);
+	}
+}
+
 static void print_tensor(tensor<float>& data)
 {
 	int x = data._size._x;
@@ -218,7 +399,7 @@ static tensor<float> convert_to_tensor(std::vector<float> data)
 	return tensor;
 }
 
-static std::string tensor_to_string(tensor<float>& data)
+static std::string tensor_to_string(tensor_view<float> data)
 {
 	std::stringstream ss;
 	ss << data._size._x << " " << data._size._y << " " << data._size._z << " ";
@@ -249,7 +430,7 @@ static tensor<float> string_to_tensor(const std::string& s)
 	for (int i = 0; i < z; i++) {
 		for (int j = 0; j < y; j++) {
 			for (int k = 0; k < x; k++) {
-				input_tensor(k, j, i) = v[x * y * i + y * j + k + 3];
+				input_tensor(k, j, i) = v[x * y * i + x * j + k + 3];
 			}
 		}
 	}
@@ -1,9 +1,8 @@
 #ifndef ACTIVATION_H
 #define ACTIVATION_H
 
+#include <cfloat>
 #include <cmath>
-#include <vector>
-#include "tensor.h"
 
 enum class activation_t
 {
@@ -14,129 +13,102 @@ enum class activation_t
 	Softmax
 };
 
-static tensor<float> net_tanh(std::vector<float> x)
-{
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = tanh(x[i]);
-	}
-
-	return a;
-}
+// The element-wise activations as types: f is the activation and df the
+// derivative the layers use. Tanh's df is of the value f returned, the others'
+// of the value f takes. Kernels templated on an activation_t get them inlined
+// instead of calling through a pointer. Softmax isn't element-wise and has no
+// activation_op.
+template<activation_t A>
+struct activation_op;
 
-static tensor<float> tanh_dev(std::vector<float> x)
+template<>
+struct activation_op<activation_t::Tanh>
 {
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = (1 - (x[i] * x[i]));
-	}
-
-	return a;
-}
+	static float f(float x) { return tanh(x); }
+	static float df(float x) { return (1 - (x * x)); }
+};
 
-static tensor<float> sig(std::vector<float> x)
+template<>
+struct activation_op<activation_t::Sigmoid>
 {
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = (1 / (1 + (exp(-x[i]))));
-	}
+	static float f(float x) { return (1 / (1 + (exp(-x)))); }
+	static float df(float x) { return ((exp(-x)) / pow(1 + exp(-x), 2)); }
+};
 
-	return a;
-}
-static tensor<float> sigmoid_dev(std::vector<float> x)
+template<>
+struct activation_op<activation_t::Relu>
 {
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = ((exp(-x[i])) / pow(1 + exp(-x[i]), 2));
-	}
-
-	return a;
-}
+	static float f(float x) { return x > 0 ? x : 0; }
+	static float df(float x) { return x > 0 ? 1.0f : 0.0f; }
+};
 
-static tensor<float> relu(std::vector<float> x)
+template<>
+struct activation_op<activation_t::LRelu>
 {
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = x[i] > 0 ? x[i] : 0;
-	}
-
-	return a;
-}
+	static float f(float x) { return x > 0 ? x : 0.01f * x; }
+	static float df(float x) { return x > 0 ? 1.0f : 0.01f; }
+};
 
-static tensor<float> relu_dev(std::vector<float> x)
+template<activation_t A>
+static void apply_activation(const float* x, float* out, int n)
 {
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = x[i] > 0 ? 1.0f : 0.0f;
+	for (int i = 0; i < n; i++) {
+		out[i] = activation_op<A>::f(x[i]);
 	}
-
-	return a;
 }
 
-static tensor<float> lRelu(std::vector<float> x)
+template<activation_t A>
+static void apply_derivative(const float* x, float* out, int n)
 {
-	tensor<float> a(x.size(), 1, 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = x[i] > 0 ? x[i] : 0.01f * x[i];
+	for (int i = 0; i < n; i++) {
+		out[i] = activation_op<A>::df(x[i]);
 	}
-
-	return a;
 }
-static tensor<float> lRelu_dev(std::vector<float> x)
-{
-	tensor<float> a(x.size(), 1, 1);
 
-	for (int i = 0; i < x.size(); i++) {
-		a(i, 0, 0) = x[i] > 0 ? 1.0f : 0.01f;
-	}
+// Every activation reads n values from x and writes n results to out. out may
+// be x itself, nothing is allocated.
 
-	return a;
-}
+static void net_tanh(const float* x, float* out, int n) { apply_activation<activation_t::Tanh>(x, out, n); }
+static void tanh_dev(const float* x, float* out, int n) { apply_derivative<activation_t::Tanh>(x, out, n); }
+static void sig(const float* x, float* out, int n) { apply_activation<activation_t::Sigmoid>(x, out, n); }
+static void sigmoid_dev(const float* x, float* out, int n) { apply_derivative<activation_t::Sigmoid>(x, out, n); }
+static void relu(const float* x, float* out, int n) { apply_activation<activation_t::Relu>(x, out, n); }
+static void relu_dev(const float* x, float* out, int n) { apply_derivative<activation_t::Relu>(x, out, n); }
+static void lRelu(const float* x, float* out, int n) { apply_activation<activation_t::LRelu>(x, out, n); }
+static void lRelu_dev(const float* x, float* out, int n) { apply_derivative<activation_t::LRelu>(x, out, n); }
 
-static tensor<float> softmax(std::vector<float> x)
+static void softmax(const float* x, float* out, int n)
 {
-	tensor<float> a(x.size(), 1, 1);
-
 	float exp_sum = 0.0f;
 	float output_max = -FLT_MAX;
 
-	std::vector<float> shift_output = x;
-	for (int i = 0; i < shift_output.size(); i++) {
-		if (output_max < shift_output[i]) output_max = shift_output[i];
+	for (int i = 0; i < n; i++) {
+		if (output_max < x[i]) output_max = x[i];
 	}
 
-	for (int i = 0; i < shift_output.size(); i++) {
-		shift_output[i] = exp((shift_output[i] - output_max));
-		exp_sum += shift_output[i];
+	for (int i = 0; i < n; i++) {
+		out[i] = exp((x[i] - output_max));
+		exp_sum += out[i];
 	}
 
-	for (int n = 0; n < x.size(); n++) {
-		a(n, 0, 0) = shift_output[n] / exp_sum;
+	for (int i = 0; i < n; i++) {
+		out[i] /= exp_sum;
 	}
-
-	return a;
 }
 
-static tensor<float> softmax_dev(std::vector<float> x)
+// Gradient of the softmax inputs from the gradient of its outputs s, i.e. the
+// Jacobian diag(s) - s * s^T times grads, in O(n) without forming the Jacobian
+static void softmax_backward(const float* s, const float* grads, float* out, int n)
 {
-	tensor<float> s = softmax(x);
+	float dot = 0.0f;
 
-	tensor<float> a(x.size(), x.size(), 1);
-
-	for (int i = 0; i < x.size(); i++) {
-		for (int j = 0; j < x.size(); j++) {
-			a(i, j, 0) = s(i, 0, 0) * ((i == j) - s(j, 0, 0));
-		}
+	for (int i = 0; i < n; i++) {
+		dot += s[i] * grads[i];
 	}
 
-	return a;
+	for (int i = 0; i < n; i++) {
+		out[i] = s[i] * (grads[i] - dot);
+	}
 }
 
 #endif // !ACTIVATION_H
@@ -1,24 +1,14 @@
 #ifndef LEARNING_H
 #define LEARNING_H
 
+#include <cmath>
 #include "../Layers/layer.h"
 
+// Defaults of the momentum SGD every network starts with, see
+// Learning/optimizer.h
 constexpr float MOMENTUM = 0.6f;
 constexpr float WEIGHT_DECAY = 0.001f;
 
-
-static float update_weight(float w, gradient& grad, float learning_rate, float multplier = 1)
-{
-	float m = (grad.grad + grad.prev_grad * MOMENTUM);
-	w -= learning_rate * m * multplier + learning_rate * WEIGHT_DECAY * w;
-	return w;
-}
-
-static void update_gradient(gradient& grad)
-{
-	grad.prev_grad = (grad.grad + grad.prev_grad * MOMENTUM);
-}
-
 enum class loss_t
 {
 	MeanSquaredError,
@@ -26,52 +16,57 @@ enum class loss_t
 	CategoricalCrossentropy
 };
 
-static float MSE(std::vector<tensor<float>> output, std::vector<tensor<float>> expected)
+// The losses of a set of samples are taken from one running sum over every
+// value of every sample; accumulate_loss() adds the values of one sample to it
+// and sum_to_loss() turns the sum of count samples into their loss, so an
+// epoch's loss can be summed as it trains without keeping its outputs.
+static float accumulate_loss(loss_t loss, const float* output, const float* expected, int size, float sum)
 {
-	float sum_squared_error = 0.0f;
-
-	int tensor_size = output[0]._size._x * output[0]._size._y * output[0]._size._z;
-
-	for (unsigned int i = 0; i < output.size(); i++) {
-		for (int j = 0; j < tensor_size; j++) {
-			float sum = output[i]._data[j] + expected[i]._data[j];
-			sum_squared_error += sum * sum;
+	for (int j = 0; j < size; j++) {
+		if (loss == loss_t::MeanSquaredError) {
+			float value = output[j] + expected[j];
+			sum += value * value;
+		}
+		else {
+			sum += expected[j] * log(1e-15 * output[j]);
 		}
 	}
 
-	return 1.0 / (output.size() * sum_squared_error);
+	return sum;
 }
 
-static float BinaryCrossentropy(std::vector<tensor<float>> output, std::vector<tensor<float>> expected)
+static float sum_to_loss(loss_t loss, float sum, size_t count)
 {
-	float sum_score = 0.0f;
+	float mean_sum = 1.0 / (count * sum);
+	return loss == loss_t::MeanSquaredError ? mean_sum : -mean_sum;
+}
+
+static float batch_loss(loss_t loss, const std::vector<tensor<float>>& output, const std::vector<tensor<float>>& expected)
+{
+	float sum = 0.0f;
 
 	int tensor_size = output[0]._size._x * output[0]._size._y * output[0]._size._z;
 
 	for (unsigned int i = 0; i < output.size(); i++) {
-		for (int j = 0; j < tensor_size; j++) {
-			sum_score += expected[i]._data[j] * log(1e-15 * output[i]._data[j]);
-		}
+		sum = accumulate_loss(loss, output[i]._data, expected[i]._data, tensor_size, sum);
 	}
 
-	float mean_sum_score =  1.0 / (output.size() * sum_score);
-	return -mean_sum_score;
+	return sum_to_loss(loss, sum, output.size());
 }
 
-static float CategoricalCrossentropy(std::vector<tensor<float>> output, std::vector<tensor<float>> expected)
+static float MSE(std::vector<tensor<float>> output, std::vector<tensor<float>> expected)
 {
-	float sum_score = 0.0f;
-
-	int tensor_size = output[0]._size._x * output[0]._size._y * output[0]._size._z;
+	return batch_loss(loss_t::MeanSquaredError, output, expected);
+}
 
-	for (unsigned int i = 0; i < output.size(); i++) {
-		for (int j = 0; j < tensor_size; j++) {
-			sum_score += expected[i]._data[j] * log(1e-15 * output[i]._data[j]);
-		}
-	}
+static float BinaryCrossentropy(std::vector<tensor<float>> output, std::vector<tensor<float>> expected)
+{
+	return batch_loss(loss_t::BinaryCrossentropy, output, expected);
+}
 
-	float mean_sum_score = 1.0 / (output.size() * sum_score);
-	return -mean_sum_score;
+static float CategoricalCrossentropy(std::vector<tensor<float>> output, std::vector<tensor<float>> expected)
+{
+	return batch_loss(loss_t::CategoricalCrossentropy, output, expected);
 }
 
 #endif
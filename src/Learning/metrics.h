@@ -0,0 +1,111 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "learning.h"
+
+// Loss of a single sample, output and expected holding size values each. The
+// probabilities the crossentropies take the log of are clamped away from 0 and 1.
+inline float sample_loss(loss_t loss, const float* output, const float* expected, int size)
+{
+	const float epsilon = 1e-7f;
+	float sum = 0.0f;
+
+	for (int j = 0; j < size; j++) {
+		float p = std::min(std::max(output[j], epsilon), 1.0f - epsilon);
+
+		if (loss == loss_t::MeanSquaredError) {
+			float delta = output[j] - expected[j];
+			sum += delta * delta;
+		}
+		else if (loss == loss_t::BinaryCrossentropy) {
+			sum -= expected[j] * std::log(p) + (1.0f - expected[j]) * std::log(1.0f - p);
+		}
+		else {
+			sum -= expected[j] * std::log(p);
+		}
+	}
+
+	return loss == loss_t::CategoricalCrossentropy ? sum : sum / size;
+}
+
+// How SharPNetConv::evaluate() streams a dataset: batch_size samples are read
+// at a time by nr_readers threads of a prefetcher, see Data/prefetcher.h, and
+// every batch is split across nr_threads threads that predict a shard each.
+struct evaluation_options
+{
+	int batch_size = 64;
+	int nr_threads = 1;
+	int nr_readers = 1;
+	int top_k = 5;
+};
+
+// Metrics of a classifier over a dataset, kept as running sums and counts, so
+// their size depends on the number of classes but not of samples. The class a
+// sample belongs to is its largest expected value, the predicted one the
+// largest output. A sample is in the top k when fewer than k outputs are larger
+// than the one of its class. Each thread adds its samples to an evaluation of
+// its own and merge() sums them; the counts come out the same in any order.
+struct evaluation
+{
+	int _nr_classes = 0;
+	int _top_k = 1;
+
+	uint64_t _samples = 0;
+	uint64_t _correct = 0;
+	uint64_t _top_k_correct = 0;
+	double _loss = 0.0;
+
+	// _nr_classes x _nr_classes, row: actual class, column: predicted one
+	std::vector<uint64_t> _confusion;
+
+	evaluation() { }
+	evaluation(int nr_classes, int top_k)
+		: _nr_classes(nr_classes), _top_k(std::max(top_k, 1)), _confusion((size_t)nr_classes * nr_classes, 0) { }
+
+	void add(const float* output, const float* expected, float loss);
+	void merge(const evaluation& other);
+
+	double mean_loss() const { return _samples > 0 ? _loss / _samples : 0.0; }
+	double accuracy() const { return _samples > 0 ? (double)_correct / _samples : 0.0; }
+	double top_k_accuracy() const { return _samples > 0 ? (double)_top_k_correct / _samples : 0.0; }
+
+	uint64_t confusion(int actual, int predicted) const { return _confusion[(size_t)actual * _nr_classes + predicted]; }
+};
+
+inline void evaluation::add(const float* output, const float* expected, float loss)
+{
+	int actual = (int)(std::max_element(expected, expected + _nr_classes) - expected);
+	int predicted = (int)(std::max_element(output, output + _nr_classes) - output);
+
+	int larger = 0;
+	for (int j = 0; j < _nr_classes; j++) {
+		larger += output[j] > output[actual];
+	}
+
+	_samples++;
+	_correct += predicted == actual;
+	_top_k_correct += larger < _top_k;
+	_loss += loss;
+	_confusion[(size_t)actual * _nr_classes + predicted]++;
+}
+
+inline void evaluation::merge(const evaluation& other)
+{
+	assert(other._nr_classes == _nr_classes && other._top_k == _top_k);
+
+	_samples += other._samples;
+	_correct += other._correct;
+	_top_k_correct += other._top_k_correct;
+	_loss += other._loss;
+
+	for (size_t i = 0; i < _confusion.size(); i++) {
+		_confusion[i] += other._confusion[i];
+	}
+}
+
+#endif // !METRICS_H
@@ -0,0 +1,201 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cmath>
+#include <vector>
+#include "learning.h"
+#include "../Layers/layer.h"
+#include "../Math/simd.h"
+
+// Updates the weights of every layer registered with add_layer() from the
+// gradients set_weight_grads() left in it. The weights stay with their layers,
+// which may borrow them from a mapped file, but the optimizer's state for all
+// of them lives in one flat buffer: state_size() arrays per layer, each as long
+// as its weights. Every update is one vectorized pass over weights, gradients
+// and state, see Math/simd.h.
+class optimizer
+{
+private:
+	struct parameter_block
+	{
+		layer* _layer;
+		size_t _offset;		// of the block's state in _state
+	};
+
+	std::vector<parameter_block> _blocks;
+	std::vector<float> _state;
+
+protected:
+	float _learning_rate;
+	float _weight_decay;
+	long long _steps = 0;
+
+	// Floats of state kept per weight
+	virtual int state_size() const = 0;
+
+	// Updates n weights from their gradients; state holds state_size() arrays
+	// of n floats. _steps already counts the current step.
+	virtual void update(float* weights, const float* grads, float* state, int n) = 0;
+
+public:
+	optimizer(float learning_rate, float weight_decay) : _learning_rate(learning_rate), _weight_decay(weight_decay) { }
+	virtual ~optimizer() { }
+
+	// Layers without weights are skipped. The state of a new layer starts at 0.
+	void add_layer(layer* l);
+	// Forgets the layers, frees their state and starts the steps over
+	void clear();
+
+	// One update of every registered layer's weights
+	void step();
+
+	// The same one layer at a time, e.g. to time each: start_step(), then
+	// update_layer() for every layer. Layers that weren't added are skipped.
+	void start_step() { _steps++; }
+	void update_layer(layer* l);
+
+	float get_learning_rate() const { return _learning_rate; }
+	void set_learning_rate(float learning_rate) { _learning_rate = learning_rate; }
+	long long get_steps() const { return _steps; }
+
+	// Everything the optimizer carries from one step to the next besides the
+	// step count, in registration order. Both are restored to resume training.
+	std::vector<float>& state() { return _state; }
+	void set_steps(long long steps) { _steps = steps; }
+};
+
+// Stochastic gradient descent with momentum, the network's default:
+// v = g + momentum * v, w -= learning_rate * v + learning_rate * decay * w.
+// With nesterov the step looks ahead along the new velocity instead,
+// w -= learning_rate * (g + momentum * v) + learning_rate * decay * w.
+class sgd_optimizer : public optimizer
+{
+private:
+	float _momentum;
+	bool _nesterov;
+
+protected:
+	int state_size() const { return 1; }
+
+	void update(float* weights, const float* grads, float* state, int n)
+	{
+		if (_nesterov) {
+			simd_nesterov_step(weights, grads, state, _learning_rate, _momentum, _weight_decay, n);
+		}
+		else {
+			simd_momentum_step(weights, grads, state, _learning_rate, _momentum, _weight_decay, n);
+		}
+	}
+
+public:
+	explicit sgd_optimizer(float learning_rate = 0.01f, float momentum = MOMENTUM, float weight_decay = WEIGHT_DECAY, bool nesterov = false)
+		: optimizer(learning_rate, weight_decay), _momentum(momentum), _nesterov(nesterov) { }
+};
+
+// RMSProp: s = rho * s + (1 - rho) * g^2,
+// w -= learning_rate * g / (sqrt(s) + epsilon) + learning_rate * decay * w
+class rmsprop_optimizer : public optimizer
+{
+private:
+	float _rho;
+	float _epsilon;
+
+protected:
+	int state_size() const { return 1; }
+
+	void update(float* weights, const float* grads, float* state, int n)
+	{
+		simd_rmsprop_step(weights, grads, state, _learning_rate, _rho, _epsilon, _weight_decay, n);
+	}
+
+public:
+	explicit rmsprop_optimizer(float learning_rate = 0.001f, float rho = 0.9f, float epsilon = 1e-8f, float weight_decay = 0.0f)
+		: optimizer(learning_rate, weight_decay), _rho(rho), _epsilon(epsilon) { }
+};
+
+// Adam with bias corrected first and second moments. Its weight decay is added
+// to the gradient, so it is scaled by the second moment like the gradient is.
+class adam_optimizer : public optimizer
+{
+private:
+	float _beta1;
+	float _beta2;
+	float _epsilon;
+	bool _decoupled;
+
+protected:
+	int state_size() const { return 2; }
+
+	void update(float* weights, const float* grads, float* state, int n)
+	{
+		adam_params p;
+		p.step_size = _learning_rate / (1.0f - std::pow(_beta1, (float)_steps));
+		p.beta1 = _beta1;
+		p.beta2 = _beta2;
+		p.correction = 1.0f / std::sqrt(1.0f - std::pow(_beta2, (float)_steps));
+		p.epsilon = _epsilon;
+		p.l2 = _decoupled ? 0.0f : _weight_decay;
+		p.decay = _decoupled ? _learning_rate * _weight_decay : 0.0f;
+
+		simd_adam_step(weights, grads, state, state + n, p, n);
+	}
+
+	adam_optimizer(float learning_rate, float beta1, float beta2, float epsilon, float weight_decay, bool decoupled)
+		: optimizer(learning_rate, weight_decay), _beta1(beta1), _beta2(beta2), _epsilon(epsilon), _decoupled(decoupled) { }
+
+public:
+	explicit adam_optimizer(float learning_rate = 0.001f, float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f, float weight_decay = 0.0f)
+		: adam_optimizer(learning_rate, beta1, beta2, epsilon, weight_decay, false) { }
+};
+
+// AdamW: Adam with the weight decay taken off the weights directly, apart
+// from the adaptive step
+class adamw_optimizer : public adam_optimizer
+{
+public:
+	explicit adamw_optimizer(float learning_rate = 0.001f, float weight_decay = 0.01f, float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f)
+		: adam_optimizer(learning_rate, beta1, beta2, epsilon, weight_decay, true) { }
+};
+
+inline void optimizer::add_layer(layer* l)
+{
+	int count = l->weight_count();
+
+	if (count == 0) {
+		return;
+	}
+
+	_blocks.push_back({ l, _state.size() });
+	_state.resize(_state.size() + (size_t)count * state_size(), 0.0f);
+}
+
+inline void optimizer::clear()
+{
+	_blocks = std::vector<parameter_block>();
+	_state = std::vector<float>();
+	_steps = 0;
+}
+
+inline void optimizer::step()
+{
+	start_step();
+
+	for (const parameter_block& block : _blocks) {
+		layer* l = block._layer;
+		update(l->get_weights()._data, l->get_weight_grads(), _state.data() + block._offset, l->weight_count());
+		l->weights_changed();
+	}
+}
+
+inline void optimizer::update_layer(layer* l)
+{
+	for (const parameter_block& block : _blocks) {
+		if (block._layer == l) {
+			update(l->get_weights()._data, l->get_weight_grads(), _state.data() + block._offset, l->weight_count());
+			l->weights_changed();
+			return;
+		}
+	}
+}
+
+#endif // !OPTIMIZER_H
@@ -0,0 +1,243 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define GEMM_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GEMM_SSE2
+#include <emmintrin.h>
+#endif
+
+// Row-major single precision GEMM: C = alpha * op(A) * op(B) + beta * C, where
+// op(A) is m x k and op(B) is k x n.
+//
+// The product is split into GEMM_KC x GEMM_MC blocks of A and GEMM_KC x GEMM_NC
+// blocks of B. Both are packed into contiguous micro-panels so the micro-kernel
+// streams them linearly out of L1/L2, and every micro-kernel call keeps a
+// GEMM_MR x GEMM_NR tile of C in registers for the whole depth of the block.
+// The tile is sized for the widest vector unit the translation unit is built for.
+
+#if defined(GEMM_AVX2)
+constexpr int GEMM_MR = 4;
+constexpr int GEMM_NR = 24;
+#elif defined(GEMM_SSE2)
+constexpr int GEMM_MR = 6;
+constexpr int GEMM_NR = 8;
+#else
+constexpr int GEMM_MR = 4;
+constexpr int GEMM_NR = 4;
+#endif
+constexpr int GEMM_MC = 120;
+constexpr int GEMM_KC = 256;
+constexpr int GEMM_NC = 3072;
+
+inline void gemm_pack_a(bool trans, const float* a, int lda, int mc, int kc, float* packed)
+{
+	for (int i = 0; i < mc; i += GEMM_MR) {
+		int mr = std::min(GEMM_MR, mc - i);
+
+		for (int p = 0; p < kc; p++) {
+			for (int r = 0; r < mr; r++) {
+				packed[r] = trans ? a[p * lda + i + r] : a[(i + r) * lda + p];
+			}
+			for (int r = mr; r < GEMM_MR; r++) {
+				packed[r] = 0;
+			}
+			packed += GEMM_MR;
+		}
+	}
+}
+
+inline void gemm_pack_b(bool trans, const float* b, int ldb, int kc, int nc, float* packed)
+{
+	for (int j = 0; j < nc; j += GEMM_NR) {
+		int nr = std::min(GEMM_NR, nc - j);
+
+		for (int p = 0; p < kc; p++) {
+			if (!trans && nr == GEMM_NR) {
+				const float* row = b + p * ldb + j;
+				for (int c = 0; c < GEMM_NR; c++) {
+					packed[c] = row[c];
+				}
+			}
+			else {
+				for (int c = 0; c < nr; c++) {
+					packed[c] = trans ? b[(j + c) * ldb + p] : b[p * ldb + j + c];
+				}
+				for (int c = nr; c < GEMM_NR; c++) {
+					packed[c] = 0;
+				}
+			}
+			packed += GEMM_NR;
+		}
+	}
+}
+
+inline void gemm_store_tile(const float* acc, float* c, int ldc, int mr, int nr, float alpha, float beta)
+{
+	for (int r = 0; r < mr; r++) {
+		float* c_row = c + r * ldc;
+		const float* acc_row = acc + r * GEMM_NR;
+
+		if (beta == 0) {
+			for (int col = 0; col < nr; col++) {
+				c_row[col] = alpha * acc_row[col];
+			}
+		}
+		else {
+			for (int col = 0; col < nr; col++) {
+				c_row[col] = alpha * acc_row[col] + beta * c_row[col];
+			}
+		}
+	}
+}
+
+// Multiplies one packed GEMM_MR panel of A with one packed GEMM_NR panel of B and
+// writes the mr x nr valid part of the tile into C.
+inline void gemm_micro_kernel(int kc, const float* a, const float* b, float* c, int ldc,
+	int mr, int nr, float alpha, float beta)
+{
+	alignas(32) float acc[GEMM_MR * GEMM_NR];
+
+#if defined(GEMM_AVX2)
+	__m256 c0[GEMM_MR];
+	__m256 c1[GEMM_MR];
+	__m256 c2[GEMM_MR];
+
+	for (int r = 0; r < GEMM_MR; r++) {
+		c0[r] = _mm256_setzero_ps();
+		c1[r] = _mm256_setzero_ps();
+		c2[r] = _mm256_setzero_ps();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		__m256 b0 = _mm256_loadu_ps(b);
+		__m256 b1 = _mm256_loadu_ps(b + 8);
+		__m256 b2 = _mm256_loadu_ps(b + 16);
+
+		for (int r = 0; r < GEMM_MR; r++) {
+			__m256 av = _mm256_broadcast_ss(a + r);
+			c0[r] = _mm256_fmadd_ps(av, b0, c0[r]);
+			c1[r] = _mm256_fmadd_ps(av, b1, c1[r]);
+			c2[r] = _mm256_fmadd_ps(av, b2, c2[r]);
+		}
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	for (int r = 0; r < GEMM_MR; r++) {
+		_mm256_store_ps(acc + r * GEMM_NR, c0[r]);
+		_mm256_store_ps(acc + r * GEMM_NR + 8, c1[r]);
+		_mm256_store_ps(acc + r * GEMM_NR + 16, c2[r]);
+	}
+#elif defined(GEMM_SSE2)
+	__m128 c0[GEMM_MR];
+	__m128 c1[GEMM_MR];
+
+	for (int r = 0; r < GEMM_MR; r++) {
+		c0[r] = _mm_setzero_ps();
+		c1[r] = _mm_setzero_ps();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		__m128 b0 = _mm_loadu_ps(b);
+		__m128 b1 = _mm_loadu_ps(b + 4);
+
+		for (int r = 0; r < GEMM_MR; r++) {
+			__m128 av = _mm_set1_ps(a[r]);
+			c0[r] = _mm_add_ps(c0[r], _mm_mul_ps(av, b0));
+			c1[r] = _mm_add_ps(c1[r], _mm_mul_ps(av, b1));
+		}
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	for (int r = 0; r < GEMM_MR; r++) {
+		_mm_store_ps(acc + r * GEMM_NR, c0[r]);
+		_mm_store_ps(acc + r * GEMM_NR + 4, c1[r]);
+	}
+#else
+	for (int i = 0; i < GEMM_MR * GEMM_NR; i++) {
+		acc[i] = 0;
+	}
+
+	for (int p = 0; p < kc; p++) {
+		for (int r = 0; r < GEMM_MR; r++) {
+			float av = a[r];
+			for (int col = 0; col < GEMM_NR; col++) {
+				acc[r * GEMM_NR + col] += av * b[col];
+			}
+		}
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+#endif
+
+	gemm_store_tile(acc, c, ldc, mr, nr, alpha, beta);
+}
+
+inline void sgemm(bool trans_a, bool trans_b, int m, int n, int k, float alpha,
+	const float* a, int lda, const float* b, int ldb, float beta, float* c, int ldc)
+{
+	if (m <= 0 || n <= 0) {
+		return;
+	}
+
+	if (k <= 0) {
+		for (int i = 0; i < m; i++) {
+			for (int j = 0; j < n; j++) {
+				c[i * ldc + j] = beta == 0 ? 0 : beta * c[i * ldc + j];
+			}
+		}
+		return;
+	}
+
+	// Packing buffers are kept per thread so repeated calls don't touch the heap.
+	thread_local std::vector<float> packed_a;
+	thread_local std::vector<float> packed_b;
+
+	packed_a.resize((size_t)GEMM_MC * GEMM_KC);
+	packed_b.resize((size_t)GEMM_KC * (GEMM_NC + GEMM_NR));
+
+	for (int jc = 0; jc < n; jc += GEMM_NC) {
+		int nc = std::min(GEMM_NC, n - jc);
+
+		for (int pc = 0; pc < k; pc += GEMM_KC) {
+			int kc = std::min(GEMM_KC, k - pc);
+			float block_beta = pc == 0 ? beta : 1.0f;
+
+			const float* b_block = trans_b ? b + jc * ldb + pc : b + pc * ldb + jc;
+			gemm_pack_b(trans_b, b_block, ldb, kc, nc, packed_b.data());
+
+			for (int ic = 0; ic < m; ic += GEMM_MC) {
+				int mc = std::min(GEMM_MC, m - ic);
+
+				const float* a_block = trans_a ? a + pc * lda + ic : a + ic * lda + pc;
+				gemm_pack_a(trans_a, a_block, lda, mc, kc, packed_a.data());
+
+				for (int jr = 0; jr < nc; jr += GEMM_NR) {
+					int nr = std::min(GEMM_NR, nc - jr);
+
+					for (int ir = 0; ir < mc; ir += GEMM_MR) {
+						int mr = std::min(GEMM_MR, mc - ir);
+
+						gemm_micro_kernel(kc,
+							packed_a.data() + ir * kc,
+							packed_b.data() + jr * kc,
+							c + (ic + ir) * ldc + jc + jr, ldc,
+							mr, nr, alpha, block_beta);
+					}
+				}
+			}
+		}
+	}
+}
+
+#endif // !GEMM_H
@@ -0,0 +1,196 @@
+#ifndef IM2COL_H
+#define IM2COL_H
+
+#include <cstdint>
+#include <cstring>
+#include "../Layers/tensor.h"
+
+// Lowers an input volume into a (filter_dem * filter_dem * in_size._z) x
+// (rows * out_size._x) patch matrix of output rows first .. first + rows - 1.
+// Row r = z * F * F + j * F + i holds input(x * stride + i, y * stride + j, z)
+// for every output position (y - first) * X + x, which is the same order a
+// filter tensor stores its weights in, so a convolution becomes a single
+// filters x patches matrix product.
+inline void im2col_rows(const float* in, td_size in_size, int filter_dem, int stride, td_size out_size, int first, int rows, float* col)
+{
+	int plane = in_size._x * in_size._y;
+	int positions = rows * out_size._x;
+
+	for (int z = 0; z < in_size._z; z++) {
+		const float* src = in + z * plane;
+
+		for (int j = 0; j < filter_dem; j++) {
+			for (int i = 0; i < filter_dem; i++) {
+				float* dst = col + ((z * filter_dem + j) * filter_dem + i) * positions;
+
+				for (int y = 0; y < rows; y++) {
+					const float* src_row = src + ((first + y) * stride + j) * in_size._x + i;
+					float* dst_row = dst + y * out_size._x;
+
+					if (stride == 1) {
+						memcpy(dst_row, src_row, out_size._x * sizeof(float));
+					}
+					else {
+						for (int x = 0; x < out_size._x; x++) {
+							dst_row[x] = src_row[x * stride];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// The patch matrix of every output row
+inline void im2col(const float* in, td_size in_size, int filter_dem, int stride, td_size out_size, float* col)
+{
+	im2col_rows(in, in_size, filter_dem, stride, out_size, 0, out_size._y, col);
+}
+
+// Inverse of im2col for gradients: adds every entry of the patch matrix back onto
+// the input position it was read from. Overlapping windows accumulate, so the
+// caller clears the destination first.
+inline void col2im(const float* col, td_size in_size, int filter_dem, int stride, td_size out_size, float* in)
+{
+	int plane = in_size._x * in_size._y;
+	int positions = out_size._x * out_size._y;
+
+	for (int z = 0; z < in_size._z; z++) {
+		float* dst = in + z * plane;
+
+		for (int j = 0; j < filter_dem; j++) {
+			for (int i = 0; i < filter_dem; i++) {
+				const float* src = col + ((z * filter_dem + j) * filter_dem + i) * positions;
+
+				for (int y = 0; y < out_size._y; y++) {
+					float* dst_row = dst + (y * stride + j) * in_size._x + i;
+					const float* src_row = src + y * out_size._x;
+
+					for (int x = 0; x < out_size._x; x++) {
+						dst_row[x * stride] += src_row[x];
+					}
+				}
+			}
+		}
+	}
+}
+
+// im2col for HWC inputs, transposed: row y * X + x of the (out_size._x *
+// out_size._y) x (filter_dem * filter_dem * in_size._z) patch matrix holds the
+// channel vectors of the window at output (x, y) back to back, column
+// (j * F + i) * Z + z being input(x * stride + i, y * stride + j, z). Every
+// window row is a single copy of F * Z contiguous floats.
+inline void im2col_hwc(const float* in, td_size in_size, int filter_dem, int stride, td_size out_size, float* col)
+{
+	int channels = in_size._z;
+	int row_size = filter_dem * channels;
+
+	for (int y = 0; y < out_size._y; y++) {
+		for (int x = 0; x < out_size._x; x++) {
+			float* dst = col + (y * out_size._x + x) * filter_dem * row_size;
+
+			for (int j = 0; j < filter_dem; j++) {
+				const float* src = in + ((y * stride + j) * in_size._x + x * stride) * channels;
+				memcpy(dst + j * row_size, src, row_size * sizeof(float));
+			}
+		}
+	}
+}
+
+// Inverse of im2col_hwc for gradients onto channels first .. last - 1 only,
+// accumulating like col2im. Disjoint ranges of channels can be folded back
+// side by side.
+inline void col2im_hwc_channels(const float* col, td_size in_size, int filter_dem, int stride, td_size out_size,
+	int first, int last, float* in)
+{
+	int channels = in_size._z;
+	int row_size = filter_dem * channels;
+
+	for (int y = 0; y < out_size._y; y++) {
+		for (int x = 0; x < out_size._x; x++) {
+			const float* src = col + (y * out_size._x + x) * filter_dem * row_size;
+
+			for (int j = 0; j < filter_dem; j++) {
+				float* dst = in + ((y * stride + j) * in_size._x + x * stride) * channels;
+				const float* src_row = src + j * row_size;
+
+				for (int i = 0; i < filter_dem; i++) {
+					for (int z = first; z < last; z++) {
+						dst[i * channels + z] += src_row[i * channels + z];
+					}
+				}
+			}
+		}
+	}
+}
+
+// Inverse of im2col_hwc for gradients, accumulating like col2im
+inline void col2im_hwc(const float* col, td_size in_size, int filter_dem, int stride, td_size out_size, float* in)
+{
+	int channels = in_size._z;
+	int row_size = filter_dem * channels;
+
+	for (int y = 0; y < out_size._y; y++) {
+		for (int x = 0; x < out_size._x; x++) {
+			const float* src = col + (y * out_size._x + x) * filter_dem * row_size;
+
+			for (int j = 0; j < filter_dem; j++) {
+				float* dst = in + ((y * stride + j) * in_size._x + x * stride) * channels;
+				const float* src_row = src + j * row_size;
+
+				for (int k = 0; k < row_size; k++) {
+					dst[k] += src_row[k];
+				}
+			}
+		}
+	}
+}
+
+// im2col of a planar 8 bit image into the packed layout of int8_gemm(), see
+// Math/int8.h: patch row k = z * F * F + j * F + i as above, four rows at a
+// time, so the bytes of rows 4q .. 4q + 3 at position p sit together at
+// (q * positions + p) * 4. Rows from in_size._z * F * F up to k4 are zero.
+inline void im2col_packed(const uint8_t* in, td_size in_size, int filter_dem, int stride, td_size out_size, int k4, uint8_t* packed)
+{
+	int plane = in_size._x * in_size._y;
+	int positions = out_size._x * out_size._y;
+	int k = in_size._z * filter_dem * filter_dem;
+
+	for (int q = 0; q < k4 / 4; q++) {
+		// offset of each of the four rows' window origin, and a mask that
+		// zeroes the padding rows, which read the origin instead
+		int offsets[4];
+		uint32_t mask = 0;
+
+		for (int lane = 0; lane < 4; lane++) {
+			int row = q * 4 + lane;
+			int z = row / (filter_dem * filter_dem);
+			int j = row / filter_dem % filter_dem;
+			int i = row % filter_dem;
+
+			offsets[lane] = row < k ? z * plane + j * in_size._x + i : 0;
+			mask |= row < k ? 0xFFu << (lane * 8) : 0;
+		}
+
+		uint8_t* dst = packed + (size_t)q * positions * 4;
+
+		for (int y = 0; y < out_size._y; y++) {
+			const uint8_t* src = in + y * stride * in_size._x;
+			const uint8_t* row0 = src + offsets[0];
+			const uint8_t* row1 = src + offsets[1];
+			const uint8_t* row2 = src + offsets[2];
+			const uint8_t* row3 = src + offsets[3];
+			uint32_t* lanes = reinterpret_cast<uint32_t*>(dst);
+
+			// the four bytes of a position as one little endian 32 bit lane
+			for (int x = 0; x < out_size._x; x++) {
+				int i = x * stride;
+				lanes[x] = (row0[i] | row1[i] << 8 | row2[i] << 16 | (uint32_t)row3[i] << 24) & mask;
+			}
+
+			dst += out_size._x * 4;
+		}
+	}
+}
+
+#endif // !IM2COL_H
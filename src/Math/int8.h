@@ -0,0 +1,326 @@
+#ifndef INT8_H
+#define INT8_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "simd.h"
+
+// Integer kernels of the quantized inference path, see SharPNetQuantizedModel.
+// Activations are unsigned 8 bit, weights signed 8 bit, and products are summed
+// exactly in 32 bit, so every instruction set computes the same integers:
+//
+//   int8_dot(a, w, n)              sum of a[i] * w[i]
+//   int8_gemm(w, b, c, m, n, k4)   c[r][p] = sum over k of w[r][k] * b(k, p)
+//
+// int8_gemm() takes b packed four k at a time, the layout VNNI's vpdpbusd
+// multiplies: b(k, p) at ((k / 4) * n + p) * 4 + k % 4, so the four bytes of
+// one position form a 32 bit lane. w holds m rows of k4 weights, k4 a multiple
+// of 4 and the weights past the real k zero. Without VNNI the AVX2 kernels
+// widen to 16 bit and use pmaddwd, which can't saturate the way pmaddubsw can
+// with full range unsigned activations.
+
+enum class int8_kernel_t
+{
+	Scalar,
+	AVX2,
+	VNNI
+};
+
+struct int8_kernels
+{
+	int32_t (*dot)(const uint8_t* a, const int8_t* w, int n);
+	void (*gemm)(const int8_t* w, const uint8_t* b, int32_t* c, int m, int n, int k4);
+};
+
+inline int32_t int8_dot_scalar(const uint8_t* a, const int8_t* w, int n)
+{
+	int32_t sum = 0;
+	for (int i = 0; i < n; i++) {
+		sum += (int32_t)a[i] * w[i];
+	}
+	return sum;
+}
+
+// Positions first..n of every row
+inline void int8_gemm_columns_scalar(const int8_t* w, const uint8_t* b, int32_t* c, int m, int n, int k4, int first)
+{
+	for (int r = 0; r < m; r++) {
+		const int8_t* row = w + (size_t)r * k4;
+
+		for (int p = first; p < n; p++) {
+			int32_t sum = 0;
+
+			for (int q = 0; q < k4 / 4; q++) {
+				const uint8_t* lane = b + ((size_t)q * n + p) * 4;
+				sum += lane[0] * row[q * 4] + lane[1] * row[q * 4 + 1] + lane[2] * row[q * 4 + 2] + lane[3] * row[q * 4 + 3];
+			}
+
+			c[(size_t)r * n + p] = sum;
+		}
+	}
+}
+
+inline void int8_gemm_scalar(const int8_t* w, const uint8_t* b, int32_t* c, int m, int n, int k4)
+{
+	int8_gemm_columns_scalar(w, b, c, m, n, k4, 0);
+}
+
+#ifdef SIMD_X86
+
+SIMD_TARGET("avx2") inline int32_t int8_dot_avx2(const uint8_t* a, const int8_t* w, int n)
+{
+	__m256i sum = _mm256_setzero_si256();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+		__m256i y = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x, y));
+	}
+
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+
+	return _mm_cvtsi128_si32(half) + int8_dot_scalar(a + i, w + i, n - i);
+}
+
+// The four weights of row r at k-quad q, widened and repeated over the four
+// positions a 16 bit half of a packed vector holds
+SIMD_TARGET("avx2") inline __m256i int8_weights_avx2(const int8_t* w)
+{
+	int32_t quad;
+	memcpy(&quad, w, 4);
+	__m128i wide = _mm_cvtepi8_epi16(_mm_cvtsi32_si128(quad));
+	return _mm256_broadcastq_epi64(wide);
+}
+
+// R rows by 8 positions. madd leaves two partial sums per position, which one
+// hadd at the end adds up, in the lane order permute4x64 undoes.
+template<int R>
+SIMD_TARGET("avx2") inline void int8_gemm_block_avx2(const int8_t* w, const uint8_t* b, int32_t* c, int n, int k4, int p)
+{
+	__m256i low[R];
+	__m256i high[R];
+
+	for (int r = 0; r < R; r++) {
+		low[r] = _mm256_setzero_si256();
+		high[r] = _mm256_setzero_si256();
+	}
+
+	for (int q = 0; q < k4 / 4; q++) {
+		__m256i packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + ((size_t)q * n + p) * 4));
+		__m256i b_low = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(packed));
+		__m256i b_high = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(packed, 1));
+
+		for (int r = 0; r < R; r++) {
+			__m256i weights = int8_weights_avx2(w + (size_t)r * k4 + q * 4);
+			low[r] = _mm256_add_epi32(low[r], _mm256_madd_epi16(b_low, weights));
+			high[r] = _mm256_add_epi32(high[r], _mm256_madd_epi16(b_high, weights));
+		}
+	}
+
+	for (int r = 0; r < R; r++) {
+		__m256i sums = _mm256_permute4x64_epi64(_mm256_hadd_epi32(low[r], high[r]), 0xD8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(c + (size_t)r * n + p), sums);
+	}
+}
+
+SIMD_TARGET("avx2") inline void int8_gemm_avx2(const int8_t* w, const uint8_t* b, int32_t* c, int m, int n, int k4)
+{
+	int full = n / 8 * 8;
+	int r = 0;
+
+	for (; r + 4 <= m; r += 4) {
+		for (int p = 0; p < full; p += 8) {
+			int8_gemm_block_avx2<4>(w + (size_t)r * k4, b, c + (size_t)r * n, n, k4, p);
+		}
+	}
+
+	for (; r < m; r++) {
+		for (int p = 0; p < full; p += 8) {
+			int8_gemm_block_avx2<1>(w + (size_t)r * k4, b, c + (size_t)r * n, n, k4, p);
+		}
+	}
+
+	int8_gemm_columns_scalar(w, b, c, m, n, k4, full);
+}
+
+SIMD_TARGET("avx512f,avx512bw,avx512vnni") inline int32_t int8_dot_vnni(const uint8_t* a, const int8_t* w, int n)
+{
+	__m512i sum = _mm512_setzero_si512();
+
+	for (int i = 0; i < n; i += 64) {
+		__mmask64 mask = n - i >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << (n - i)) - 1);
+		sum = _mm512_dpbusd_epi32(sum, _mm512_maskz_loadu_epi8(mask, a + i), _mm512_maskz_loadu_epi8(mask, w + i));
+	}
+
+	return _mm512_reduce_add_epi32(sum);
+}
+
+// R rows by 32 positions: one vpdpbusd per row and half for every four k
+template<int R>
+SIMD_TARGET("avx512f,avx512bw,avx512vnni") inline void int8_gemm_block_vnni(const int8_t* w, const uint8_t* b, int32_t* c,
+	int n, int k4, int p)
+{
+	__mmask16 mask0 = n - p >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - p)) - 1);
+	__mmask16 mask1 = n - p >= 32 ? (__mmask16)0xFFFF : n - p <= 16 ? (__mmask16)0 : (__mmask16)((1u << (n - p - 16)) - 1);
+	__m512i sum0[R];
+	__m512i sum1[R];
+
+	for (int r = 0; r < R; r++) {
+		sum0[r] = _mm512_setzero_si512();
+		sum1[r] = _mm512_setzero_si512();
+	}
+
+	for (int q = 0; q < k4 / 4; q++) {
+		const int32_t* packed = reinterpret_cast<const int32_t*>(b) + (size_t)q * n + p;
+		__m512i b0 = _mm512_maskz_loadu_epi32(mask0, packed);
+		__m512i b1 = _mm512_maskz_loadu_epi32(mask1, packed + 16);
+
+		for (int r = 0; r < R; r++) {
+			int32_t quad;
+			memcpy(&quad, w + (size_t)r * k4 + q * 4, 4);
+			__m512i weights = _mm512_set1_epi32(quad);
+
+			sum0[r] = _mm512_dpbusd_epi32(sum0[r], b0, weights);
+			sum1[r] = _mm512_dpbusd_epi32(sum1[r], b1, weights);
+		}
+	}
+
+	for (int r = 0; r < R; r++) {
+		_mm512_mask_storeu_epi32(c + (size_t)r * n + p, mask0, sum0[r]);
+		_mm512_mask_storeu_epi32(c + (size_t)r * n + p + 16, mask1, sum1[r]);
+	}
+}
+
+SIMD_TARGET("avx512f,avx512bw,avx512vnni") inline void int8_gemm_vnni(const int8_t* w, const uint8_t* b, int32_t* c,
+	int m, int n, int k4)
+{
+	int r = 0;
+
+	for (; r + 8 <= m; r += 8) {
+		for (int p = 0; p < n; p += 32) {
+			int8_gemm_block_vnni<8>(w + (size_t)r * k4, b, c + (size_t)r * n, n, k4, p);
+		}
+	}
+
+	for (; r < m; r++) {
+		for (int p = 0; p < n; p += 32) {
+			int8_gemm_block_vnni<1>(w + (size_t)r * k4, b, c + (size_t)r * n, n, k4, p);
+		}
+	}
+}
+
+#endif // SIMD_X86
+
+inline int8_kernel_t detect_int8_kernels()
+{
+#if defined(SIMD_X86) && defined(__GNUC__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) {
+		return int8_kernel_t::VNNI;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return int8_kernel_t::AVX2;
+	}
+#elif defined(SIMD_X86)
+	if (detect_simd() != simd_t::Scalar) {
+		return int8_kernel_t::AVX2;
+	}
+#endif
+	return int8_kernel_t::Scalar;
+}
+
+inline int8_kernels int8_kernels_for(int8_kernel_t level)
+{
+#ifdef SIMD_X86
+	if (level == int8_kernel_t::VNNI) {
+		return { int8_dot_vnni, int8_gemm_vnni };
+	}
+	if (level == int8_kernel_t::AVX2) {
+		return { int8_dot_avx2, int8_gemm_avx2 };
+	}
+#endif
+	return { int8_dot_scalar, int8_gemm_scalar };
+}
+
+struct int8_state
+{
+	int8_kernel_t level;
+	int8_kernels kernels;
+};
+
+inline int8_state& int8()
+{
+	static int8_state state = { detect_int8_kernels(), int8_kernels_for(detect_int8_kernels()) };
+	return state;
+}
+
+// Switches the kernels to level, or to the widest supported one below it, as
+// set_simd_level() does for the float kernels
+inline int8_kernel_t set_int8_level(int8_kernel_t level)
+{
+	int8_kernel_t supported = detect_int8_kernels();
+	int8_kernel_t chosen = (int)level > (int)supported ? supported : level;
+
+	int8().level = chosen;
+	int8().kernels = int8_kernels_for(chosen);
+	return chosen;
+}
+
+inline int8_kernel_t int8_level() { return int8().level; }
+
+inline int32_t int8_dot(const uint8_t* a, const int8_t* w, int n) { return int8().kernels.dot(a, w, n); }
+
+inline void int8_gemm(const int8_t* w, const uint8_t* b, int32_t* c, int m, int n, int k4)
+{
+	int8().kernels.gemm(w, b, c, m, n, k4);
+}
+
+// Affine mapping of floats onto 0 .. 255: value = scale * (q - zero_point)
+struct quantization
+{
+	float scale = 1.0f;
+	int32_t zero_point = 0;
+};
+
+// The mapping of [min, max], widened to take in 0 so zero stays exact
+inline quantization quantization_for(float min, float max)
+{
+	min = std::min(min, 0.0f);
+	max = std::max(max, 0.0f);
+
+	quantization q;
+	q.scale = max > min ? (max - min) / 255.0f : 1.0f;
+	q.zero_point = (int32_t)std::lround(-min / q.scale);
+	return q;
+}
+
+inline uint8_t quantize_value(float value, quantization q)
+{
+	long rounded = std::lround(value / q.scale) + q.zero_point;
+	return (uint8_t)std::min<long>(std::max<long>(rounded, 0), 255);
+}
+
+inline void quantize(const float* in, uint8_t* out, int n, quantization q)
+{
+	float inverse = 1.0f / q.scale;
+
+	for (int i = 0; i < n; i++) {
+		float rounded = std::nearbyint(in[i] * inverse) + q.zero_point;
+		out[i] = (uint8_t)std::min(std::max(rounded, 0.0f), 255.0f);
+	}
+}
+
+inline void dequantize(const uint8_t* in, float* out, int n, quantization q)
+{
+	for (int i = 0; i < n; i++) {
+		out[i] = q.scale * (in[i] - q.zero_point);
+	}
+}
+
+#endif // !INT8_H
@@ -0,0 +1,480 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SIMD_X86
+#define SIMD_TARGET(isa)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// Vector kernels for the dense layers with the instruction set picked at run
+// time, so one binary uses AVX-512 or AVX2+FMA where the CPU has them and plain
+// scalar loops everywhere else. The AVX2 and AVX-512 versions are compiled for
+// their own target whatever flags the rest of the build uses.
+//
+//   simd_dot(a, b, n)          sum of a[i] * b[i]
+//   simd_axpy(alpha, x, y, n)  y[i] += alpha * x[i]
+//   simd_scale(alpha, x, y, n) y[i] = alpha * x[i]
+//   simd_momentum_step(...)    the optimizer updates of Learning/optimizer.h
+//   simd_nesterov_step(...)    on n weights, each a single pass over the
+//   simd_rmsprop_step(...)     weights, their gradients and the optimizer's
+//   simd_adam_step(...)        state
+//
+// The vector versions sum in a different order and fuse multiply-adds, so they
+// agree with the scalar ones to rounding, not bit for bit.
+
+// Bias corrected Adam update, see adam_optimizer: l2 times the weight is added
+// to the gradient (Adam's weight decay), decay times the weight is taken off
+// it directly (AdamW's)
+struct adam_params
+{
+	float step_size;	// learning rate / (1 - beta1^t)
+	float beta1;
+	float beta2;
+	float correction;	// 1 / sqrt(1 - beta2^t)
+	float epsilon;
+	float l2;
+	float decay;
+};
+
+enum class simd_t
+{
+	Scalar,
+	AVX2,
+	AVX512
+};
+
+struct simd_kernels
+{
+	float (*dot)(const float* a, const float* b, int n);
+	void (*axpy)(float alpha, const float* x, float* y, int n);
+	void (*scale)(float alpha, const float* x, float* y, int n);
+	void (*momentum_step)(float* weights, const float* grads, float* prev_grads, float learning_rate, float momentum, float decay, int n);
+	void (*nesterov_step)(float* weights, const float* grads, float* velocity, float learning_rate, float momentum, float decay, int n);
+	void (*rmsprop_step)(float* weights, const float* grads, float* mean_square, float learning_rate, float rho, float epsilon, float decay, int n);
+	void (*adam_step)(float* weights, const float* grads, float* m, float* v, const adam_params& p, int n);
+};
+
+inline float dot_scalar(const float* a, const float* b, int n)
+{
+	float sum = 0.0f;
+	for (int i = 0; i < n; i++) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+inline void axpy_scalar(float alpha, const float* x, float* y, int n)
+{
+	for (int i = 0; i < n; i++) {
+		y[i] += alpha * x[i];
+	}
+}
+
+inline void scale_scalar(float alpha, const float* x, float* y, int n)
+{
+	for (int i = 0; i < n; i++) {
+		y[i] = alpha * x[i];
+	}
+}
+
+inline void momentum_step_scalar(float* weights, const float* grads, float* prev_grads, float learning_rate, float momentum, float decay, int n)
+{
+	for (int i = 0; i < n; i++) {
+		float m = grads[i] + prev_grads[i] * momentum;
+		weights[i] -= learning_rate * m + learning_rate * decay * weights[i];
+		prev_grads[i] = m;
+	}
+}
+
+inline void nesterov_step_scalar(float* weights, const float* grads, float* velocity, float learning_rate, float momentum, float decay, int n)
+{
+	for (int i = 0; i < n; i++) {
+		float v = grads[i] + velocity[i] * momentum;
+		weights[i] -= learning_rate * (grads[i] + momentum * v) + learning_rate * decay * weights[i];
+		velocity[i] = v;
+	}
+}
+
+inline void rmsprop_step_scalar(float* weights, const float* grads, float* mean_square, float learning_rate, float rho, float epsilon, float decay, int n)
+{
+	for (int i = 0; i < n; i++) {
+		float s = rho * mean_square[i] + (1.0f - rho) * grads[i] * grads[i];
+		weights[i] -= learning_rate * grads[i] / (std::sqrt(s) + epsilon) + learning_rate * decay * weights[i];
+		mean_square[i] = s;
+	}
+}
+
+inline void adam_step_scalar(float* weights, const float* grads, float* m, float* v, const adam_params& p, int n)
+{
+	for (int i = 0; i < n; i++) {
+		float g = grads[i] + p.l2 * weights[i];
+		m[i] = p.beta1 * m[i] + (1.0f - p.beta1) * g;
+		v[i] = p.beta2 * v[i] + (1.0f - p.beta2) * g * g;
+		weights[i] -= p.step_size * m[i] / (std::sqrt(v[i]) * p.correction + p.epsilon) + p.decay * weights[i];
+	}
+}
+
+#ifdef SIMD_X86
+
+SIMD_TARGET("avx2,fma") inline float dot_avx2(const float* a, const float* b, int n)
+{
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+	}
+	for (; i + 8 <= n; i += 8) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+	}
+
+	sum0 = _mm256_add_ps(sum0, sum1);
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+
+	float sum = _mm_cvtss_f32(half);
+	for (; i < n; i++) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+SIMD_TARGET("avx2,fma") inline void axpy_avx2(float alpha, const float* x, float* y, int n)
+{
+	__m256 a = _mm256_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+	}
+	for (; i < n; i++) {
+		y[i] += alpha * x[i];
+	}
+}
+
+SIMD_TARGET("avx2,fma") inline void scale_avx2(float alpha, const float* x, float* y, int n)
+{
+	__m256 a = _mm256_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(y + i, _mm256_mul_ps(a, _mm256_loadu_ps(x + i)));
+	}
+	for (; i < n; i++) {
+		y[i] = alpha * x[i];
+	}
+}
+
+SIMD_TARGET("avx2,fma") inline void momentum_step_avx2(float* weights, const float* grads, float* prev_grads, float learning_rate, float momentum, float decay, int n)
+{
+	__m256 lr = _mm256_set1_ps(learning_rate);
+	__m256 mom = _mm256_set1_ps(momentum);
+	__m256 lr_decay = _mm256_set1_ps(learning_rate * decay);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 w = _mm256_loadu_ps(weights + i);
+		__m256 m = _mm256_fmadd_ps(_mm256_loadu_ps(prev_grads + i), mom, _mm256_loadu_ps(grads + i));
+		__m256 step = _mm256_fmadd_ps(lr, m, _mm256_mul_ps(lr_decay, w));
+		_mm256_storeu_ps(weights + i, _mm256_sub_ps(w, step));
+		_mm256_storeu_ps(prev_grads + i, m);
+	}
+
+	momentum_step_scalar(weights + i, grads + i, prev_grads + i, learning_rate, momentum, decay, n - i);
+}
+
+SIMD_TARGET("avx2,fma") inline void nesterov_step_avx2(float* weights, const float* grads, float* velocity, float learning_rate, float momentum, float decay, int n)
+{
+	__m256 lr = _mm256_set1_ps(learning_rate);
+	__m256 mom = _mm256_set1_ps(momentum);
+	__m256 lr_decay = _mm256_set1_ps(learning_rate * decay);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 w = _mm256_loadu_ps(weights + i);
+		__m256 g = _mm256_loadu_ps(grads + i);
+		__m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(velocity + i), mom, g);
+		__m256 step = _mm256_fmadd_ps(lr, _mm256_fmadd_ps(mom, v, g), _mm256_mul_ps(lr_decay, w));
+		_mm256_storeu_ps(weights + i, _mm256_sub_ps(w, step));
+		_mm256_storeu_ps(velocity + i, v);
+	}
+
+	nesterov_step_scalar(weights + i, grads + i, velocity + i, learning_rate, momentum, decay, n - i);
+}
+
+SIMD_TARGET("avx2,fma") inline void rmsprop_step_avx2(float* weights, const float* grads, float* mean_square, float learning_rate, float rho, float epsilon, float decay, int n)
+{
+	__m256 lr = _mm256_set1_ps(learning_rate);
+	__m256 r = _mm256_set1_ps(rho);
+	__m256 one_minus_r = _mm256_set1_ps(1.0f - rho);
+	__m256 eps = _mm256_set1_ps(epsilon);
+	__m256 lr_decay = _mm256_set1_ps(learning_rate * decay);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 w = _mm256_loadu_ps(weights + i);
+		__m256 g = _mm256_loadu_ps(grads + i);
+		__m256 ms = _mm256_fmadd_ps(r, _mm256_loadu_ps(mean_square + i), _mm256_mul_ps(one_minus_r, _mm256_mul_ps(g, g)));
+		__m256 scaled = _mm256_div_ps(_mm256_mul_ps(lr, g), _mm256_add_ps(_mm256_sqrt_ps(ms), eps));
+		_mm256_storeu_ps(weights + i, _mm256_sub_ps(w, _mm256_fmadd_ps(lr_decay, w, scaled)));
+		_mm256_storeu_ps(mean_square + i, ms);
+	}
+
+	rmsprop_step_scalar(weights + i, grads + i, mean_square + i, learning_rate, rho, epsilon, decay, n - i);
+}
+
+SIMD_TARGET("avx2,fma") inline void adam_step_avx2(float* weights, const float* grads, float* m, float* v, const adam_params& p, int n)
+{
+	__m256 step_size = _mm256_set1_ps(p.step_size);
+	__m256 b1 = _mm256_set1_ps(p.beta1);
+	__m256 one_minus_b1 = _mm256_set1_ps(1.0f - p.beta1);
+	__m256 b2 = _mm256_set1_ps(p.beta2);
+	__m256 one_minus_b2 = _mm256_set1_ps(1.0f - p.beta2);
+	__m256 correction = _mm256_set1_ps(p.correction);
+	__m256 eps = _mm256_set1_ps(p.epsilon);
+	__m256 l2 = _mm256_set1_ps(p.l2);
+	__m256 decay = _mm256_set1_ps(p.decay);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 w = _mm256_loadu_ps(weights + i);
+		__m256 g = _mm256_fmadd_ps(l2, w, _mm256_loadu_ps(grads + i));
+		__m256 m1 = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i), _mm256_mul_ps(one_minus_b1, g));
+		__m256 v1 = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i), _mm256_mul_ps(one_minus_b2, _mm256_mul_ps(g, g)));
+		__m256 denominator = _mm256_fmadd_ps(_mm256_sqrt_ps(v1), correction, eps);
+		__m256 step = _mm256_div_ps(_mm256_mul_ps(step_size, m1), denominator);
+		_mm256_storeu_ps(weights + i, _mm256_sub_ps(w, _mm256_fmadd_ps(decay, w, step)));
+		_mm256_storeu_ps(m + i, m1);
+		_mm256_storeu_ps(v + i, v1);
+	}
+
+	adam_step_scalar(weights + i, grads + i, m + i, v + i, p, n - i);
+}
+
+SIMD_TARGET("avx512f") inline float dot_avx512(const float* a, const float* b, int n)
+{
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	int i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+		sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+	}
+	for (; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum0);
+	}
+
+	return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+SIMD_TARGET("avx512f") inline void axpy_avx512(float alpha, const float* x, float* y, int n)
+{
+	__m512 a = _mm512_set1_ps(alpha);
+
+	for (int i = 0; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		__m512 r = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+		_mm512_mask_storeu_ps(y + i, mask, r);
+	}
+}
+
+SIMD_TARGET("avx512f") inline void scale_avx512(float alpha, const float* x, float* y, int n)
+{
+	__m512 a = _mm512_set1_ps(alpha);
+
+	for (int i = 0; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(y + i, mask, _mm512_mul_ps(a, _mm512_maskz_loadu_ps(mask, x + i)));
+	}
+}
+
+SIMD_TARGET("avx512f") inline void momentum_step_avx512(float* weights, const float* grads, float* prev_grads, float learning_rate, float momentum, float decay, int n)
+{
+	__m512 lr = _mm512_set1_ps(learning_rate);
+	__m512 mom = _mm512_set1_ps(momentum);
+	__m512 lr_decay = _mm512_set1_ps(learning_rate * decay);
+
+	for (int i = 0; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		__m512 w = _mm512_maskz_loadu_ps(mask, weights + i);
+		__m512 m = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, prev_grads + i), mom, _mm512_maskz_loadu_ps(mask, grads + i));
+		__m512 step = _mm512_fmadd_ps(lr, m, _mm512_mul_ps(lr_decay, w));
+		_mm512_mask_storeu_ps(weights + i, mask, _mm512_sub_ps(w, step));
+		_mm512_mask_storeu_ps(prev_grads + i, mask, m);
+	}
+}
+
+SIMD_TARGET("avx512f") inline void nesterov_step_avx512(float* weights, const float* grads, float* velocity, float learning_rate, float momentum, float decay, int n)
+{
+	__m512 lr = _mm512_set1_ps(learning_rate);
+	__m512 mom = _mm512_set1_ps(momentum);
+	__m512 lr_decay = _mm512_set1_ps(learning_rate * decay);
+
+	for (int i = 0; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		__m512 w = _mm512_maskz_loadu_ps(mask, weights + i);
+		__m512 g = _mm512_maskz_loadu_ps(mask, grads + i);
+		__m512 v = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, velocity + i), mom, g);
+		__m512 step = _mm512_fmadd_ps(lr, _mm512_fmadd_ps(mom, v, g), _mm512_mul_ps(lr_decay, w));
+		_mm512_mask_storeu_ps(weights + i, mask, _mm512_sub_ps(w, step));
+		_mm512_mask_storeu_ps(velocity + i, mask, v);
+	}
+}
+
+SIMD_TARGET("avx512f") inline void rmsprop_step_avx512(float* weights, const float* grads, float* mean_square, float learning_rate, float rho, float epsilon, float decay, int n)
+{
+	__m512 lr = _mm512_set1_ps(learning_rate);
+	__m512 r = _mm512_set1_ps(rho);
+	__m512 one_minus_r = _mm512_set1_ps(1.0f - rho);
+	__m512 eps = _mm512_set1_ps(epsilon);
+	__m512 lr_decay = _mm512_set1_ps(learning_rate * decay);
+
+	for (int i = 0; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		__m512 w = _mm512_maskz_loadu_ps(mask, weights + i);
+		__m512 g = _mm512_maskz_loadu_ps(mask, grads + i);
+		__m512 ms = _mm512_fmadd_ps(r, _mm512_maskz_loadu_ps(mask, mean_square + i), _mm512_mul_ps(one_minus_r, _mm512_mul_ps(g, g)));
+		__m512 scaled = _mm512_div_ps(_mm512_mul_ps(lr, g), _mm512_add_ps(_mm512_sqrt_ps(ms), eps));
+		_mm512_mask_storeu_ps(weights + i, mask, _mm512_sub_ps(w, _mm512_fmadd_ps(lr_decay, w, scaled)));
+		_mm512_mask_storeu_ps(mean_square + i, mask, ms);
+	}
+}
+
+SIMD_TARGET("avx512f") inline void adam_step_avx512(float* weights, const float* grads, float* m, float* v, const adam_params& p, int n)
+{
+	__m512 step_size = _mm512_set1_ps(p.step_size);
+	__m512 b1 = _mm512_set1_ps(p.beta1);
+	__m512 one_minus_b1 = _mm512_set1_ps(1.0f - p.beta1);
+	__m512 b2 = _mm512_set1_ps(p.beta2);
+	__m512 one_minus_b2 = _mm512_set1_ps(1.0f - p.beta2);
+	__m512 correction = _mm512_set1_ps(p.correction);
+	__m512 eps = _mm512_set1_ps(p.epsilon);
+	__m512 l2 = _mm512_set1_ps(p.l2);
+	__m512 decay = _mm512_set1_ps(p.decay);
+
+	for (int i = 0; i < n; i += 16) {
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		__m512 w = _mm512_maskz_loadu_ps(mask, weights + i);
+		__m512 g = _mm512_fmadd_ps(l2, w, _mm512_maskz_loadu_ps(mask, grads + i));
+		__m512 m1 = _mm512_fmadd_ps(b1, _mm512_maskz_loadu_ps(mask, m + i), _mm512_mul_ps(one_minus_b1, g));
+		__m512 v1 = _mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(mask, v + i), _mm512_mul_ps(one_minus_b2, _mm512_mul_ps(g, g)));
+		__m512 denominator = _mm512_fmadd_ps(_mm512_sqrt_ps(v1), correction, eps);
+		__m512 step = _mm512_div_ps(_mm512_mul_ps(step_size, m1), denominator);
+		_mm512_mask_storeu_ps(weights + i, mask, _mm512_sub_ps(w, _mm512_fmadd_ps(decay, w, step)));
+		_mm512_mask_storeu_ps(m + i, mask, m1);
+		_mm512_mask_storeu_ps(v + i, mask, v1);
+	}
+}
+
+#endif // SIMD_X86
+
+// Widest instruction set both the CPU and the OS support
+inline simd_t detect_simd()
+{
+#if defined(SIMD_X86) && defined(__GNUC__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		return simd_t::AVX512;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return simd_t::AVX2;
+	}
+#elif defined(SIMD_X86)
+	int info[4];
+	__cpuid(info, 1);
+
+	bool fma = (info[2] & (1 << 12)) != 0;
+	bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+
+	if (os_saves_ymm) {
+		__cpuidex(info, 7, 0);
+
+		if ((info[1] & (1 << 16)) != 0 && (_xgetbv(0) & 0xE6) == 0xE6) {
+			return simd_t::AVX512;
+		}
+		if ((info[1] & (1 << 5)) != 0 && fma) {
+			return simd_t::AVX2;
+		}
+	}
+#endif
+	return simd_t::Scalar;
+}
+
+inline simd_kernels simd_kernels_for(simd_t level)
+{
+#ifdef SIMD_X86
+	if (level == simd_t::AVX512) {
+		return { dot_avx512, axpy_avx512, scale_avx512, momentum_step_avx512, nesterov_step_avx512, rmsprop_step_avx512, adam_step_avx512 };
+	}
+	if (level == simd_t::AVX2) {
+		return { dot_avx2, axpy_avx2, scale_avx2, momentum_step_avx2, nesterov_step_avx2, rmsprop_step_avx2, adam_step_avx2 };
+	}
+#endif
+	return { dot_scalar, axpy_scalar, scale_scalar, momentum_step_scalar, nesterov_step_scalar, rmsprop_step_scalar, adam_step_scalar };
+}
+
+struct simd_state
+{
+	simd_t level;
+	simd_kernels kernels;
+};
+
+inline simd_state& simd()
+{
+	static simd_state state = { detect_simd(), simd_kernels_for(detect_simd()) };
+	return state;
+}
+
+// Switches every kernel to level, or to the widest supported one below it.
+// Meant for benchmarks and tests; don't call it while other threads run kernels.
+inline simd_t set_simd_level(simd_t level)
+{
+	simd_t supported = detect_simd();
+	simd_t chosen = (int)level > (int)supported ? supported : level;
+
+	simd().level = chosen;
+	simd().kernels = simd_kernels_for(chosen);
+	return chosen;
+}
+
+inline simd_t simd_level() { return simd().level; }
+
+inline float simd_dot(const float* a, const float* b, int n) { return simd().kernels.dot(a, b, n); }
+inline void simd_axpy(float alpha, const float* x, float* y, int n) { simd().kernels.axpy(alpha, x, y, n); }
+inline void simd_scale(float alpha, const float* x, float* y, int n) { simd().kernels.scale(alpha, x, y, n); }
+
+inline void simd_momentum_step(float* weights, const float* grads, float* prev_grads, float learning_rate, float momentum, float decay, int n)
+{
+	simd().kernels.momentum_step(weights, grads, prev_grads, learning_rate, momentum, decay, n);
+}
+
+inline void simd_nesterov_step(float* weights, const float* grads, float* velocity, float learning_rate, float momentum, float decay, int n)
+{
+	simd().kernels.nesterov_step(weights, grads, velocity, learning_rate, momentum, decay, n);
+}
+
+inline void simd_rmsprop_step(float* weights, const float* grads, float* mean_square, float learning_rate, float rho, float epsilon, float decay, int n)
+{
+	simd().kernels.rmsprop_step(weights, grads, mean_square, learning_rate, rho, epsilon, decay, n);
+}
+
+inline void simd_adam_step(float* weights, const float* grads, float* m, float* v, const adam_params& p, int n)
+{
+	simd().kernels.adam_step(weights, grads, m, v, p, n);
+}
+
+#endif // !SIMD_H
@@ -0,0 +1,203 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+
+#include <algorithm>
+#include "gemm.h"
+#include "../Layers/tensor.h"
+#include "../Parallel/task_pool.h"
+
+// Winograd F(2x2, 3x3) for 3x3 stride 1 convolutions of planar tensors.
+//
+// Every 2x2 block of output is computed from a 4x4 tile of input, the tiles
+// overlapping by 2. Filters and tiles are moved into the transformed domain,
+//   U = G g G^T      V = B^T d B
+// where one elementwise product of U and V does the work of a whole 2x2 block:
+// 16 multiplies instead of 36. Summed over the channels those products are 16
+// independent (nr_filters x channels) * (channels x tiles) GEMMs, and
+//   Y = A^T M A
+// turns each 4x4 result back into the 2x2 block of output.
+//
+// Filters are laid out like ConvLayer's: one row of 3 * 3 * channels values per
+// filter, filter(x, y, c) at c * 9 + y * 3 + x. The transformed filters are
+// 16 matrices of nr_filters x channels, one per position of the 4x4 tile.
+//
+// Within a block of tiles the input transform is split across the intra-op
+// pool by channel, the products by tile position and the output transform by
+// filter, see Parallel/task_pool.h.
+
+// Tiles transformed and multiplied at a time, which bounds the scratch however
+// large the image is while keeping the GEMMs wide enough to run at full speed
+constexpr int WINOGRAD_BLOCK = 1024;
+
+// Floats of scratch winograd_conv() needs for the given shapes
+inline size_t winograd_scratch_size(int channels, int nr_filters)
+{
+	return (size_t)16 * (channels + nr_filters) * WINOGRAD_BLOCK;
+}
+
+inline void winograd_transform_filters(const float* filters, int nr_filters, int channels, float* transformed)
+{
+	int matrix_size = nr_filters * channels;
+
+	for (int f = 0; f < nr_filters; f++) {
+		for (int c = 0; c < channels; c++) {
+			const float* g = filters + (f * channels + c) * 9;
+			float t[4][3];
+			float u[4][4];
+
+			// G g, down the rows
+			for (int x = 0; x < 3; x++) {
+				t[0][x] = g[x];
+				t[1][x] = 0.5f * (g[x] + g[3 + x] + g[6 + x]);
+				t[2][x] = 0.5f * (g[x] - g[3 + x] + g[6 + x]);
+				t[3][x] = g[6 + x];
+			}
+
+			// (G g) G^T, along them
+			for (int y = 0; y < 4; y++) {
+				u[y][0] = t[y][0];
+				u[y][1] = 0.5f * (t[y][0] + t[y][1] + t[y][2]);
+				u[y][2] = 0.5f * (t[y][0] - t[y][1] + t[y][2]);
+				u[y][3] = t[y][2];
+			}
+
+			for (int p = 0; p < 16; p++) {
+				transformed[p * matrix_size + f * channels + c] = u[p / 4][p % 4];
+			}
+		}
+	}
+}
+
+// The filters of the gradient of a convolution's input: filter c of the result
+// is channel c of every filter, rotated by 180 degrees. rotated holds
+// nr_filters * channels * 9 floats.
+inline void winograd_rotate_filters(const float* filters, int nr_filters, int channels, float* rotated)
+{
+	for (int f = 0; f < nr_filters; f++) {
+		for (int c = 0; c < channels; c++) {
+			const float* g = filters + (f * channels + c) * 9;
+			float* r = rotated + (c * nr_filters + f) * 9;
+
+			for (int i = 0; i < 9; i++) {
+				r[i] = g[8 - i];
+			}
+		}
+	}
+}
+
+// out(x, y, f) = sum over (i, j, c) of filter_f(i, j, c) * in(x + i - pad, y + j - pad, c),
+// with the input read as zero outside of it. transformed comes from
+// winograd_transform_filters() and scratch holds winograd_scratch_size() floats.
+inline void winograd_conv(const float* in, td_size in_size, int pad, const float* transformed, int nr_filters,
+	float* out, td_size out_size, float* scratch)
+{
+	int channels = in_size._z;
+	int tiles_x = (out_size._x + 1) / 2;
+	int tiles_y = (out_size._y + 1) / 2;
+	int nr_tiles = tiles_x * tiles_y;
+	int plane = in_size._x * in_size._y;
+
+	float* v = scratch;
+	float* m = scratch + (size_t)16 * channels * WINOGRAD_BLOCK;
+	task_pool& pool = intra_op_pool();
+
+	for (int first = 0; first < nr_tiles; first += WINOGRAD_BLOCK) {
+		int block = std::min(WINOGRAD_BLOCK, nr_tiles - first);
+
+		// V = B^T d B for every tile of the block in every channel
+		pool.parallel_for(channels, 64.0 * block, [&](int first_channel, int last_channel) {
+			for (int c = first_channel; c < last_channel; c++) {
+				const float* channel = in + c * plane;
+
+				for (int i = 0; i < block; i++) {
+					int x0 = (first + i) % tiles_x * 2 - pad;
+					int y0 = (first + i) / tiles_x * 2 - pad;
+					float d[4][4];
+					float t[4][4];
+
+					if (x0 >= 0 && y0 >= 0 && x0 + 4 <= in_size._x && y0 + 4 <= in_size._y) {
+						for (int y = 0; y < 4; y++) {
+							for (int x = 0; x < 4; x++) {
+								d[y][x] = channel[(y0 + y) * in_size._x + x0 + x];
+							}
+						}
+					}
+					else {
+						for (int y = 0; y < 4; y++) {
+							for (int x = 0; x < 4; x++) {
+								bool inside = x0 + x >= 0 && x0 + x < in_size._x && y0 + y >= 0 && y0 + y < in_size._y;
+								d[y][x] = inside ? channel[(y0 + y) * in_size._x + x0 + x] : 0.0f;
+							}
+						}
+					}
+
+					for (int x = 0; x < 4; x++) {
+						t[0][x] = d[0][x] - d[2][x];
+						t[1][x] = d[1][x] + d[2][x];
+						t[2][x] = d[2][x] - d[1][x];
+						t[3][x] = d[1][x] - d[3][x];
+					}
+
+					float* tile = v + c * block + i;
+					int stride = channels * block;
+
+					for (int y = 0; y < 4; y++) {
+						tile[(y * 4 + 0) * stride] = t[y][0] - t[y][2];
+						tile[(y * 4 + 1) * stride] = t[y][1] + t[y][2];
+						tile[(y * 4 + 2) * stride] = t[y][2] - t[y][1];
+						tile[(y * 4 + 3) * stride] = t[y][1] - t[y][3];
+					}
+				}
+			}
+		});
+
+		// M = U V, one product per tile position
+		pool.parallel_for(16, 2.0 * nr_filters * block * channels, [&](int first_position, int last_position) {
+			for (int p = first_position; p < last_position; p++) {
+				sgemm(false, false, nr_filters, block, channels,
+					1.0f, transformed + (size_t)p * nr_filters * channels, channels,
+					v + (size_t)p * channels * block, block,
+					0.0f, m + (size_t)p * nr_filters * block, block);
+			}
+		});
+
+		// Y = A^T M A, dropping the outputs past an odd edge
+		int stride = nr_filters * block;
+
+		pool.parallel_for(nr_filters, 48.0 * block, [&](int first_filter, int last_filter) {
+			for (int f = first_filter; f < last_filter; f++) {
+				float* channel = out + f * out_size._x * out_size._y;
+
+				for (int i = 0; i < block; i++) {
+					const float* tile = m + f * block + i;
+					float t[2][4];
+
+					for (int x = 0; x < 4; x++) {
+						float m0 = tile[(0 * 4 + x) * stride];
+						float m1 = tile[(1 * 4 + x) * stride];
+						float m2 = tile[(2 * 4 + x) * stride];
+						float m3 = tile[(3 * 4 + x) * stride];
+
+						t[0][x] = m0 + m1 + m2;
+						t[1][x] = m1 - m2 - m3;
+					}
+
+					int x0 = (first + i) % tiles_x * 2;
+					int y0 = (first + i) / tiles_x * 2;
+
+					for (int y = 0; y < 2 && y0 + y < out_size._y; y++) {
+						float* row = channel + (y0 + y) * out_size._x + x0;
+
+						row[0] = t[y][0] + t[y][1] + t[y][2];
+
+						if (x0 + 1 < out_size._x) {
+							row[1] = t[y][1] - t[y][2] - t[y][3];
+						}
+					}
+				}
+			}
+		});
+	}
+}
+
+#endif // !WINOGRAD_H
@@ -0,0 +1,199 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// Steps first to last of a run in which a buffer is in use. The default covers
+// every step.
+struct lifetime
+{
+	int first = 0;
+	int last = INT_MAX;
+
+	bool always() const { return first == 0 && last == INT_MAX; }
+	bool empty() const { return first > last; }
+	bool overlaps(const lifetime& other) const
+	{
+		return !empty() && !other.empty() && first <= other.last && other.first <= last;
+	}
+};
+
+// Bump allocator holding every buffer of one workspace in a single block.
+//
+// plan(describe) runs describe twice. In the first run allocate() only adds up
+// the requested sizes and returns nullptr; the block is then allocated once and
+// the second run hands out 64 byte aligned pieces of it in the same order.
+// Buffers are never freed on their own, they live as long as the arena, and
+// moving an arena keeps the pointers it handed out valid. Buffers that are
+// never in use at the same time can share memory through mark() and
+// release(), and the block is as large as the most the arena held at once.
+//
+// Buffers allocated with a lifetime are placed like registers by an offline
+// allocator instead: after the first run, largest first, each goes to the
+// lowest offset that no buffer in use at any of the same steps covers. They
+// sit in the block after everything allocated without one.
+class arena
+{
+private:
+	static constexpr size_t ALIGNMENT = 64 / sizeof(float);
+
+	// A buffer with a lifetime, in use in any of a few separate spans of steps
+	struct block
+	{
+		size_t _offset;
+		size_t _size;
+		std::vector<lifetime> _live;
+
+		bool overlaps(const block& other) const
+		{
+			for (const lifetime& a : _live) {
+				for (const lifetime& b : other._live) {
+					if (a.overlaps(b)) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+	};
+
+	std::vector<float> _memory;
+	float* _base;
+	size_t _used;
+	size_t _peak;
+	size_t _unshared;
+	bool _measuring;
+
+	std::vector<block> _blocks;
+	size_t _next_block;
+
+	size_t place_blocks();
+
+	static size_t aligned(size_t count) { return (count + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+public:
+	arena()
+	{
+		_base = nullptr;
+		_used = 0;
+		_peak = 0;
+		_unshared = 0;
+		_measuring = false;
+		_next_block = 0;
+	}
+
+	template<typename F>
+	void plan(F describe)
+	{
+		_measuring = true;
+		_used = 0;
+		_peak = 0;
+		_unshared = 0;
+		_blocks.clear();
+		describe(*this);
+
+		_memory.assign(_peak + place_blocks() + ALIGNMENT, 0.0f);
+		uintptr_t address = reinterpret_cast<uintptr_t>(_memory.data());
+		_base = _memory.data() + ((ALIGNMENT - (address / sizeof(float)) % ALIGNMENT) % ALIGNMENT);
+
+		_measuring = false;
+		_used = 0;
+		_next_block = 0;
+		describe(*this);
+	}
+
+	float* allocate(size_t count)
+	{
+		size_t offset = _used;
+		_used += aligned(count);
+		_peak = std::max(_peak, _used);
+
+		if (_measuring) {
+			_unshared += aligned(count);
+		}
+		return _measuring ? nullptr : _base + offset;
+	}
+
+	// A buffer only in use in the steps of live, which shares memory with any
+	// other whose steps don't overlap with its own
+	float* allocate(size_t count, lifetime live) { return allocate(count, { live }); }
+
+	// The same for a buffer in use in several spans of steps, empty ones are
+	// left out
+	float* allocate(size_t count, std::initializer_list<lifetime> live)
+	{
+		for (const lifetime& span : live) {
+			if (span.always()) {
+				return allocate(count);
+			}
+		}
+
+		if (_measuring) {
+			_blocks.push_back({ 0, aligned(count), std::vector<lifetime>(live) });
+			_unshared += aligned(count);
+			return nullptr;
+		}
+
+		assert(_next_block < _blocks.size() && _blocks[_next_block]._size == aligned(count));
+		return _base + _peak + _blocks[_next_block++]._offset;
+	}
+
+	// Everything allocated after mark() is handed out again after release()
+	size_t mark() const { return _used; }
+	void release(size_t mark) { _used = mark; }
+
+	size_t size_in_bytes() const { return _memory.size() * sizeof(float); }
+
+	// What the block would take if no buffers shared memory
+	size_t unshared_bytes() const { return (_unshared + ALIGNMENT) * sizeof(float); }
+};
+
+// Returns how much the blocks take
+inline size_t arena::place_blocks()
+{
+	std::vector<size_t> order(_blocks.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return _blocks[a]._size > _blocks[b]._size; });
+
+	std::vector<const block*> placed;
+	std::vector<const block*> in_use;
+	size_t total = 0;
+
+	for (size_t i : order) {
+		block& b = _blocks[i];
+
+		// the placed blocks in use at the same time, by offset
+		in_use.clear();
+		for (const block* other : placed) {
+			if (other->overlaps(b)) {
+				in_use.push_back(other);
+			}
+		}
+
+		std::sort(in_use.begin(), in_use.end(), [](const block* x, const block* y) { return x->_offset < y->_offset; });
+
+		// the first gap large enough
+		b._offset = 0;
+		for (const block* other : in_use) {
+			if (b._offset + b._size <= other->_offset) {
+				break;
+			}
+			b._offset = std::max(b._offset, other->_offset + other->_size);
+		}
+
+		placed.push_back(&b);
+		total = std::max(total, b._offset + b._size);
+	}
+
+	return total;
+}
+
+#endif // !ARENA_H
@@ -0,0 +1,115 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#include <fstream>
+#include <vector>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped copy-on-write into memory. Pages are read in lazily when
+// first touched, and writes through data() stay private to this process and
+// never reach the file. Without mmap (Windows) the file is read into memory.
+class mapped_file
+{
+private:
+	char* _data;
+	size_t _size;
+
+#ifdef _WIN32
+	std::vector<char> _buffer;
+#endif
+
+public:
+	mapped_file()
+	{
+		_data = nullptr;
+		_size = 0;
+	}
+
+	~mapped_file() { close(); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool open(const std::string& filepath);
+	void close();
+
+	char* data() const { return _data; }
+	size_t size() const { return _size; }
+};
+
+#ifdef _WIN32
+
+inline bool mapped_file::open(const std::string& filepath)
+{
+	close();
+
+	std::ifstream infile(filepath, std::ios::binary | std::ios::ate);
+	if (!infile.is_open()) { return false; }
+
+	_buffer.resize((size_t)infile.tellg());
+	infile.seekg(0);
+
+	if (!infile.read(_buffer.data(), _buffer.size())) {
+		_buffer.clear();
+		return false;
+	}
+
+	_data = _buffer.data();
+	_size = _buffer.size();
+	return true;
+}
+
+inline void mapped_file::close()
+{
+	_buffer.clear();
+	_data = nullptr;
+	_size = 0;
+}
+
+#else
+
+inline bool mapped_file::open(const std::string& filepath)
+{
+	close();
+
+	int fd = ::open(filepath.c_str(), O_RDONLY);
+	if (fd < 0) { return false; }
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* memory = mmap(nullptr, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (memory == MAP_FAILED) { return false; }
+
+	_data = static_cast<char*>(memory);
+	_size = (size_t)info.st_size;
+	return true;
+}
+
+inline void mapped_file::close()
+{
+	if (_data != nullptr) {
+		munmap(_data, _size);
+	}
+
+	_data = nullptr;
+	_size = 0;
+}
+
+#endif
+
+#endif // !MAPPED_FILE_H
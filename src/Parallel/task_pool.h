@@ -0,0 +1,346 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for parallelism inside a single layer, shared by every
+// layer of the process, see intra_op_pool(). parallel_for() cuts a loop into
+// chunks and runs them on the pool's workers and the calling thread. A range of
+// chunks is split in halves: the thread running it keeps the lower half and
+// queues the upper one, so idle workers steal big pieces from the front of other
+// threads' queues while the owner works through the small ones at the back.
+// The caller helps until every chunk of its loop has run, so loops may be
+// started from any number of threads at once. Nothing is allocated per loop.
+//
+// How a loop is cut never changes what each item computes, so results are the
+// same for any number of threads.
+class task_pool
+{
+private:
+	struct job
+	{
+		const void* _body;
+		void (*_call)(const void* body, int first, int last);
+		int _count;
+		int _grain;						// items per chunk
+		std::atomic<int> _remaining;	// chunks not run yet
+	};
+
+	// Chunks first .. last - 1 of a job
+	struct task
+	{
+		job* _job;
+		int _first;
+		int _last;
+	};
+
+	static const int QUEUE_CAPACITY = 256;
+
+	// Its owner pushes and pops at the back, thieves take from the front
+	struct task_queue
+	{
+		std::mutex _mutex;
+		task _tasks[QUEUE_CAPACITY];
+		int _head = 0;
+		int _tail = 0;
+
+		bool push(const task& t);
+		bool pop(task& t);
+		bool steal(task& t);
+	};
+
+	std::vector<std::thread> _threads;
+	// one per worker, and queue 0 for threads outside the pool
+	std::unique_ptr<task_queue[]> _queues;
+	std::atomic<int> _queued;
+
+	std::mutex _sleep_mutex;
+	std::condition_variable _wake;
+	bool _stop;
+
+	void start(int nr_threads);
+	void stop();
+	void worker(int index);
+
+	bool find_task(int index, task& t);
+	void execute(int index, task t);
+
+	static int& worker_index();
+	static int& serial_depth();
+
+public:
+	// Chunks cheaper than this aren't worth handing to another thread; the unit
+	// is a floating point operation or a float moved
+	static constexpr double MIN_TASK_COST = 256 * 1024;
+
+	explicit task_pool(int nr_threads) { start(nr_threads); }
+	~task_pool() { stop(); }
+
+	task_pool(const task_pool&) = delete;
+	task_pool& operator=(const task_pool&) = delete;
+
+	// Threads a loop runs on, the calling one included
+	int size() const { return (int)_threads.size() + 1; }
+
+	// Not while a loop runs
+	void resize(int nr_threads);
+
+	// Calls body(first, last) on disjoint ranges covering 0 .. count - 1, where
+	// cost is the work of one item. A loop cheaper than two chunks, and every
+	// loop inside a serial_scope, runs as one call on the calling thread.
+	template<typename F>
+	void parallel_for(int count, double cost, const F& body);
+
+	// Chunks worth cutting count items of the given cost into, 1 if the loop
+	// runs inline
+	int chunks(int count, double cost) const;
+
+	// Keeps the loops of the current thread on it while the scope lives, for
+	// threads that already run side by side, see thread_group
+	class serial_scope
+	{
+	public:
+		serial_scope() { serial_depth()++; }
+		~serial_scope() { serial_depth()--; }
+	};
+};
+
+// The pool every layer splits its loops across. It starts with a thread per
+// hardware thread; set_intra_op_threads(1) turns intra-op parallelism off.
+inline task_pool& intra_op_pool()
+{
+	static task_pool pool((int)std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
+
+inline void set_intra_op_threads(int nr_threads)
+{
+	intra_op_pool().resize(std::max(nr_threads, 1));
+}
+
+inline int& task_pool::worker_index()
+{
+	thread_local int index = 0;
+	return index;
+}
+
+inline int& task_pool::serial_depth()
+{
+	thread_local int depth = 0;
+	return depth;
+}
+
+inline bool task_pool::task_queue::push(const task& t)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_tail - _head == QUEUE_CAPACITY) {
+		return false;
+	}
+
+	_tasks[_tail++ % QUEUE_CAPACITY] = t;
+	return true;
+}
+
+inline bool task_pool::task_queue::pop(task& t)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_tail == _head) {
+		return false;
+	}
+
+	t = _tasks[--_tail % QUEUE_CAPACITY];
+	return true;
+}
+
+inline bool task_pool::task_queue::steal(task& t)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	if (_tail == _head) {
+		return false;
+	}
+
+	t = _tasks[_head++ % QUEUE_CAPACITY];
+
+	// keeps the indices small, the queue is empty
+	if (_head == _tail) {
+		_head = _tail = 0;
+	}
+	return true;
+}
+
+inline void task_pool::start(int nr_threads)
+{
+	_queues.reset(new task_queue[std::max(nr_threads, 1)]);
+	_queued = 0;
+	_stop = false;
+
+	for (int i = 1; i < nr_threads; i++) {
+		_threads.emplace_back(&task_pool::worker, this, i);
+	}
+}
+
+inline void task_pool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_sleep_mutex);
+		_stop = true;
+	}
+
+	_wake.notify_all();
+
+	for (std::thread& thread : _threads) {
+		thread.join();
+	}
+	_threads.clear();
+}
+
+inline void task_pool::resize(int nr_threads)
+{
+	if (nr_threads == size()) {
+		return;
+	}
+
+	stop();
+	start(nr_threads);
+}
+
+inline int task_pool::chunks(int count, double cost) const
+{
+	if (_threads.empty() || serial_depth() > 0 || count < 2) {
+		return 1;
+	}
+
+	// a few chunks per thread leave room to balance uneven ones
+	double by_cost = count * cost / MIN_TASK_COST;
+	int limit = std::min(count, 4 * size());
+	return by_cost < 2 ? 1 : (int)std::min<double>(by_cost, limit);
+}
+
+template<typename F>
+inline void task_pool::parallel_for(int count, double cost, const F& body)
+{
+	if (count <= 0) {
+		return;
+	}
+
+	int nr_chunks = chunks(count, cost);
+
+	if (nr_chunks == 1) {
+		body(0, count);
+		return;
+	}
+
+	job j;
+	j._body = &body;
+	j._call = [](const void* body, int first, int last) { (*static_cast<const F*>(body))(first, last); };
+	j._count = count;
+	j._grain = (count + nr_chunks - 1) / nr_chunks;
+	j._remaining = (count + j._grain - 1) / j._grain;
+
+	int index = worker_index();
+	execute(index, { &j, 0, j._remaining.load(std::memory_order_relaxed) });
+
+	// help with whatever is queued until the last chunk of this loop is done
+	while (j._remaining.load(std::memory_order_acquire) > 0) {
+		task t;
+
+		if (find_task(index, t)) {
+			execute(index, t);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+inline void task_pool::execute(int index, task t)
+{
+	job* j = t._job;
+
+	while (t._last - t._first > 1) {
+		int middle = (t._first + t._last) / 2;
+
+		// a full queue keeps the rest of the range here
+		if (!_queues[index].push({ j, middle, t._last })) {
+			break;
+		}
+
+		_queued.fetch_add(1, std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> lock(_sleep_mutex);
+		}
+		_wake.notify_one();
+
+		t._last = middle;
+	}
+
+	for (int chunk = t._first; chunk < t._last; chunk++) {
+		int first = chunk * j->_grain;
+		j->_call(j->_body, first, std::min(first + j->_grain, j->_count));
+	}
+
+	j->_remaining.fetch_sub(t._last - t._first, std::memory_order_acq_rel);
+}
+
+inline bool task_pool::find_task(int index, task& t)
+{
+	int nr_queues = size();
+
+	if (_queued.load(std::memory_order_acquire) == 0) {
+		return false;
+	}
+
+	bool found = _queues[index].pop(t);
+
+	for (int i = 1; i < nr_queues && !found; i++) {
+		found = _queues[(index + i) % nr_queues].steal(t);
+	}
+
+	if (found) {
+		_queued.fetch_sub(1, std::memory_order_relaxed);
+	}
+	return found;
+}
+
+inline void task_pool::worker(int index)
+{
+	worker_index() = index;
+
+	for (;;) {
+		task t;
+
+		if (find_task(index, t)) {
+			execute(index, t);
+			continue;
+		}
+
+		// a short spin catches the next loop of the layer without a wake up
+		bool busy = false;
+		for (int spin = 0; spin < 256 && !busy; spin++) {
+			std::this_thread::yield();
+			busy = _queued.load(std::memory_order_acquire) > 0;
+		}
+
+		if (busy) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_sleep_mutex);
+		_wake.wait(lock, [this] { return _stop || _queued.load(std::memory_order_acquire) > 0; });
+
+		if (_stop) {
+			return;
+		}
+	}
+}
+
+#endif // !TASK_POOL_H
@@ -0,0 +1,133 @@
+#ifndef THREAD_GROUP_H
+#define THREAD_GROUP_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "task_pool.h"
+
+// A fixed set of threads that run one job side by side, fork-join style.
+// run(job) calls job(0) .. job(size() - 1), job(0) on the calling thread,
+// and returns once every index has finished. Index t always runs on the same
+// thread, so per-thread buffers can simply be indexed by t. The job is only
+// referenced, never copied, so a run doesn't allocate. With more than one
+// thread the layers a job runs keep their loops on its thread instead of
+// splitting them across the intra-op pool, see Parallel/task_pool.h.
+class thread_group
+{
+private:
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _start;
+	std::condition_variable _done;
+
+	const void* _job;
+	void (*_call)(const void* job, int index);
+	unsigned long long _generation;
+	int _pending;
+	bool _stop;
+
+	void worker(int index);
+
+public:
+	explicit thread_group(int nr_threads);
+	~thread_group();
+
+	thread_group(const thread_group&) = delete;
+	thread_group& operator=(const thread_group&) = delete;
+
+	int size() const { return (int)_threads.size() + 1; }
+
+	template<typename F>
+	void run(const F& job);
+};
+
+inline thread_group::thread_group(int nr_threads)
+{
+	_job = nullptr;
+	_call = nullptr;
+	_generation = 0;
+	_pending = 0;
+	_stop = false;
+
+	for (int i = 1; i < nr_threads; i++) {
+		_threads.emplace_back(&thread_group::worker, this, i);
+	}
+}
+
+inline thread_group::~thread_group()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+
+	_start.notify_all();
+
+	for (std::thread& thread : _threads) {
+		thread.join();
+	}
+}
+
+template<typename F>
+inline void thread_group::run(const F& job)
+{
+	if (_threads.empty()) {
+		job(0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_job = &job;
+		_call = [](const void* job, int index) { (*static_cast<const F*>(job))(index); };
+		_pending = (int)_threads.size();
+		_generation++;
+	}
+
+	_start.notify_all();
+	{
+		task_pool::serial_scope serial;
+		job(0);
+	}
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	_done.wait(lock, [this] { return _pending == 0; });
+	_job = nullptr;
+}
+
+inline void thread_group::worker(int index)
+{
+	unsigned long long seen = 0;
+	task_pool::serial_scope serial;
+
+	for (;;) {
+		const void* job;
+		void (*call)(const void*, int);
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_start.wait(lock, [&] { return _stop || _generation != seen; });
+
+			if (_stop) {
+				return;
+			}
+
+			seen = _generation;
+			job = _job;
+			call = _call;
+		}
+
+		call(job, index);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_pending--;
+		}
+
+		_done.notify_one();
+	}
+}
+
+#endif // !THREAD_GROUP_H
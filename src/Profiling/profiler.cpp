@@ -0,0 +1,34 @@
+#include "profiler.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef SHARPNET_PROFILING
+
+static std::atomic<uint64_t> g_allocations(0);
+static thread_local uint64_t t_allocations = 0;
+
+// The array and nothrow forms of the standard library allocate through this one
+void* operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	t_allocations++;
+
+	if (void* memory = malloc(size == 0 ? 1 : size)) {
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+
+uint64_t allocation_count() { return g_allocations.load(std::memory_order_relaxed); }
+uint64_t thread_allocation_count() { return t_allocations; }
+
+#else
+
+uint64_t allocation_count() { return 0; }
+uint64_t thread_allocation_count() { return 0; }
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../Layers/layer.h"
+
+// Per-layer counters for the training loop of SharPNetConv, compiled in only
+// when SHARPNET_PROFILING is defined (cmake -DSHARPNET_PROFILING=ON). Without
+// it PROFILE_LAYER expands to nothing and the profiler is never written to, so
+// the counters simply stay at zero.
+//
+// Time and allocations are measured. FLOPs and bytes are what the layer shapes
+// say a phase has to do and move at least, not hardware counters. Allocations
+// are counted by a replacement of the global operator new that comes with the
+// library in profiling builds, see profiler.cpp.
+
+#ifdef SHARPNET_PROFILING
+constexpr bool profiling_enabled = true;
+#else
+constexpr bool profiling_enabled = false;
+#endif
+
+enum class phase_t
+{
+	Forward,
+	Backward,
+	Update
+};
+
+constexpr int NR_PHASES = 3;
+
+struct phase_counters
+{
+	uint64_t calls = 0;
+	uint64_t samples = 0;
+	uint64_t nanoseconds = 0;
+	uint64_t flops = 0;
+	uint64_t bytes = 0;
+	uint64_t allocations = 0;
+};
+
+struct layer_profile
+{
+	std::string name;
+	phase_counters phases[NR_PHASES];
+
+	phase_counters& operator[](phase_t phase) { return phases[(int)phase]; }
+	const phase_counters& operator[](phase_t phase) const { return phases[(int)phase]; }
+};
+
+// Heap allocations made so far by the whole process and by the calling thread.
+// Both stay at zero without SHARPNET_PROFILING.
+uint64_t allocation_count();
+uint64_t thread_allocation_count();
+
+inline const char* phase_name(phase_t phase)
+{
+	switch (phase) {
+	case phase_t::Forward: return "forward";
+	case phase_t::Backward: return "backward";
+	default: return "update";
+	}
+}
+
+inline const char* layer_name(layer_t type)
+{
+	switch (type) {
+	case layer_t::Convolutional: return "convolutional";
+	case layer_t::Pooling: return "pooling";
+	case layer_t::Relu: return "relu";
+	default: return "fullconnected";
+	}
+}
+
+// Work of one phase over batch samples as the layer shapes dictate it. A
+// weighted layer's backward pass does twice its forward products, one for the
+// weight and one for the input gradients, and an update touches every weight
+// and its two gradient slots once.
+inline void layer_cost(const layer& l, phase_t phase, int batch, uint64_t& flops, uint64_t& bytes)
+{
+	td_size in = l.get_input_size();
+	td_size out = l.get_output_size();
+	uint64_t in_size = (uint64_t)in._x * in._y * in._z;
+	uint64_t out_size = (uint64_t)out._x * out._y * out._z;
+	uint64_t weights = l.weight_count();
+	uint64_t forward = 0;
+
+	// every filter of a convolution is applied at each output position
+	if (l.type() == layer_t::Convolutional) {
+		forward = 2 * weights * out._x * out._y;
+	}
+	else if (l.type() == layer_t::FullConnected) {
+		forward = 2 * weights;
+	}
+	else if (l.type() == layer_t::Pooling) {
+		forward = in_size;
+	}
+	else {
+		forward = out_size;
+	}
+
+	switch (phase) {
+	case phase_t::Forward:
+		flops = forward * batch;
+		bytes = sizeof(float) * ((in_size + out_size) * batch + weights);
+		break;
+	case phase_t::Backward:
+		flops = (weights > 0 ? 2 * forward : forward) * batch;
+		bytes = sizeof(float) * ((2 * in_size + out_size) * batch + 2 * weights);
+		break;
+	case phase_t::Update:
+		flops = 6 * weights;
+		bytes = sizeof(float) * 5 * weights;
+		break;
+	}
+}
+
+class profiler
+{
+private:
+	struct trace_event
+	{
+		int layer;	// -1 for the gradient reduction between the passes
+		phase_t phase;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	std::chrono::steady_clock::time_point _epoch;
+	std::vector<std::string> _names;
+
+	// [thread][layer], summed by layers() so the threads never share a counter
+	std::vector<std::vector<layer_profile>> _counters;
+	std::vector<std::vector<trace_event>> _events;
+
+	size_t _max_events;
+
+public:
+	profiler()
+	{
+		_epoch = std::chrono::steady_clock::now();
+		_max_events = 1 << 20;
+	}
+
+	// Forgets everything recorded and sizes the counters for the layers of a
+	// network trained on nr_threads threads
+	void reset(const std::vector<layer*>& layers, int nr_threads);
+
+	uint64_t now() const
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _epoch).count();
+	}
+
+	void record(int thread, int index, const layer& l, phase_t phase, int batch, uint64_t start, uint64_t end, uint64_t allocations);
+	void record_reduce(uint64_t start, uint64_t end);
+
+	// Trace events per thread are capped, the counters keep counting
+	void set_max_events(size_t max_events) { _max_events = max_events; }
+
+	// The counters of every layer summed over all threads
+	std::vector<layer_profile> layers() const;
+
+	// Chrome trace event format, for chrome://tracing or Perfetto. Every
+	// recorded phase is a complete event on the thread that ran it.
+	bool save_trace(std::string filepath) const;
+};
+
+inline void profiler::reset(const std::vector<layer*>& layers, int nr_threads)
+{
+	_epoch = std::chrono::steady_clock::now();
+	_names.clear();
+
+	for (unsigned int i = 0; i < layers.size(); i++) {
+		std::stringstream ss;
+		td_size in = layers[i]->get_input_size();
+		ss << i << " " << layer_name(layers[i]->type()) << " " << in._x << "x" << in._y << "x" << in._z;
+		_names.push_back(ss.str());
+	}
+
+	_counters.assign(nr_threads, std::vector<layer_profile>(layers.size()));
+	_events.assign(nr_threads, std::vector<trace_event>());
+
+	for (std::vector<trace_event>& events : _events) {
+		events.reserve(std::min<size_t>(_max_events, 4096));
+	}
+}
+
+inline void profiler::record(int thread, int index, const layer& l, phase_t phase, int batch,
+	uint64_t start, uint64_t end, uint64_t allocations)
+{
+	phase_counters& counters = _counters[thread][index][phase];
+	uint64_t flops = 0;
+	uint64_t bytes = 0;
+
+	layer_cost(l, phase, batch, flops, bytes);
+
+	counters.calls++;
+	counters.samples += batch;
+	counters.nanoseconds += end - start;
+	counters.flops += flops;
+	counters.bytes += bytes;
+	counters.allocations += allocations;
+
+	if (_events[thread].size() < _max_events) {
+		_events[thread].push_back({ index, phase, start, end - start });
+	}
+}
+
+inline void profiler::record_reduce(uint64_t start, uint64_t end)
+{
+	if (!_events.empty() && _events[0].size() < _max_events) {
+		_events[0].push_back({ -1, phase_t::Update, start, end - start });
+	}
+}
+
+inline std::vector<layer_profile> profiler::layers() const
+{
+	std::vector<layer_profile> sum(_names.size());
+
+	for (unsigned int i = 0; i < _names.size(); i++) {
+		sum[i].name = _names[i];
+	}
+
+	for (const std::vector<layer_profile>& thread : _counters) {
+		for (unsigned int i = 0; i < thread.size(); i++) {
+			for (int p = 0; p < NR_PHASES; p++) {
+				const phase_counters& from = thread[i].phases[p];
+				phase_counters& to = sum[i].phases[p];
+
+				to.calls += from.calls;
+				to.samples += from.samples;
+				to.nanoseconds += from.nanoseconds;
+				to.flops += from.flops;
+				to.bytes += from.bytes;
+				to.allocations += from.allocations;
+			}
+		}
+	}
+
+	return sum;
+}
+
+inline bool profiler::save_trace(std::string filepath) const
+{
+	std::ofstream outfile(filepath);
+
+	if (!outfile.is_open()) { return false; }
+
+	// timestamps are in microseconds, kept to the nanosecond
+	outfile << std::fixed << std::setprecision(3);
+	outfile << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	outfile << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"SharPNetConv\"}}";
+
+	for (unsigned int t = 0; t < _events.size(); t++) {
+		outfile << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << t
+			<< ", \"args\": {\"name\": \"worker " << t << "\"}}";
+
+		for (const trace_event& e : _events[t]) {
+			const char* name = e.layer < 0 ? "reduce gradients" : _names[e.layer].c_str();
+
+			outfile << ",\n{\"name\": \"" << name << "\", \"cat\": \"" << (e.layer < 0 ? "reduce" : phase_name(e.phase))
+				<< "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << t
+				<< ", \"ts\": " << e.start / 1000.0 << ", \"dur\": " << e.duration / 1000.0 << "}";
+		}
+	}
+
+	outfile << "\n]}\n";
+	outfile.close();
+
+	return !outfile.fail();
+}
+
+// Times one phase of one layer on the calling thread and records it when it
+// goes out of scope, see PROFILE_LAYER
+class layer_scope
+{
+private:
+	profiler& _profiler;
+	int _thread;
+	int _index;
+	const layer& _layer;
+	phase_t _phase;
+	int _batch;
+	uint64_t _allocations;
+	uint64_t _start;
+
+public:
+	layer_scope(profiler& p, int thread, int index, const layer& l, phase_t phase, int batch)
+		: _profiler(p), _thread(thread), _index(index), _layer(l), _phase(phase), _batch(batch)
+	{
+		_allocations = thread_allocation_count();
+		_start = _profiler.now();
+	}
+
+	~layer_scope()
+	{
+		uint64_t end = _profiler.now();
+		_profiler.record(_thread, _index, _layer, _phase, _batch, _start, end, thread_allocation_count() - _allocations);
+	}
+
+	layer_scope(const layer_scope&) = delete;
+	layer_scope& operator=(const layer_scope&) = delete;
+};
+
+#ifdef SHARPNET_PROFILING
+#define PROFILE_LAYER(profiler, thread, index, layer, phase, batch) \
+	layer_scope profile_scope_(profiler, thread, index, layer, phase, batch)
+#else
+#define PROFILE_LAYER(profiler, thread, index, layer, phase, batch)
+#endif
+
+#endif // !PROFILER_H
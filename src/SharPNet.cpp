@@ -1,8 +1,10 @@
 #include "SharPNet.h"
+#include "Math/simd.h"
 #include <string>
 #include <cassert>
-#include <functional>
+#include <cmath>
 #include <algorithm>
+#include <random>
 
 SharPNet::SharPNet(std::vector<int>& topology, activation_t activation = activation_t::Relu)
 {
@@ -24,21 +26,45 @@ SharPNet::SharPNet(std::vector<int>& topology, activation_t activation = activat
 		_activation_function = lRelu;
 		_activation_derviative = lRelu_dev;
 		break;
+	case activation_t::Softmax:
+		// softmax isn't element-wise, so the neurons can't apply it one by one;
+		// release builds fall back to sigmoid, which gives the same class order
+		assert(!"SharPNet has no softmax activation");
+		_activation_function = sig;
+		_activation_derviative = sigmoid_dev;
+		break;
 	}
 
-	// creating the layers specified by the user
+	int widest = 0;
+
 	for (unsigned int i = 0; i < topology.size(); i++) {
-		unsigned int nr_outputs = i == topology.size() - 1 ? 0 : topology[i + 1];
+		_outputs.push_back(std::vector<float>(topology[i] + 1, 0.0f));
+		_outputs.back().back() = 1.0f; // Bias node
 
-		_layers.push_back(Layer());
-		
-		for (int j = 0; j <= topology[i]; j++) {
-			_layers.back().push_back(Neuron(nr_outputs, j));
+		_gradients.push_back(std::vector<float>(i == 0 ? 0 : topology[i], 0.0f));
+		widest = std::max(widest, topology[i]);
+	}
+
+	// creating the layers specified by the user, drawing the weights in the same
+	// order as the neurons of each layer
+	for (unsigned int i = 0; i + 1 < topology.size(); i++) {
+		dense_layer layer;
+		layer._nr_inputs = topology[i] + 1;
+		layer._nr_outputs = topology[i + 1];
+		layer._weights.resize(layer._nr_inputs * layer._nr_outputs);
+		layer._deltas.assign(layer._nr_inputs * layer._nr_outputs, 0.0f);
+
+		for (int j = 0; j < layer._nr_inputs; j++) {
+			for (int k = 0; k < layer._nr_outputs; k++) {
+				layer._weights[k * layer._nr_inputs + j] = rand() / static_cast<float>(RAND_MAX);
+			}
 		}
 
-		_layers.back().back().set_output_val(1.0); // Bias node
+		_layers.push_back(std::move(layer));
 	}
 
+	_derivatives.resize(widest);
+
 	_training_accuracy = 0.0;
 	_accuracy = 0.0;
 	_smoothing_factor = 0.0;
@@ -58,7 +84,8 @@ double SharPNet::train(std::vector<std::vector<float>>& inputs, std::vector<std:
 	}
 
 	for (int pass = 0; pass < nr_epochs; pass++) {
-		std::random_shuffle(indicies.begin(), indicies.end());
+		// seeded from rand() so srand() still makes runs repeatable
+		std::shuffle(indicies.begin(), indicies.end(), std::default_random_engine(rand()));
 
 		for (std::vector<int>::iterator it = indicies.begin(); it != indicies.end(); it++) {
 			feed_forward(inputs[*it]);
@@ -72,57 +99,82 @@ double SharPNet::train(std::vector<std::vector<float>>& inputs, std::vector<std:
 
 void SharPNet::feed_forward(std::vector<float>& inputs)
 {
-	assert(inputs.size() == _layers[0].size() - 1);
+	assert(inputs.size() == _outputs[0].size() - 1);
 
-	for (unsigned int i = 0; i < inputs.size(); i++) {
-		_layers[0][i].set_output_val(inputs[i]);
-	}
+	std::copy(inputs.begin(), inputs.end(), _outputs[0].begin());
 
-	for (unsigned int i = 1; i < _layers.size(); i++) {
-		Layer& prevLayer = _layers[i - 1];
-		Layer& currLayer = _layers[i];
+	for (unsigned int l = 0; l < _layers.size(); l++) {
+		const dense_layer& layer = _layers[l];
+		const float* in = _outputs[l].data();
+		float* out = _outputs[l + 1].data();
 
-		for (unsigned int j = 0; j < _layers[i].size() - 1; j++) {
-			_layers[i][j].feed_forward(prevLayer, _activation_function);
+		for (int k = 0; k < layer._nr_outputs; k++) {
+			out[k] = simd_dot(&layer._weights[k * layer._nr_inputs], in, layer._nr_inputs);
 		}
+
+		_activation_function(out, out, layer._nr_outputs);
 	}
 }
 
 void SharPNet::back_propagation(std::vector<float>& outputs)
 {
 	// Calculate overall network error with root mean squared error
-	Layer& outputLayer = _layers.back();
+	std::vector<float>& network_output = _outputs.back();
+	int nr_outputs = (int)network_output.size() - 1;
 	float error = 0.0;
 
-	for (unsigned int i = 0; i < outputLayer.size() - 1; i++) {
-		float delta = outputs[i] - outputLayer[i].get_output_val();
+	for (int i = 0; i < nr_outputs; i++) {
+		float delta = outputs[i] - network_output[i];
 		error += delta * delta;
 	}
 
-	error /= outputLayer.size() - 1;
+	error /= nr_outputs;
 	error = sqrt(error);
 
 	_training_accuracy = (float)((_training_accuracy * _smoothing_factor) + error) / (_smoothing_factor + 1.0);
 
-	for (unsigned int i = 0; i < outputLayer.size() - 1; i++) {
-		outputLayer[i].calculate_output_gradient(outputs[i], _activation_derviative);
+	_activation_derviative(network_output.data(), _derivatives.data(), nr_outputs);
+
+	for (int i = 0; i < nr_outputs; i++) {
+		_gradients.back()[i] = (outputs[i] - network_output[i]) * _derivatives[i];
 	}
 
-	for (unsigned int i = _layers.size() - 2; i > 0; i--) {
-		Layer& hiddenLayer = _layers[i];
-		Layer& nextLayer = _layers[i + 1];
+	// The gradient of a hidden neuron is the column of the next layer's weights
+	// leaving it dotted with the next layer's gradients, i.e. W^T * g, which is
+	// summed a row of W at a time
+	for (unsigned int l = _layers.size() - 1; l > 0; l--) {
+		const dense_layer& next = _layers[l];
+		std::vector<float>& grads = _gradients[l];
+		const std::vector<float>& next_grads = _gradients[l + 1];
+		int nr_neurons = (int)grads.size();
+
+		std::fill(grads.begin(), grads.end(), 0.0f);
 
-		for (unsigned int j = 0; j < hiddenLayer.size(); j++) {
-			hiddenLayer[j].calculate_hidden_gradient(nextLayer, _activation_derviative);
+		for (int k = 0; k < next._nr_outputs; k++) {
+			simd_axpy(next_grads[k], &next._weights[k * next._nr_inputs], grads.data(), nr_neurons);
+		}
+
+		_activation_derviative(_outputs[l].data(), _derivatives.data(), nr_neurons);
+
+		for (int j = 0; j < nr_neurons; j++) {
+			grads[j] *= _derivatives[j];
 		}
 	}
 
-	for (unsigned int i = _layers.size() - 1; i > 0; i--) {
-		Layer& layer = _layers[i];
-		Layer& prevLayer = _layers[i - 1];
+	for (unsigned int l = 0; l < _layers.size(); l++) {
+		dense_layer& layer = _layers[l];
+		const float* in = _outputs[l].data();
+
+		for (int k = 0; k < layer._nr_outputs; k++) {
+			float* weights = &layer._weights[k * layer._nr_inputs];
+			float* deltas = &layer._deltas[k * layer._nr_inputs];
+			float gradient = _gradients[l + 1][k];
 
-		for (unsigned int j = 0; j < layer.size() - 1; j++) {
-			layer[j].update_input_weights(prevLayer);
+			for (int j = 0; j < layer._nr_inputs; j++) {
+				float delta = _eta * in[j] * gradient + _alpha * deltas[j];
+				deltas[j] = delta;
+				weights[j] += delta;
+			}
 		}
 	}
 }
@@ -138,15 +190,15 @@ double SharPNet::evaluate(std::vector<std::vector<float>>& inputs, std::vector<s
 	for (unsigned int i = 0; i < inputs.size(); i++) {
 		feed_forward(inputs[i]);
 
-		Layer& outputLayer = _layers.back();
+		std::vector<float>& network_output = _outputs.back();
 		float error = 0.0f;
 
-		for (unsigned int j = 0; j < outputLayer.size() - 1; j++) {
-			float delta = (float)((double)outputs[i][j] - outputLayer[j].get_output_val());
+		for (unsigned int j = 0; j < network_output.size() - 1; j++) {
+			float delta = (float)((double)outputs[i][j] - network_output[j]);
 			error = delta * delta;
 		}
 
-		error /= outputLayer.size() - 1;
+		error /= network_output.size() - 1;
 		error = sqrt(error);
 
 		model_accuracy = ((model_accuracy * smoothing_factor) + error) / (smoothing_factor + 1.0);
@@ -164,10 +216,6 @@ double SharPNet::evaluate(std::vector<std::vector<float>>& inputs, std::vector<s
 
 void SharPNet::get_results(std::vector<float>& inputs, std::vector<float>& results)
 {
-	results.clear();
 	feed_forward(inputs);
-
-	for (unsigned int i = 0; i < _layers.back().size() - 1; i++) {
-		results.push_back(_layers.back()[i].get_output_val());
-	}
+	results.assign(_outputs.back().begin(), _outputs.back().end() - 1);
 }
\ No newline at end of file
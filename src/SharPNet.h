@@ -2,22 +2,46 @@
 #define SHARPNET_H
 
 #include <vector>
-#include <functional>
 #include <fstream>
-#include "Layers/Neuron.h"
+#include "Learning/activation.h"
 #include "Learning/learning.h"
 
+// The weights between two neighbouring layers of a SharPNet. Row k holds the
+// weights from every neuron of the previous layer, its bias neuron last, into
+// neuron k, so the input sum of a neuron is one dot product over contiguous
+// memory.
+struct dense_layer
+{
+	int _nr_inputs;		// neurons of the previous layer plus its bias
+	int _nr_outputs;
+
+	std::vector<float> _weights;	// _nr_outputs x _nr_inputs
+	std::vector<float> _deltas;		// last change of every weight, for the momentum term
+};
+
 class SharPNet
 {
 private:
-	std::function<float(float)> _activation_function;
-	std::function<float(float)> _activation_derviative;
+	void (*_activation_function)(const float*, float*, int);
+	void (*_activation_derviative)(const float*, float*, int);
 
 	float _accuracy;
 	float _training_accuracy;
 	float _smoothing_factor;
 
-	std::vector<Layer> _layers;
+	float _eta = .15f;
+	float _alpha = .5f;
+
+	// _layers[l] feeds layer l + 1 of the topology from layer l
+	std::vector<dense_layer> _layers;
+
+	// Output of every neuron of every layer of the topology, followed by the
+	// bias neuron's constant 1, and the gradient of every neuron but the bias
+	std::vector<std::vector<float>> _outputs;
+	std::vector<std::vector<float>> _gradients;
+
+	// Derivatives of one layer, scratch for back_propagation()
+	std::vector<float> _derivatives;
 
 	void feed_forward(std::vector<float>& inputs);
 	void back_propagation(std::vector<float>& outputs);
@@ -37,4 +61,4 @@ public:
 };
 
 
-#endif
\ No newline at end of file
+#endif
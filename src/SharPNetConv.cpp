@@ -1,121 +1,442 @@
 #include "SharPNetConv.h"
+#include "IO/checkpoint_format.h"
+#include "IO/model_format.h"
+#include <algorithm>
+#include <climits>
 #include <fstream>
 #include <iostream>
 
 SharPNetConv::SharPNetConv(std::vector<layer*> topology, loss_t loss_function, float learning_rate)
 {
-	_layers = std::move(topology);
 	_loss_function = loss_function;
-	_learning_rate = learning_rate;
+	_optimizer.reset(new sgd_optimizer(learning_rate));
+	set_layers(std::move(topology));
 
 	_training_accuracy = 0.0f;
 	_accuracy = 0.0f;
 	_smoothing_factor = 0.0f;
 }
 
-std::vector<std::pair<float, float>> SharPNetConv::train(std::vector<image_sample> samples, int nr_epochs)
+// The steps of a training step are every layer's forward pass in turn, the
+// gradients of the loss, every layer's backward pass from the last layer to
+// the first, and the reduction of the weight gradients after all threads are
+// done, when the network's output is read once more. With checkpoints the
+// layers of a segment run forward again right before their backward passes.
+std::vector<layer_schedule> SharPNetConv::training_schedule() const
 {
-	_smoothing_factor = samples.size() * .05f;
+	int nr_layers = (int)_layers.size();
+	std::vector<layer_schedule> schedule(nr_layers);
+	int step = 0;
+
+	for (int layer = 0; layer < nr_layers; layer++, step++) {
+		schedule[layer].forward = { step, step };
+	}
+
+	// the gradients of the loss
+	step++;
+
+	for (int last = nr_layers - 1; last >= 0; last = segment_start(last) - 1) {
+		for (int layer = segment_start(last); layer < last && _checkpoint_every > 0; layer++, step++) {
+			schedule[layer].recompute = { step, step };
+		}
+
+		for (int layer = last; layer >= segment_start(last); layer--, step++) {
+			schedule[layer].backward = { step, step };
+		}
+	}
+
+	int after = step;
+
+	for (int layer = 0; layer < nr_layers; layer++) {
+		layer_schedule& steps = schedule[layer];
+		int forward = steps.forward.first;
+		int backward = steps.backward.first;
+
+		// an output dropped after the forward pass is only read by the next layer
+		if (layer == nr_layers - 1) {
+			steps.output = { forward, after };
+		}
+		else if (steps.recompute.empty()) {
+			steps.output = { forward, backward };
+		}
+		else {
+			steps.output = { forward, forward + 1 };
+			steps.recomputed_output = { steps.recompute.first, backward };
+		}
+
+		steps.gradients = { backward, layer > 0 ? schedule[layer - 1].backward.first : backward };
+		steps.weight_grads = { backward, after };
+	}
+
+	return schedule;
+}
+
+int SharPNetConv::segment_start(int last) const
+{
+	return _checkpoint_every > 0 ? last - last % _checkpoint_every : 0;
+}
+
+void SharPNetConv::prepare_training(int batch_size, int nr_threads)
+{
+	assert(!_inference_only);
+
+	batch_size = std::max(batch_size, 1);
+	nr_threads = std::max(nr_threads, 1);
+
+	if (_workers && _workers->size() == nr_threads && _planned_batch >= batch_size) {
+		return;
+	}
+
+	if (!_workers || _workers->size() != nr_threads) {
+		_workers.reset(new thread_group(nr_threads));
+	}
+
+	// every shard holds at most ceil(batch_size / nr_threads) samples
+	int shard = (batch_size + nr_threads - 1) / nr_threads;
+
+	td_size in_size = _layers.front()->get_input_size();
+	td_size out_size = _layers.back()->get_output_size();
+	int input_size = in_size._x * in_size._y * in_size._z;
+	int output_size = out_size._x * out_size._y * out_size._z;
+
+	_workspaces.clear();
+	_workspaces.resize(nr_threads);
+
+	for (train_workspace& ws : _workspaces) {
+		for (layer* layer : _layers) {
+			ws._contexts.push_back(layer->create_context());
+		}
+
+		ws._batch.reserve(shard);
+		ws._expected.reserve(shard);
+		ws._output_gradients.reserve(shard);
+
+		std::vector<layer_schedule> schedule = _share_memory ? training_schedule() : std::vector<layer_schedule>(_layers.size());
+
+		// the gradients of the loss are read by the last layer's backward pass
+		lifetime output_gradients;
+		if (_share_memory) {
+			output_gradients = { schedule.back().forward.last + 1, schedule.back().backward.first };
+		}
+
+		ws._memory.plan([&](arena& memory) {
+			ws._input_memory = memory.allocate(shard * input_size);
+			ws._expected_memory = memory.allocate(shard * output_size);
+			ws._output_gradient_memory = memory.allocate(shard * output_size, output_gradients);
+
+			for (unsigned int layer = 0; layer < _layers.size(); layer++) {
+				_layers[layer]->plan(*ws._contexts[layer], memory, shard, true, schedule[layer]);
+			}
+		});
+	}
+
+	_planned_batch = batch_size;
+	reset_profile();
+}
+
+void SharPNetConv::set_checkpointing(int every)
+{
+	every = std::max(every, 0);
+
+	if (every != _checkpoint_every) {
+		_checkpoint_every = every;
+		_planned_batch = 0;
+	}
+}
+
+void SharPNetConv::share_workspace_memory(bool enable)
+{
+	if (enable != _share_memory) {
+		_share_memory = enable;
+		_planned_batch = 0;
+	}
+}
+
+size_t SharPNetConv::workspace_bytes() const
+{
+	size_t bytes = 0;
+	for (const train_workspace& ws : _workspaces) {
+		bytes += ws._memory.size_in_bytes();
+	}
+	return bytes;
+}
+
+size_t SharPNetConv::unshared_workspace_bytes() const
+{
+	size_t bytes = 0;
+	for (const train_workspace& ws : _workspaces) {
+		bytes += ws._memory.unshared_bytes();
+	}
+	return bytes;
+}
+
+void SharPNetConv::reset_profile()
+{
+	if (profiling_enabled && _workers) {
+		_profiler.reset(_layers, _workers->size());
+	}
+}
+
+template<typename F>
+void SharPNetConv::run_batch(int count, const F& load)
+{
+	int nr_active = std::min(_workers->size(), count);
+
+	_workers->run([&](int t) {
+		train_workspace& ws = _workspaces[t];
+
+		if (t >= nr_active) {
+			ws._batch.clear();
+			ws._expected.clear();
+			return;
+		}
+
+		// shard t starts after the count / nr_active (+ 1 for the first
+		// count % nr_active shards) samples of every shard before it
+		int first = t * (count / nr_active) + std::min(t, count % nr_active);
+		int last = first + count / nr_active + (t < count % nr_active ? 1 : 0);
+
+		td_size in_size = _layers.front()->get_input_size();
+		td_size out_size = _layers.back()->get_output_size();
+
+		// load() either fills the slots in the arena or points the views elsewhere
+		bind_views(ws._batch, ws._input_memory, last - first, in_size, _layout);
+		bind_views(ws._expected, ws._expected_memory, last - first, out_size, _layout);
+
+		for (int i = first; i < last; i++) {
+			load(i, ws._batch[i - first], ws._expected[i - first]);
+		}
+
+		feed_forword(ws._batch, ws._contexts, t, 0, (int)_layers.size());
+		back_propagation(ws, t);
+	});
+
+#ifdef SHARPNET_PROFILING
+	uint64_t reduce_start = _profiler.now();
+	reduce_gradients(nr_active, count);
+	_profiler.record_reduce(reduce_start, _profiler.now());
+#else
+	reduce_gradients(nr_active, count);
+#endif
+
+	_optimizer->start_step();
+	for (unsigned int layer = 0; layer < _layers.size(); layer++) {
+		PROFILE_LAYER(_profiler, 0, layer, *_layers[layer], phase_t::Update, count);
+		_optimizer->update_layer(_layers[layer]);
+	}
+}
+
+std::vector<std::pair<float, float>> SharPNetConv::train(const std::vector<image_sample>& samples, int nr_epochs, int batch_size, int nr_threads)
+{
+	memory_dataset data(samples);
+	return train(data, nr_epochs, batch_size, nr_threads);
+}
+
+std::vector<std::pair<float, float>> SharPNetConv::train(const dataset& data, int nr_epochs, int batch_size, int nr_threads)
+{
+	_smoothing_factor = data.size() * .05f;
+	batch_size = std::max(batch_size, 1);
+
+	prepare_training(batch_size, nr_threads);
+
+	// a resumed run goes on with the epochs after the ones it trained
+	prefetcher batches(data, batch_size, nr_epochs, _pipeline, _history.size());
 
 	for (int pass = 0; pass < nr_epochs; pass++) {
-		std::vector<tensor<float>> predictions;
-		std::vector<tensor<float>> actual;
+		// the loss of the epoch is summed sample by sample, see accumulate_loss()
+		float loss_sum = 0.0f;
+		size_t nr_samples = 0;
+
+		// the prefetcher hands out the mini-batches of every epoch in turn
+		for (size_t start = 0; start < data.size(); start += batch_size) {
+			const sample_batch* batch = batches.next();
 
-		for (unsigned int i = 0; i < samples.size(); i++) {
-			tensor<float> data = convert_to_tensor(samples[i].data);
-			tensor<float> expected = convert_to_tensor(samples[i].expected);
+			run_batch((int)batch->_inputs.size(), [&](int i, tensor_view<float>& input, tensor_view<float>& expected) {
+				load_sample(batch->_inputs[i], batch->_expected[i], input, expected);
+			});
 
-			feed_forword(data);
-			back_propagation(expected);	
+			for (train_workspace& ws : _workspaces) {
+				std::vector<tensor_view<float>>& output = ws._contexts.back()->_output;
 
-			predictions.emplace_back(_layers.back()->get_output());
-			actual.emplace_back(expected);
+				for (unsigned int b = 0; b < ws._expected.size(); b++) {
+					td_size size = output[b]._size;
+					int output_size = size._x * size._y * size._z;
+
+					float error = 0.0;
+					for (int j = 0; j < output_size; j++) {
+						float delta = output[b]._data[j] - ws._expected[b]._data[j];
+						error += delta * delta;
+					}
+
+					error /= output_size;
+					error = sqrt(error);
+
+					_training_accuracy = ((_training_accuracy * _smoothing_factor + error) / (_smoothing_factor + 1.0));
+
+					loss_sum = accumulate_loss(_loss_function, output[b]._data, ws._expected[b]._data, output_size, loss_sum);
+					nr_samples++;
+				}
+			}
 		}
 
-		float loss = calculate_loss(predictions, actual);
+		float loss = sum_to_loss(_loss_function, loss_sum, nr_samples);
 		_training_accuracy = (1 - _training_accuracy) * 100;
 
 		_history.emplace_back(std::make_pair(loss, _training_accuracy));
+
+		if (!_checkpoint_file.empty()) {
+			save_checkpoint(_checkpoint_file);
+		}
 	}
 
 	return _history;
 }
 
-void SharPNetConv::feed_forword(tensor<float>& input)
+void SharPNetConv::load_sample(tensor_view<float> from_input, tensor_view<float> from_expected,
+	tensor_view<float>& input, tensor_view<float>& expected) const
 {
-	for (unsigned int layer = 0; layer < _layers.size(); layer++) {
+	// dense CHW samples are read in place, anything else is converted into
+	// the arena's slots
+	if (_layout == layout_t::CHW && from_input.is_dense() && from_expected.is_dense()) {
+		input = from_input;
+		expected = from_expected;
+	}
+	else {
+		copy_view(from_input, input);
+		copy_view(from_expected, expected);
+	}
+}
+
+void SharPNetConv::train_batch(const std::vector<tensor<float>>& inputs, const std::vector<tensor<float>>& expected)
+{
+	assert(inputs.size() == expected.size() && (int)inputs.size() <= _planned_batch);
+
+	run_batch((int)inputs.size(), [&](int i, tensor_view<float>& input, tensor_view<float>& output) {
+		load_sample(tensor_view<float>(inputs[i]._data, inputs[i]._size),
+			tensor_view<float>(expected[i]._data, expected[i]._size), input, output);
+	});
+}
+
+void SharPNetConv::train_batch(const std::vector<tensor_view<float>>& inputs, const std::vector<tensor_view<float>>& expected)
+{
+	assert(inputs.size() == expected.size() && (int)inputs.size() <= _planned_batch);
+
+	run_batch((int)inputs.size(), [&](int i, tensor_view<float>& input, tensor_view<float>& output) {
+		load_sample(inputs[i], expected[i], input, output);
+	});
+}
+
+void SharPNetConv::feed_forword(const std::vector<tensor_view<float>>& batch, network_context& ctx, int thread, int first, int last)
+{
+	for (int layer = first; layer < last; layer++) {
+		PROFILE_LAYER(_profiler, thread, layer, *_layers[layer], phase_t::Forward, (int)batch.size());
+
 		if (layer == 0) {
-			_layers[layer]->activate(input);
+			_layers[layer]->activate(batch, *ctx[layer]);
 		}
 		else {
-			tensor<float> last_output = _layers[layer - 1]->get_output();
-			_layers[layer]->activate(last_output);
+			_layers[layer]->activate(ctx[layer - 1]->_output, *ctx[layer]);
 		}
 	}
 }
 
-void SharPNetConv::back_propagation(tensor<float>& expected)
+void SharPNetConv::back_propagation(train_workspace& ws, int thread)
 {
-	int network_output_size = _layers.back()->get_output()._size._x *
-		_layers.back()->get_output()._size._y *
-		_layers.back()->get_output()._size._z;
+	network_context& ctx = ws._contexts;
+	std::vector<tensor_view<float>>& network_output = ctx.back()->_output;
 
-	int expected_size = expected._size._x * expected._size._y * expected._size._z;
+	td_size out_size = network_output[0]._size;
+	int network_output_size = out_size._x * out_size._y * out_size._z;
 
-	assert(network_output_size == expected_size);
+	assert(network_output_size == ws._expected[0]._size._x * ws._expected[0]._size._y * ws._expected[0]._size._z);
 
-	tensor<float> output_gradients = _layers.back()->get_output() - expected;
+	bind_views(ws._output_gradients, ws._output_gradient_memory, (int)ws._expected.size(), out_size, _layout);
 
-	for (int layer = _layers.size() - 1; layer >= 0; layer--) {
-		if (layer == _layers.size() - 1) {
-			_layers[layer]->calc_grads(output_gradients);
-		}
-		else {
-			tensor<float> last_gradients = _layers[layer + 1]->get_gradients();
-			_layers[layer]->calc_grads(last_gradients);
+	for (unsigned int b = 0; b < ws._expected.size(); b++) {
+		for (int j = 0; j < network_output_size; j++) {
+			ws._output_gradients[b]._data[j] = network_output[b]._data[j] - ws._expected[b]._data[j];
 		}
 	}
 
-	for (unsigned int layer = 0; layer < _layers.size(); layer++) {
-		_layers[layer]->fix_weights(_learning_rate);
-	}
+	// one segment between checkpoints at a time, whose outputs but the last
+	// were dropped after the forward pass and are computed again
+	for (int last = (int)_layers.size() - 1; last >= 0; last = segment_start(last) - 1) {
+		if (_checkpoint_every > 0) {
+			feed_forword(ws._batch, ctx, thread, segment_start(last), last);
+		}
+
+		for (int layer = last; layer >= segment_start(last); layer--) {
+			PROFILE_LAYER(_profiler, thread, layer, *_layers[layer], phase_t::Backward, (int)ws._expected.size());
 
-	float error = 0.0;
-	for (int j = 0; j < network_output_size; j++) {
-		float delta = _layers.back()->get_output()._data[j] - expected._data[j];
-		error += delta * delta;
+			if (layer == (int)_layers.size() - 1) {
+				_layers[layer]->calc_grads(ws._output_gradients, *ctx[layer]);
+			}
+			else {
+				_layers[layer]->calc_grads(ctx[layer + 1]->_gradients, *ctx[layer]);
+			}
+		}
 	}
+}
+
+void SharPNetConv::reduce_gradients(int nr_active, int batch_size)
+{
+	int nr_threads = _workers->size();
+
+	// Every thread adds up its own slice of each layer's weight gradients, always
+	// in context order, into the first context
+	_workers->run([&](int t) {
+		for (unsigned int layer = 0; layer < _layers.size(); layer++) {
+			float* sum = _workspaces[0]._contexts[layer]->_weight_grads;
+			int count = _layers[layer]->weight_count();
+			int first = (int)((long long)count * t / nr_threads);
+			int last = (int)((long long)count * (t + 1) / nr_threads);
+
+			for (int c = 1; c < nr_active; c++) {
+				const float* grads = _workspaces[c]._contexts[layer]->_weight_grads;
+
+				for (int i = first; i < last; i++) {
+					sum[i] += grads[i];
+				}
+			}
+		}
+	});
 
-	error /= network_output_size;
-	error = sqrt(error);
+	for (unsigned int layer = 0; layer < _layers.size(); layer++) {
+		if (_layers[layer]->weight_count() > 0) {
+			_layers[layer]->set_weight_grads(_workspaces[0]._contexts[layer]->_weight_grads, 1.0f / batch_size);
+		}
+	}
+}
 
-	_training_accuracy = ((_training_accuracy * _smoothing_factor + error) / (_smoothing_factor + 1.0));
+float SharPNetConv::evaluate(const std::vector<image_sample>& samples)
+{
+	return evaluate(memory_dataset(samples));
 }
 
-float SharPNetConv::evaluate(std::vector<image_sample> samples)
+// Smoothed accuracy of the outputs forward(input) gives for every sample of data
+template<typename F>
+static float smoothed_accuracy(const dataset& data, F forward)
 {
 	float model_accuracy = 0.0;
-	float smoothing_factor = samples.size() * .05f;
+	float smoothing_factor = data.size() * .05f;
 	float sum = 0.0;
-	std::vector<float> accuracy_vector;
-
-	for (unsigned int i = 0; i < samples.size(); i++) {
-		tensor<float> input = convert_to_tensor(samples[i].data);
-		tensor<float> expected = convert_to_tensor(samples[i].expected);
 
-		int network_output_size = _layers.back()->get_output()._size._x *
-			_layers.back()->get_output()._size._y *
-			_layers.back()->get_output()._size._z;
+	td_size in_size = data.input_size();
+	td_size out_size = data.output_size();
+	tensor<float> input(in_size._x, in_size._y, in_size._z);
+	tensor<float> expected(out_size._x, out_size._y, out_size._z);
 
-		int expected_size = expected._size._x * expected._size._y * expected._size._z;
+	for (size_t i = 0; i < data.size(); i++) {
+		data.read(i, input._data, expected._data);
 
-		feed_forword(input);
+		tensor_view<float> output = forward(input);
+		int network_output_size = output._size._x * output._size._y * output._size._z;
 
-		assert(network_output_size == expected_size);
+		assert(network_output_size == expected._size._x * expected._size._y * expected._size._z);
 
 		float error = 0.0;
 		for (int j = 0; j < network_output_size; j++) {
-			float delta = _layers.back()->get_output()._data[j] - expected._data[j];
+			float delta = output._data[j] - expected._data[j];
 			error = delta * delta;
 		}
 
@@ -123,37 +444,112 @@ float SharPNetConv::evaluate(std::vector<image_sample> samples)
 		error = sqrt(error);
 
 		model_accuracy = ((model_accuracy * smoothing_factor) + error) / (smoothing_factor + 1.0);
-		accuracy_vector.push_back(model_accuracy);
+		sum += model_accuracy;
 	}
 
-	for (auto ele : accuracy_vector) {
-		sum += ele;
-	}
-
-	_accuracy = sum / accuracy_vector.size();
-	_accuracy = (1 - _accuracy) * 100;
-	return _accuracy;
+	float accuracy = sum / data.size();
+	return (1 - accuracy) * 100;
 }
 
-float SharPNetConv::calculate_loss(std::vector<tensor<float>> predictions, std::vector<tensor<float>> actual)
+// Metrics of the outputs model gives for every sample of data. The prefetcher
+// reads the next batches while the threads predict the shards of the current
+// one, the same shards run_batch() gives the threads of a training step, each
+// with a workspace and an evaluation of its own. They are merged in thread order.
+template<typename M>
+static evaluation evaluate_batches(const dataset& data, const M& model, loss_t loss, const evaluation_options& options)
 {
-	float loss = 0.0f;
-	
-	if (_loss_function == loss_t::MeanSquaredError) {
-		loss = MSE(predictions, actual);
+	int nr_threads = std::max(options.nr_threads, 1);
+	td_size out_size = data.output_size();
+	int nr_classes = out_size._x * out_size._y * out_size._z;
+
+	assert(model.get_output_size()._x * model.get_output_size()._y * model.get_output_size()._z == nr_classes);
+
+	thread_group workers(nr_threads);
+	std::vector<decltype(model.create_workspace())> workspaces;
+	std::vector<evaluation> partial(nr_threads, evaluation(nr_classes, options.top_k));
+
+	for (int t = 0; t < nr_threads; t++) {
+		workspaces.push_back(model.create_workspace());
 	}
-	else if (_loss_function == loss_t::BinaryCrossentropy) {
-		loss = BinaryCrossentropy(predictions, actual);
+
+	pipeline_options pipeline;
+	pipeline.nr_workers = options.nr_readers;
+	prefetcher batches(data, options.batch_size, 1, pipeline);
+
+	while (const sample_batch* batch = batches.next()) {
+		int count = (int)batch->_inputs.size();
+		int nr_active = std::min(nr_threads, count);
+
+		workers.run([&](int t) {
+			if (t >= nr_active) {
+				return;
+			}
+
+			int first = t * (count / nr_active) + std::min(t, count % nr_active);
+			int last = first + count / nr_active + (t < count % nr_active ? 1 : 0);
+
+			for (int i = first; i < last; i++) {
+				tensor_view<float> output = model.predict(batch->_inputs[i], workspaces[t]);
+				const float* expected = batch->_expected[i]._data;
+
+				partial[t].add(output._data, expected, sample_loss(loss, output._data, expected, nr_classes));
+			}
+		});
 	}
-	else if (_loss_function == loss_t::CategoricalCrossentropy) {
-		loss = CategoricalCrossentropy(predictions, actual);
+
+	for (int t = 1; t < nr_threads; t++) {
+		partial[0].merge(partial[t]);
 	}
 
-	return loss;
+	return partial[0];
+}
+
+float SharPNetConv::evaluate(const dataset& data)
+{
+	SharPNetModel model = compile();
+	model_workspace workspace = model.create_workspace();
+
+	_accuracy = smoothed_accuracy(data, [&](tensor<float>& input) {
+		return model.predict(input, workspace);
+	});
+
+	return _accuracy;
+}
+
+float SharPNetConv::evaluate(const dataset& data, const SharPNetQuantizedModel& model) const
+{
+	quantized_workspace workspace = model.create_workspace();
+
+	return smoothed_accuracy(data, [&](tensor<float>& input) {
+		return model.predict(input, workspace);
+	});
+}
+
+evaluation SharPNetConv::evaluate(const dataset& data, const evaluation_options& options) const
+{
+	return evaluate_batches(data, compile(), _loss_function, options);
+}
+
+evaluation SharPNetConv::evaluate(const dataset& data, const SharPNetQuantizedModel& model, const evaluation_options& options) const
+{
+	return evaluate_batches(data, model, _loss_function, options);
+}
+
+SharPNetModel SharPNetConv::compile() const
+{
+	return SharPNetModel(std::vector<const layer*>(_layers.begin(), _layers.end()));
+}
+
+SharPNetQuantizedModel SharPNetConv::quantize(const dataset& calibration, size_t nr_samples) const
+{
+	return SharPNetQuantizedModel(compile(), calibration, nr_samples);
 }
 
 bool SharPNetConv::save(std::string filepath)
 {
+	// the text format holds the buffers inference doesn't keep
+	if (_inference_only) { return false; }
+
 	std::ofstream outfile(filepath);
 
 	if (!outfile.is_open()) { return false; }
@@ -203,6 +599,9 @@ bool SharPNetConv::load(std::string filepath)
 				else if (line == "LRelu") {
 					function = activation_t::LRelu;
 				}
+				else if (line == "Softmax") {
+					function = activation_t::Softmax;
+				}
 
 				layers.push_back(new FullConnected(tensor_input, tensor_output,
 					tensor_weight, tensor_gradients, function));
@@ -273,5 +672,425 @@ bool SharPNetConv::load(std::string filepath)
 
 	infile.close();
 
+	_inference_only = false;
+	set_layers(std::move(layers));
+	return true;
+}
+
+bool SharPNetConv::set_layout(layout_t layout)
+{
+	for (layer* layer : _layers) {
+		if (!layer->set_layout(layout)) {
+			for (unsigned int i = 0; i < _layers.size(); i++) {
+				_layers[i]->set_layout(_layout);
+			}
+
+			return false;
+		}
+	}
+
+	_layout = layout;
+
+	// the workspaces were planned for the old layout
+	_workspaces.clear();
+	_planned_batch = 0;
+	return true;
+}
+
+void SharPNetConv::set_inference_only()
+{
+	for (layer* l : _layers) {
+		l->set_inference_only();
+	}
+
+	// the optimizer stays, with its settings, for when the network is loaded
+	// for training again
+	_optimizer->clear();
+	_workspaces = std::vector<train_workspace>();
+	_workers.reset();
+	_planned_batch = 0;
+	_inference_only = true;
+}
+
+void SharPNetConv::set_optimizer(std::unique_ptr<optimizer> opt)
+{
+	_optimizer = std::move(opt);
+	_optimizer->clear();
+
+	for (layer* l : _layers) {
+		_optimizer->add_layer(l);
+	}
+}
+
+void SharPNetConv::set_layers(std::vector<layer*> layers)
+{
 	_layers = std::move(layers);
+
+	// the optimizer's state belongs to the old layers
+	if (!_inference_only) {
+		set_optimizer(std::move(_optimizer));
+	}
+
+	// new layers start out in CHW and keep it if they can't run in the
+	// network's layout
+	layout_t layout = _layout;
+	_layout = layout_t::CHW;
+	set_layout(layout);
+
+	// the output layer's gradient comes straight from the loss
+	if (!_layers.empty() && _layers.back()->type() == layer_t::FullConnected) {
+		static_cast<FullConnected*>(_layers.back())->set_loss(_loss_function);
+	}
+
+	// the workspaces were planned for the old layers
+	_workspaces.clear();
+	_planned_batch = 0;
+}
+
+bool SharPNetConv::save_binary(std::string filepath)
+{
+	static const char padding[MODEL_ALIGNMENT] = { };
+
+	if (!is_little_endian()) { return false; }
+
+	std::vector<layer_record> records(_layers.size());
+	uint64_t offset = align_offset(sizeof(model_header) + records.size() * sizeof(layer_record));
+
+	for (unsigned int i = 0; i < _layers.size(); i++) {
+		layer* layer = _layers[i];
+		layer_record& record = records[i];
+		memset(&record, 0, sizeof(record));
+
+		td_size in_size = layer->get_input_size();
+		td_size out_size = layer->get_output_size();
+
+		record.type = (uint32_t)layer->type();
+		record.in_size[0] = in_size._x;
+		record.in_size[1] = in_size._y;
+		record.in_size[2] = in_size._z;
+		record.out_size[0] = out_size._x;
+		record.out_size[1] = out_size._y;
+		record.out_size[2] = out_size._z;
+
+		if (layer->type() == layer_t::Convolutional) {
+			ConvLayer* conv = static_cast<ConvLayer*>(layer);
+			record.stride = conv->get_stride();
+			record.filter_dem = conv->get_filter_dem();
+		}
+		else if (layer->type() == layer_t::Pooling) {
+			PoolingLayer* pooling = static_cast<PoolingLayer*>(layer);
+			record.stride = pooling->get_stride();
+			record.filter_dem = pooling->get_filter_dem();
+		}
+		else if (layer->type() == layer_t::FullConnected) {
+			record.activation = (uint32_t)static_cast<FullConnected*>(layer)->get_activation();
+		}
+
+		tensor_view<float> weights = layer->get_weights();
+		record.weight_count = (uint64_t)weights._size._x * weights._size._y * weights._size._z;
+
+		if (record.weight_count > 0) {
+			record.weight_offset = offset;
+			offset = align_offset(offset + record.weight_count * sizeof(float));
+		}
+	}
+
+	model_header header;
+	memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+	header.version = MODEL_VERSION;
+	header.nr_layers = (uint32_t)records.size();
+	header.file_size = offset;
+
+	std::ofstream outfile(filepath, std::ios::binary | std::ios::trunc);
+
+	if (!outfile.is_open()) { return false; }
+
+	outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	outfile.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(layer_record));
+
+	// every blob and the end of the file are padded with zeros up to the alignment
+	for (unsigned int i = 0; i < _layers.size(); i++) {
+		if (records[i].weight_count == 0) {
+			continue;
+		}
+
+		outfile.write(padding, records[i].weight_offset - (uint64_t)outfile.tellp());
+		outfile.write(reinterpret_cast<const char*>(_layers[i]->get_weights()._data), records[i].weight_count * sizeof(float));
+	}
+
+	outfile.write(padding, header.file_size - (uint64_t)outfile.tellp());
+	outfile.close();
+
+	return !outfile.fail();
+}
+
+// Extent of the output of a window of filter_dem moved by stride over in
+// values, 0 when the window doesn't fit or the parameters are out of the range
+// the layers take. In 64 bit, so no record can overflow it.
+static int64_t window_extent(int32_t in, uint32_t filter_dem, uint32_t stride)
+{
+	if (filter_dem == 0 || stride == 0 || filter_dem > USHRT_MAX || stride > USHRT_MAX || (int64_t)filter_dem > in) {
+		return 0;
+	}
+
+	return ((int64_t)in - filter_dem) / stride + 1;
+}
+
+bool SharPNetConv::load_binary(std::string filepath, bool inference_only)
+{
+	if (!is_little_endian()) { return false; }
+
+	std::unique_ptr<mapped_file> file(new mapped_file());
+
+	if (!file->open(filepath) || file->size() < sizeof(model_header)) { return false; }
+
+	model_header header;
+	memcpy(&header, file->data(), sizeof(header));
+
+	if (memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0 ||
+		header.version != MODEL_VERSION ||
+		header.file_size != file->size() ||
+		sizeof(model_header) + (uint64_t)header.nr_layers * sizeof(layer_record) > file->size()) {
+		return false;
+	}
+
+	const layer_record* records = reinterpret_cast<const layer_record*>(file->data() + sizeof(model_header));
+	std::vector<layer*> layers;
+	bool valid = header.nr_layers > 0;
+
+	for (uint32_t i = 0; i < header.nr_layers && valid; i++) {
+		const layer_record& record = records[i];
+		td_size in_size = { record.in_size[0], record.in_size[1], record.in_size[2] };
+		td_size out_size = { record.out_size[0], record.out_size[1], record.out_size[2] };
+
+		valid = in_size._x > 0 && in_size._y > 0 && in_size._z > 0 &&
+			out_size._x > 0 && out_size._y > 0 && out_size._z > 0 &&
+			(uint64_t)in_size._x * in_size._y * in_size._z <= INT_MAX &&
+			(uint64_t)out_size._x * out_size._y * out_size._z <= INT_MAX &&
+			record.weight_offset % MODEL_ALIGNMENT == 0 &&
+			record.weight_offset <= file->size() &&
+			record.weight_count <= file->size() / sizeof(float) &&
+			record.weight_offset + record.weight_count * sizeof(float) <= file->size();
+
+		if (!valid) {
+			break;
+		}
+
+		float* weights = reinterpret_cast<float*>(file->data() + record.weight_offset);
+
+		// every shape is checked before a layer is made from it, the layers
+		// assume they are consistent
+		switch ((layer_t)record.type) {
+		case layer_t::Convolutional: {
+			uint64_t filter_size = (uint64_t)record.filter_dem * record.filter_dem * in_size._z;
+
+			valid = window_extent(in_size._x, record.filter_dem, record.stride) == out_size._x &&
+				window_extent(in_size._y, record.filter_dem, record.stride) == out_size._y &&
+				filter_size <= INT_MAX &&
+				record.weight_count == filter_size * out_size._z;
+
+			if (valid) {
+				layers.push_back(new ConvLayer(record.stride, record.filter_dem, in_size,
+					tensor<float>::borrow(weights, { (int)filter_size, out_size._z, 1 })));
+			}
+			break;
+		}
+		case layer_t::Pooling:
+			valid = window_extent(in_size._x, record.filter_dem, record.stride) == out_size._x &&
+				window_extent(in_size._y, record.filter_dem, record.stride) == out_size._y &&
+				out_size._z == in_size._z && record.weight_count == 0;
+
+			if (valid) {
+				layers.push_back(new PoolingLayer(record.stride, record.filter_dem, in_size));
+			}
+			break;
+		case layer_t::Relu:
+			valid = record.weight_count == 0;
+
+			if (valid) {
+				layers.push_back(new ReluLayer(in_size));
+			}
+			break;
+		case layer_t::FullConnected: {
+			uint64_t input_size = (uint64_t)in_size._x * in_size._y * in_size._z;
+
+			valid = record.activation <= (uint32_t)activation_t::Softmax &&
+				out_size._y == 1 && out_size._z == 1 &&
+				record.weight_count == input_size * out_size._x;
+
+			if (valid) {
+				layers.push_back(new FullConnected(in_size,
+					tensor<float>::borrow(weights, { (int)input_size, out_size._x, 1 }),
+					(activation_t)record.activation));
+			}
+			break;
+		}
+		default:
+			valid = false;
+		}
+
+		// the shapes a layer derives from its parameters have to match the file
+		if (valid) {
+			td_size derived = layers.back()->get_output_size();
+			valid = derived._x == out_size._x && derived._y == out_size._y && derived._z == out_size._z;
+		}
+
+		if (valid && inference_only) {
+			layers.back()->set_inference_only();
+		}
+	}
+
+	if (!valid) {
+		for (layer* layer : layers) {
+			delete layer;
+		}
+
+		return false;
+	}
+
+	_inference_only = inference_only;
+	set_layers(std::move(layers));
+	_model_file = std::move(file);
+
+	if (inference_only) {
+		set_inference_only();
+	}
+	return true;
+}
+
+bool SharPNetConv::save_checkpoint(std::string filepath)
+{
+	if (!is_little_endian() || _inference_only) { return false; }
+
+	if (!_checkpoints) {
+		_checkpoints.reset(new checkpoint_writer());
+	}
+
+	std::vector<float>& state = _optimizer->state();
+
+	checkpoint_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.nr_layers = (uint32_t)_layers.size();
+	header.steps = _optimizer->get_steps();
+	header.state_count = state.size();
+	header.nr_epochs = (uint32_t)_history.size();
+	header.learning_rate = _optimizer->get_learning_rate();
+	header.training_accuracy = _training_accuracy;
+
+	uint64_t weight_count = 0;
+	for (layer* layer : _layers) {
+		weight_count += layer->weight_count();
+	}
+
+	header.file_size = sizeof(header) + _layers.size() * sizeof(checkpoint_record) +
+		(weight_count + state.size() + 2 * _history.size()) * sizeof(float);
+
+	// the snapshot is copied straight into the writer's buffer
+	std::vector<char>& bytes = _checkpoints->begin();
+	bytes.resize(header.file_size);
+	char* out = bytes.data();
+
+	memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+
+	for (layer* layer : _layers) {
+		checkpoint_record record;
+		memset(&record, 0, sizeof(record));
+		record.type = (uint32_t)layer->type();
+		record.weight_count = layer->weight_count();
+
+		memcpy(out, &record, sizeof(record));
+		out += sizeof(record);
+	}
+
+	for (layer* layer : _layers) {
+		memcpy(out, layer->get_weights()._data, layer->weight_count() * sizeof(float));
+		out += layer->weight_count() * sizeof(float);
+	}
+
+	memcpy(out, state.data(), state.size() * sizeof(float));
+	out += state.size() * sizeof(float);
+
+	for (const std::pair<float, float>& epoch : _history) {
+		memcpy(out, &epoch.first, sizeof(float));
+		memcpy(out + sizeof(float), &epoch.second, sizeof(float));
+		out += 2 * sizeof(float);
+	}
+
+	_checkpoints->commit(filepath);
+	return true;
+}
+
+bool SharPNetConv::wait_for_checkpoints()
+{
+	return !_checkpoints || _checkpoints->wait();
+}
+
+bool SharPNetConv::resume(std::string filepath)
+{
+	if (!is_little_endian() || _inference_only) { return false; }
+
+	mapped_file file;
+
+	if (!file.open(filepath) || file.size() < sizeof(checkpoint_header)) { return false; }
+
+	checkpoint_header header;
+	memcpy(&header, file.data(), sizeof(header));
+
+	std::vector<float>& state = _optimizer->state();
+
+	if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+		header.version != CHECKPOINT_VERSION ||
+		header.file_size != file.size() ||
+		header.nr_layers != _layers.size() ||
+		header.state_count != state.size() ||
+		file.size() < sizeof(header) + _layers.size() * sizeof(checkpoint_record)) {
+		return false;
+	}
+
+	// the layers have to be the ones the checkpoint was saved from
+	const char* in = file.data() + sizeof(header);
+	uint64_t weight_count = 0;
+
+	for (layer* layer : _layers) {
+		checkpoint_record record;
+		memcpy(&record, in, sizeof(record));
+		in += sizeof(record);
+
+		if (record.type != (uint32_t)layer->type() || record.weight_count != (uint64_t)layer->weight_count()) {
+			return false;
+		}
+		weight_count += record.weight_count;
+	}
+
+	if (header.file_size != sizeof(header) + _layers.size() * sizeof(checkpoint_record) +
+		(weight_count + state.size() + 2 * (uint64_t)header.nr_epochs) * sizeof(float)) {
+		return false;
+	}
+
+	for (layer* layer : _layers) {
+		memcpy(layer->get_weights()._data, in, layer->weight_count() * sizeof(float));
+		in += layer->weight_count() * sizeof(float);
+
+		if (layer->weight_count() > 0) {
+			layer->weights_changed();
+		}
+	}
+
+	memcpy(state.data(), in, state.size() * sizeof(float));
+	in += state.size() * sizeof(float);
+
+	_history.resize(header.nr_epochs);
+	for (std::pair<float, float>& epoch : _history) {
+		memcpy(&epoch.first, in, sizeof(float));
+		memcpy(&epoch.second, in + sizeof(float), sizeof(float));
+		in += 2 * sizeof(float);
+	}
+
+	_optimizer->set_steps(header.steps);
+	_optimizer->set_learning_rate(header.learning_rate);
+	_training_accuracy = header.training_accuracy;
+	return true;
 }
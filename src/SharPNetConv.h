@@ -1,6 +1,9 @@
 #ifndef SHARPNETCONV_H
 #define SHARPNETCONV_H
 
+#include "Data/dataset.h"
+#include "Data/prefetcher.h"
+#include "IO/checkpoint_writer.h"
 #include "Layers/tensor.h"
 #include "Layers/layer.h"
 #include "Layers/convolutional.h"
@@ -8,12 +11,29 @@
 #include "Layers/relu.h"
 #include "Layers/pooling.h"
 #include "Learning/learning.h"
+#include "Learning/metrics.h"
+#include "Learning/optimizer.h"
+#include "Memory/mapped_file.h"
+#include "Parallel/thread_group.h"
+#include "Profiling/profiler.h"
+#include "SharPNetModel.h"
+#include "SharPNetQuantizedModel.h"
 
-struct image_sample
+// Everything one training thread writes while it runs its shard of a
+// mini-batch. The arena is planned for the largest shard up front, so a
+// training step after the first one doesn't allocate.
+struct train_workspace
 {
-	td_size image_shape;
-	std::vector<std::vector<std::vector<float>>> data;
-	std::vector<float> expected;
+	arena _memory;
+	network_context _contexts;
+
+	std::vector<tensor_view<float>> _batch;
+	std::vector<tensor_view<float>> _expected;
+	std::vector<tensor_view<float>> _output_gradients;
+
+	float* _input_memory = nullptr;
+	float* _expected_memory = nullptr;
+	float* _output_gradient_memory = nullptr;
 };
 
 class SharPNetConv
@@ -24,15 +44,40 @@ private:
 	float _accuracy;
 	float _smoothing_factor;
 	loss_t _loss_function;
-	float _learning_rate;
+	std::unique_ptr<optimizer> _optimizer;
+	layout_t _layout = layout_t::CHW;
+	bool _inference_only = false;
+	pipeline_options _pipeline;
 
 	std::vector<std::pair<float, float>> _history;
 	std::vector<layer*> _layers;
 
-	float calculate_loss(std::vector<tensor<float>> predictions, std::vector<tensor<float>> acutal);
+	// Backs the weights of layers read by load_binary()
+	std::unique_ptr<mapped_file> _model_file;
+
+	std::unique_ptr<checkpoint_writer> _checkpoints;
+	std::string _checkpoint_file;
+
+	std::unique_ptr<thread_group> _workers;
+	std::vector<train_workspace> _workspaces;
+	int _planned_batch = 0;
+	bool _share_memory = true;
+	int _checkpoint_every = 0;
 
-	void feed_forword(tensor<float>& input);
-	void back_propagation(tensor<float>& expected);
+	profiler _profiler;
+
+	// Layers first .. last - 1, the first of them reads batch if it is layer 0
+	void feed_forword(const std::vector<tensor_view<float>>& batch, network_context& ctx, int thread, int first, int last);
+	void back_propagation(train_workspace& workspace, int thread);
+	void reduce_gradients(int nr_active, int batch_size);
+	std::vector<layer_schedule> training_schedule() const;
+	int segment_start(int last) const;
+	void set_layers(std::vector<layer*> layers);
+	void load_sample(tensor_view<float> from_input, tensor_view<float> from_expected,
+		tensor_view<float>& input, tensor_view<float>& expected) const;
+
+	template<typename F>
+	void run_batch(int count, const F& load);
 
 public:
 	SharPNetConv(std::vector<layer*> topology, loss_t loss, float learning_rate = 0.01f);
@@ -42,14 +87,142 @@ public:
 		_smoothing_factor = 0.0f;
 
 		_loss_function = loss;
-		this->_learning_rate = learning_rate;
+		_optimizer.reset(new sgd_optimizer(learning_rate));
 	}
 
-	std::vector<std::pair<float, float>> train(std::vector<image_sample> samples, int nr_epochs);
-	float evaluate(std::vector<image_sample> samples);
+	// Every mini-batch is split into nr_threads contiguous shards that run on
+	// their own thread with their own network_context. The weight gradients of
+	// the shards are then summed in thread order, so a fixed thread count always
+	// gives the same weights.
+	std::vector<std::pair<float, float>> train(const std::vector<image_sample>& samples, int nr_epochs, int batch_size = 1, int nr_threads = 1);
+
+	// Same as above, with the mini-batches read from data by the prefetcher's
+	// workers while the previous ones train, see Data/prefetcher.h. Only a few
+	// mini-batches are in memory at any time.
+	std::vector<std::pair<float, float>> train(const dataset& data, int nr_epochs, int batch_size = 1, int nr_threads = 1);
+
+	// How the weights are updated from the gradients of a mini-batch, see
+	// Learning/optimizer.h. By default momentum SGD at the learning rate passed
+	// to the constructor. Setting an optimizer starts its state over.
+	void set_optimizer(std::unique_ptr<optimizer> opt);
+	optimizer& get_optimizer() { return *_optimizer; }
+
+	// Drops everything but the weights and the shapes for serving: the
+	// layers' gradient and single-sample buffers, see layer::set_inference_only(),
+	// the optimizer's state and the training workspaces. The network can't
+	// train afterwards, nor be saved as text, but evaluates, compiles, quantizes
+	// and saves in binary as before. Loading a network resets it.
+	void set_inference_only();
+	bool is_inference_only() const { return _inference_only; }
+
+	// How train() shuffles and augments the samples and how many threads
+	// prepare them. By default samples are trained on in order, as they are.
+	void set_pipeline(const pipeline_options& options) { _pipeline = options; }
+	const pipeline_options& get_pipeline() const { return _pipeline; }
+
+	// Plans the thread pool and one train_workspace per thread for mini-batches
+	// of up to batch_size samples. train() does this itself; it only has to be
+	// called before train_batch(), and again whenever either number grows.
+	void prepare_training(int batch_size, int nr_threads);
+
+	// Within a train_workspace buffers of different layers share memory
+	// wherever their lifetimes in a training step don't overlap, see
+	// layer_schedule. Off, every buffer gets memory of its own, e.g. to
+	// compare the two; the workspaces are planned again.
+	void share_workspace_memory(bool enable);
+
+	// Gradient checkpointing for deep networks that don't fit in memory: only
+	// the outputs of every k-th layer, and of the last one, are kept through a
+	// training step, and the backward pass runs the layers in between forward
+	// again, one segment at a time. The weights come out the same at the cost
+	// of a second forward pass of most layers. 0, the default, keeps every
+	// output. It saves memory only while the workspace shares it, see
+	// share_workspace_memory(); the workspaces are planned again.
+	void set_checkpointing(int every);
+	int get_checkpointing() const { return _checkpoint_every; }
+
+	// Bytes the training workspaces take, and would take if no buffers shared
+	// memory, 0 before prepare_training()
+	size_t workspace_bytes() const;
+	size_t unshared_workspace_bytes() const;
+
+	// One optimizer step on a single mini-batch of inputs.size() samples, at most
+	// batch_size as passed to prepare_training(). Samples are read in place, and
+	// once the workspaces are planned nothing is allocated.
+	void train_batch(const std::vector<tensor<float>>& inputs, const std::vector<tensor<float>>& expected);
+	void train_batch(const std::vector<tensor_view<float>>& inputs, const std::vector<tensor_view<float>>& expected);
+
+	// Smoothed accuracy in percent, one sample after the other on the calling
+	// thread
+	float evaluate(const std::vector<image_sample>& samples);
+	float evaluate(const dataset& data);
+
+	// The same accuracy for a quantized version of the network, see quantize()
+	float evaluate(const dataset& data, const SharPNetQuantizedModel& model) const;
+
+	// Mean loss, top-1 and top-k accuracy and the confusion matrix over data,
+	// see Learning/metrics.h. The samples are streamed in batches and every
+	// batch is split into contiguous shards that run on their own thread with
+	// their own workspace of a compiled model, see options. Only a few batches
+	// are in memory at a time, whatever the size of data. The counts don't
+	// depend on the number of threads, the loss only up to rounding.
+	evaluation evaluate(const dataset& data, const evaluation_options& options) const;
+	evaluation evaluate(const dataset& data, const SharPNetQuantizedModel& model, const evaluation_options& options) const;
+
+	// Runs every layer in the given layout, see layer::set_layout(). Samples are
+	// still passed in CHW; they are converted when they enter the network, and
+	// FullConnected layers convert back. Returns false, changing nothing, when a
+	// layer can't run in the layout.
+	bool set_layout(layout_t layout);
+	layout_t get_layout() const { return _layout; }
+
+	// Read-only view of the trained weights for serving, see SharPNetModel.
+	// The network has to outlive the model and must not train while it's in use.
+	SharPNetModel compile() const;
+
+	// int8 version of the network for serving, calibrated on the first
+	// nr_samples samples of calibration, all of them for 0. Unlike a compiled
+	// model it holds a copy of the weights and doesn't need the network.
+	SharPNetQuantizedModel quantize(const dataset& calibration, size_t nr_samples = 0) const;
+
+	// Time, FLOPs, bytes and allocations of every layer's forward, backward and
+	// update phases since the workspaces were planned or reset_profile(), see
+	// Profiling/profiler.h. All zero unless built with SHARPNET_PROFILING.
+	std::vector<layer_profile> profile() const { return _profiler.layers(); }
+	void reset_profile();
+	bool save_trace(std::string filepath) const { return _profiler.save_trace(filepath); }
 
 	bool save(std::string filepath);
 	bool load(std::string filepath);
+
+	// Versioned binary format holding only shapes and weights, see
+	// IO/model_format.h. load_binary() maps the file and the layers use the
+	// weights right where they are mapped, so loading costs the same whatever
+	// the model size. Loading a network invalidates models compiled before.
+	// With inference_only every layer drops its training buffers as soon as it
+	// is made, see set_inference_only(), so loading never holds them for more
+	// than one layer.
+	bool save_binary(std::string filepath);
+	bool load_binary(std::string filepath, bool inference_only = false);
+
+	// Training checkpoints, see IO/checkpoint_format.h: the weights, the
+	// optimizer's state and step count, the learning rate and the history of
+	// every epoch. save_checkpoint() only copies them, the file is written on a
+	// thread of its own and replaced atomically, see IO/checkpoint_writer.h;
+	// wait_for_checkpoints() returns once every checkpoint is on disk, false if
+	// writing one failed. resume() restores them into a network of the same
+	// layers and optimizer, and training goes on exactly as if it had never
+	// stopped, epochs and their shuffling included.
+	bool save_checkpoint(std::string filepath);
+	bool wait_for_checkpoints();
+	bool resume(std::string filepath);
+
+	// train() saves a checkpoint to filepath after every epoch, none if empty,
+	// the default
+	void set_checkpoint_file(std::string filepath) { _checkpoint_file = filepath; }
+
+	// Epochs trained so far
+	int get_epoch() const { return (int)_history.size(); }
 };
 
 
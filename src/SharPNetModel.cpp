@@ -0,0 +1,128 @@
+#include "SharPNetModel.h"
+#include "Layers/pooling.h"
+#include <algorithm>
+#include <cassert>
+
+SharPNetModel::SharPNetModel(std::vector<const layer*> layers, bool fuse)
+{
+	_layers = std::move(layers);
+
+	for (unsigned int i = 0; i < _layers.size(); i++) {
+		model_step step;
+		step._first = i;
+		step._last = i;
+
+		if (fuse && _layers[i]->type() == layer_t::Convolutional) {
+			if (step._last + 1 < _layers.size() && _layers[step._last + 1]->type() == layer_t::Relu) {
+				step._epilogue.relu = true;
+				step._last++;
+			}
+
+			if (step._last + 1 < _layers.size() && _layers[step._last + 1]->type() == layer_t::Pooling) {
+				const PoolingLayer* pool = static_cast<const PoolingLayer*>(_layers[step._last + 1]);
+				step._epilogue.pool_dem = pool->get_filter_dem();
+				step._epilogue.pool_stride = pool->get_stride();
+				step._last++;
+			}
+		}
+
+		_steps.push_back(step);
+		i = step._last;
+	}
+}
+
+model_workspace SharPNetModel::create_workspace(bool keep_activations) const
+{
+	model_workspace workspace;
+
+	for (const layer* layer : _layers) {
+		workspace._contexts.push_back(layer->create_context());
+	}
+
+	workspace._activations.resize(_layers.size());
+
+	workspace._memory.plan([&](arena& memory) {
+		td_size in_size = _layers.front()->get_input_size();
+		workspace._input = tensor_view<float>(memory.allocate(in_size._x * in_size._y * in_size._z), in_size,
+			_layers.front()->get_layout());
+
+		// step s writes buffer s % 2, each as large as the largest output it holds
+		size_t largest[2] = { 0, 0 };
+		for (unsigned int s = 0; s < _steps.size(); s++) {
+			td_size out_size = _layers[_steps[s]._last]->get_output_size();
+			largest[s % 2] = std::max(largest[s % 2], (size_t)out_size._x * out_size._y * out_size._z);
+		}
+
+		float* ping_pong[2] = { nullptr, nullptr };
+		if (!keep_activations) {
+			ping_pong[0] = memory.allocate(largest[0]);
+			ping_pong[1] = largest[1] > 0 ? memory.allocate(largest[1]) : nullptr;
+		}
+
+		for (unsigned int s = 0; s < _steps.size(); s++) {
+			const layer* last = _layers[_steps[s]._last];
+			td_size out_size = last->get_output_size();
+			float* out = keep_activations ? memory.allocate(out_size._x * out_size._y * out_size._z) : ping_pong[s % 2];
+
+			workspace._activations[_steps[s]._last] = tensor_view<float>(out, out_size, last->get_layout());
+		}
+
+		size_t scratch = memory.mark();
+
+		for (const model_step& step : _steps) {
+			if (step.fused()) {
+				static_cast<const ConvLayer*>(_layers[step._first])->plan_fused(*workspace._contexts[step._first], memory, step._epilogue);
+			}
+			else {
+				_layers[step._first]->plan(*workspace._contexts[step._first], memory, 1, false);
+			}
+
+			memory.release(scratch);
+		}
+	});
+
+	return workspace;
+}
+
+tensor_view<float> SharPNetModel::predict(tensor_view<float> input, model_workspace& workspace) const
+{
+	assert(workspace._activations.size() == _layers.size());
+
+	// input in another layout than the network's is converted on the way in
+	if (!input.is_dense(_layers.front()->get_layout())) {
+		copy_view(input, workspace._input);
+		input = workspace._input;
+	}
+
+	for (const model_step& step : _steps) {
+		tensor_view<float> in = step._first == 0 ? input : workspace._activations[step._first - 1];
+		tensor_view<float> out = workspace._activations[step._last];
+		layer_context& ctx = *workspace._contexts[step._first];
+
+		if (step.fused()) {
+			static_cast<const ConvLayer*>(_layers[step._first])->infer_fused(in, out, ctx, step._epilogue);
+		}
+		else {
+			_layers[step._first]->infer(in, out, ctx);
+		}
+	}
+
+	return workspace._activations.back();
+}
+
+tensor_view<float> SharPNetModel::predict(const std::vector<std::vector<std::vector<float>>>& data, model_workspace& workspace) const
+{
+	tensor_view<float> input = workspace._input;
+
+	assert(data.size() == input._size._x && data[0].size() == input._size._y && data[0][0].size() == input._size._z);
+
+	for (int i = 0; i < input._size._x; i++) {
+		for (int j = 0; j < input._size._y; j++) {
+			for (int k = 0; k < input._size._z; k++) {
+				input(i, j, k) = data[i][j][k];
+			}
+		}
+	}
+
+	return predict(input, workspace);
+}
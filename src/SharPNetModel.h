@@ -0,0 +1,65 @@
+#ifndef SHARPNETMODEL_H
+#define SHARPNETMODEL_H
+
+#include <vector>
+#include "Layers/tensor.h"
+#include "Layers/layer.h"
+#include "Layers/convolutional.h"
+
+// Activations of one inference request. Every buffer comes out of one arena
+// planned when the workspace is created, so predict() doesn't allocate per call.
+// Layers fused into the convolution before them have no activation of their
+// own, their view stays empty. Unless the workspace keeps every activation,
+// the views of consecutive steps alternate between two buffers.
+struct model_workspace
+{
+	arena _memory;
+	tensor_view<float> _input;
+	std::vector<tensor_view<float>> _activations;
+	network_context _contexts;
+};
+
+// One step of predict(): a single layer, or a convolution with the relu and
+// pooling layers right after it fused into it, see ConvLayer::infer_fused()
+struct model_step
+{
+	unsigned int _first;	// index of the step's layer
+	unsigned int _last;		// index of the last layer it covers
+	conv_epilogue _epilogue;
+
+	bool fused() const { return _last > _first; }
+};
+
+// A trained network compiled for serving. It only holds const pointers to the
+// layers, so the weights are shared by every copy of the model and every
+// request, and predict() never writes to them. Each concurrent caller brings its
+// own model_workspace; apart from that predict() is reentrant.
+class SharPNetModel
+{
+private:
+	std::vector<const layer*> _layers;
+	std::vector<model_step> _steps;
+
+public:
+	// With fuse, every convolution followed by a relu, a max pooling or a relu
+	// and then a max pooling runs as one step with them, giving the same
+	// outputs without writing out the convolution's
+	explicit SharPNetModel(std::vector<const layer*> layers, bool fuse = true);
+
+	// A step only reads the output of the step before it, so by default the
+	// steps write two buffers in turn, each as large as the largest output, and
+	// only the last output is left after predict(). With keep_activations every
+	// step writes a buffer of its own. The scratch of the steps always shares
+	// memory, only one step runs at a time.
+	model_workspace create_workspace(bool keep_activations = false) const;
+
+	// input may be in any layout, the output is in the layout of the network
+	tensor_view<float> predict(tensor_view<float> input, model_workspace& workspace) const;
+	tensor_view<float> predict(const std::vector<std::vector<std::vector<float>>>& data, model_workspace& workspace) const;
+
+	td_size get_output_size() const { return _layers.back()->get_output_size(); }
+	const std::vector<const layer*>& get_layers() const { return _layers; }
+	const std::vector<model_step>& get_steps() const { return _steps; }
+};
+
+#endif
@@ -0,0 +1,504 @@
+#include "SharPNetQuantizedModel.h"
+#include "IO/quantized_format.h"
+#include "Layers/fullconnected.h"
+#include "Layers/convolutional.h"
+#include "Layers/pooling.h"
+#include "Math/im2col.h"
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+static int volume(td_size size)
+{
+	return size._x * size._y * size._z;
+}
+
+// Per row symmetric quantization of rows x k weights into rows x k4
+static void quantize_weights(quantized_layer& q, const float* weights)
+{
+	int rows = q.rows();
+
+	q._k4 = (q._k + 3) / 4 * 4;
+	q._weights.assign((size_t)rows * q._k4, 0);
+	q._weight_scales.resize(rows);
+	q._row_sums.resize(rows);
+
+	for (int r = 0; r < rows; r++) {
+		const float* row = weights + (size_t)r * q._k;
+		float max = 0.0f;
+
+		for (int i = 0; i < q._k; i++) {
+			max = std::max(max, std::fabs(row[i]));
+		}
+
+		float scale = max > 0.0f ? max / 127.0f : 1.0f;
+		int32_t sum = 0;
+
+		for (int i = 0; i < q._k; i++) {
+			long value = std::min<long>(std::max<long>(std::lround(row[i] / scale), -127), 127);
+			q._weights[(size_t)r * q._k4 + i] = (int8_t)value;
+			sum += (int32_t)value;
+		}
+
+		q._weight_scales[r] = scale;
+		q._row_sums[r] = sum;
+	}
+}
+
+static void apply_activation(activation_t activation, float* values, int n)
+{
+	switch (activation) {
+	case activation_t::Sigmoid: apply_activation<activation_t::Sigmoid>(values, values, n); break;
+	case activation_t::Tanh: apply_activation<activation_t::Tanh>(values, values, n); break;
+	case activation_t::Relu: apply_activation<activation_t::Relu>(values, values, n); break;
+	case activation_t::LRelu: apply_activation<activation_t::LRelu>(values, values, n); break;
+	case activation_t::Softmax: softmax(values, values, n); break;
+	}
+}
+
+// Max pooling of 8 bit CHW input, with the window size F fixed at compile time
+// for the common ones, which unrolls the window; 0 takes it from l
+template<int F>
+static void max_pool(const quantized_layer& l, const uint8_t* in, uint8_t* out)
+{
+	// locals, as the 8 bit stores could alias any field of l
+	int filter_dem = F > 0 ? F : l._filter_dem;
+	int stride = l._stride;
+	int in_x = l._in_size._x;
+	int out_x = l._out_size._x;
+	int out_y = l._out_size._y;
+	int plane = in_x * l._in_size._y;
+
+	for (int z = 0; z < l._out_size._z; z++) {
+		const uint8_t* channel = in + z * plane;
+		uint8_t* dst = out + z * out_y * out_x;
+
+		for (int y = 0; y < out_y; y++) {
+			for (int x = 0; x < out_x; x++) {
+				const uint8_t* window = channel + y * stride * in_x + x * stride;
+				uint8_t max = 0;
+
+				for (int j = 0; j < filter_dem; j++) {
+					for (int i = 0; i < filter_dem; i++) {
+						max = std::max(max, window[j * in_x + i]);
+					}
+				}
+
+				dst[y * out_x + x] = max;
+			}
+		}
+	}
+}
+
+SharPNetQuantizedModel::SharPNetQuantizedModel(const SharPNetModel& model, const dataset& calibration, size_t nr_samples)
+{
+	const std::vector<const layer*>& layers = model.get_layers();
+	size_t count = nr_samples == 0 ? calibration.size() : std::min(nr_samples, calibration.size());
+
+	// range of the network's input at 0 and of the output of layer l at l + 1
+	std::vector<float> min(layers.size() + 1, FLT_MAX);
+	std::vector<float> max(layers.size() + 1, -FLT_MAX);
+
+	// unfused, so every layer's output is there to be measured
+	SharPNetModel unfused(layers, false);
+	model_workspace workspace = unfused.create_workspace(true);
+	td_size in_size = calibration.input_size();
+	td_size out_size = calibration.output_size();
+	tensor<float> input(in_size._x, in_size._y, in_size._z);
+	tensor<float> expected(out_size._x, out_size._y, out_size._z);
+
+	auto track = [&](const float* data, int n, size_t index) {
+		for (int i = 0; i < n; i++) {
+			min[index] = std::min(min[index], data[i]);
+			max[index] = std::max(max[index], data[i]);
+		}
+	};
+
+	for (size_t i = 0; i < count; i++) {
+		calibration.read(i, input._data, expected._data);
+		unfused.predict(input, workspace);
+
+		// every activation is dense, the order doesn't matter for a range
+		track(input._data, volume(in_size), 0);
+
+		for (unsigned int l = 0; l < layers.size(); l++) {
+			track(workspace._activations[l]._data, volume(layers[l]->get_output_size()), l + 1);
+		}
+	}
+
+	// nothing seen: every range is empty and maps to the identity around zero
+	for (unsigned int i = 0; i < min.size(); i++) {
+		if (min[i] > max[i]) {
+			min[i] = 0.0f;
+			max[i] = 0.0f;
+		}
+	}
+
+	_input = quantization_for(min[0], max[0]);
+
+	for (unsigned int l = 0; l < layers.size(); l++) {
+		const layer* source = layers[l];
+		quantized_layer q;
+
+		q._type = source->type();
+		q._in_size = source->get_input_size();
+		q._out_size = source->get_output_size();
+
+		quantization in_mapping = l == 0 ? _input : _layers.back()._output;
+		size_t range = l + 1;
+
+		switch (q._type) {
+		case layer_t::Convolutional: {
+			const ConvLayer* conv = static_cast<const ConvLayer*>(source);
+			q._stride = conv->get_stride();
+			q._filter_dem = conv->get_filter_dem();
+			q._k = q._filter_dem * q._filter_dem * q._in_size._z;
+			quantize_weights(q, conv->get_weights()._data);
+			break;
+		}
+		case layer_t::FullConnected: {
+			const FullConnected* fc = static_cast<const FullConnected*>(source);
+			q._activation = fc->get_activation();
+			q._k = volume(q._in_size);
+			quantize_weights(q, fc->get_weights()._data);
+			break;
+		}
+		case layer_t::Pooling: {
+			const PoolingLayer* pooling = static_cast<const PoolingLayer*>(source);
+			q._stride = pooling->get_stride();
+			q._filter_dem = pooling->get_filter_dem();
+			break;
+		}
+		default:
+			break;
+		}
+
+		if (q._type == layer_t::Pooling || q._type == layer_t::Relu) {
+			// the max and relu of 8 bit values are the 8 bit values of the max and relu
+			q._output = in_mapping;
+		}
+		else {
+			// a relu right behind clamps at zero, which quantizing into its range does
+			if (l + 1 < layers.size() && layers[l + 1]->type() == layer_t::Relu) {
+				range = l + 2;
+			}
+
+			q._output = quantization_for(min[range], max[range]);
+		}
+
+		_layers.push_back(std::move(q));
+	}
+}
+
+quantized_workspace SharPNetQuantizedModel::create_workspace() const
+{
+	quantized_workspace workspace;
+	size_t columns = 0;
+	size_t sums = 0;
+	size_t values = 0;
+
+	for (const quantized_layer& l : _layers) {
+		if (l._type == layer_t::Convolutional) {
+			size_t positions = (size_t)l._out_size._x * l._out_size._y;
+			columns = std::max(columns, (size_t)l._k4 * positions);
+			sums = std::max(sums, (size_t)l.rows() * positions);
+		}
+		else if (l._type == layer_t::FullConnected) {
+			values = std::max(values, (size_t)l.rows());
+		}
+	}
+
+	workspace._activations.resize(_layers.size() + 1);
+
+	// activation l is the input of layer l, the last one the model's output
+	size_t largest[2] = { 0, 0 };
+	for (unsigned int l = 0; l <= _layers.size(); l++) {
+		td_size size = l < _layers.size() ? _layers[l]._in_size : _layers.back()._out_size;
+		largest[l % 2] = std::max(largest[l % 2], (size_t)volume(size));
+	}
+
+	// the arena hands out floats, the 8 bit buffers round up to them. A layer
+	// only reads the output of the one before it, so the layers write two
+	// buffers in turn.
+	workspace._memory.plan([&](arena& memory) {
+		uint8_t* ping_pong[2];
+		ping_pong[0] = reinterpret_cast<uint8_t*>(memory.allocate((largest[0] + 3) / 4));
+		ping_pong[1] = reinterpret_cast<uint8_t*>(memory.allocate((largest[1] + 3) / 4));
+
+		for (unsigned int l = 0; l <= _layers.size(); l++) {
+			workspace._activations[l] = ping_pong[l % 2];
+		}
+
+		workspace._columns = reinterpret_cast<uint8_t*>(memory.allocate((columns + 3) / 4));
+		workspace._sums = reinterpret_cast<int32_t*>(memory.allocate(sums));
+		workspace._values = memory.allocate(values);
+
+		td_size out_size = _layers.back()._out_size;
+		workspace._output = tensor_view<float>(memory.allocate(volume(out_size)), out_size);
+	});
+
+	return workspace;
+}
+
+tensor_view<float> SharPNetQuantizedModel::predict(tensor_view<float> input, quantized_workspace& workspace) const
+{
+	assert(workspace._activations.size() == _layers.size() + 1);
+
+	td_size size = input._size;
+	uint8_t* in = workspace._activations[0];
+
+	if (input.is_dense()) {
+		quantize(input._data, in, volume(size), _input);
+	}
+	else {
+		for (int z = 0; z < size._z; z++) {
+			for (int y = 0; y < size._y; y++) {
+				for (int x = 0; x < size._x; x++) {
+					in[(z * size._y + y) * size._x + x] = quantize_value(input(x, y, z), _input);
+				}
+			}
+		}
+	}
+
+	for (unsigned int l = 0; l < _layers.size(); l++) {
+		quantization in_mapping = l == 0 ? _input : _layers[l - 1]._output;
+		run(_layers[l], l + 1 == _layers.size(), workspace._activations[l], workspace._activations[l + 1], in_mapping, workspace);
+	}
+
+	return workspace._output;
+}
+
+// Runs one layer from its 8 bit input into the next 8 bit buffer, or into the
+// float output for the last layer
+void SharPNetQuantizedModel::run(const quantized_layer& l, bool last, const uint8_t* in, uint8_t* out, quantization in_mapping,
+	quantized_workspace& workspace) const
+{
+	float* output = workspace._output._data;
+	int out_count = volume(l._out_size);
+
+	switch (l._type) {
+	case layer_t::Convolutional: {
+		int positions = l._out_size._x * l._out_size._y;
+		int rows = l.rows();
+
+		im2col_packed(in, l._in_size, l._filter_dem, l._stride, l._out_size, l._k4, workspace._columns);
+		int8_gemm(l._weights.data(), workspace._columns, workspace._sums, rows, positions, l._k4);
+
+		// sum of (q_in - zero_point) * q_weight is the raw sum less zero_point times the row's sum
+		for (int f = 0; f < rows; f++) {
+			const int32_t* sums = workspace._sums + (size_t)f * positions;
+			int32_t offset = in_mapping.zero_point * l._row_sums[f];
+			float scale = in_mapping.scale * l._weight_scales[f];
+
+			if (last) {
+				for (int p = 0; p < positions; p++) {
+					output[f * positions + p] = scale * (sums[p] - offset);
+				}
+			}
+			else {
+				float requantize = scale / l._output.scale;
+
+				for (int p = 0; p < positions; p++) {
+					float rounded = std::nearbyint(requantize * (sums[p] - offset)) + l._output.zero_point;
+					out[f * positions + p] = (uint8_t)std::min(std::max(rounded, 0.0f), 255.0f);
+				}
+			}
+		}
+		break;
+	}
+	case layer_t::FullConnected: {
+		int rows = l.rows();
+		float* values = last ? output : workspace._values;
+
+		for (int n = 0; n < rows; n++) {
+			int32_t sum = int8_dot(in, l._weights.data() + (size_t)n * l._k4, l._k);
+			values[n] = in_mapping.scale * l._weight_scales[n] * (sum - in_mapping.zero_point * l._row_sums[n]);
+		}
+
+		apply_activation(l._activation, values, rows);
+
+		if (!last) {
+			quantize(values, out, rows, l._output);
+		}
+		break;
+	}
+	case layer_t::Pooling: {
+		if (l._filter_dem == 2) {
+			max_pool<2>(l, in, out);
+		}
+		else if (l._filter_dem == 3) {
+			max_pool<3>(l, in, out);
+		}
+		else {
+			max_pool<0>(l, in, out);
+		}
+
+		if (last) {
+			dequantize(out, output, out_count, l._output);
+		}
+		break;
+	}
+	case layer_t::Relu: {
+		uint8_t zero = (uint8_t)in_mapping.zero_point;
+
+		for (int i = 0; i < out_count; i++) {
+			out[i] = std::max(in[i], zero);
+		}
+
+		if (last) {
+			dequantize(out, output, out_count, l._output);
+		}
+		break;
+	}
+	}
+}
+
+bool SharPNetQuantizedModel::save(std::string filepath) const
+{
+	if (!is_little_endian() || _layers.empty()) { return false; }
+
+	quantized_header header;
+	memcpy(header.magic, QUANTIZED_MAGIC, sizeof(QUANTIZED_MAGIC));
+	header.version = QUANTIZED_VERSION;
+	header.nr_layers = (uint32_t)_layers.size();
+	header.input_scale = _input.scale;
+	header.input_zero_point = _input.zero_point;
+
+	std::ofstream outfile(filepath, std::ios::binary | std::ios::trunc);
+
+	if (!outfile.is_open()) { return false; }
+
+	outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (const quantized_layer& l : _layers) {
+		quantized_record record;
+		memset(&record, 0, sizeof(record));
+
+		record.type = (uint32_t)l._type;
+		record.activation = (uint32_t)l._activation;
+		record.stride = l._stride;
+		record.filter_dem = l._filter_dem;
+		record.in_size[0] = l._in_size._x;
+		record.in_size[1] = l._in_size._y;
+		record.in_size[2] = l._in_size._z;
+		record.out_size[0] = l._out_size._x;
+		record.out_size[1] = l._out_size._y;
+		record.out_size[2] = l._out_size._z;
+		record.k4 = l._k4;
+		record.output_scale = l._output.scale;
+		record.output_zero_point = l._output.zero_point;
+
+		outfile.write(reinterpret_cast<const char*>(&record), sizeof(record));
+	}
+
+	for (const quantized_layer& l : _layers) {
+		outfile.write(reinterpret_cast<const char*>(l._weights.data()), l._weights.size());
+		outfile.write(reinterpret_cast<const char*>(l._weight_scales.data()), l._weight_scales.size() * sizeof(float));
+		outfile.write(reinterpret_cast<const char*>(l._row_sums.data()), l._row_sums.size() * sizeof(int32_t));
+	}
+
+	outfile.close();
+	return !outfile.fail();
+}
+
+bool SharPNetQuantizedModel::load(std::string filepath)
+{
+	if (!is_little_endian()) { return false; }
+
+	std::ifstream infile(filepath, std::ios::binary);
+
+	if (!infile.is_open()) { return false; }
+
+	quantized_header header;
+
+	if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		memcmp(header.magic, QUANTIZED_MAGIC, sizeof(QUANTIZED_MAGIC)) != 0 ||
+		header.version != QUANTIZED_VERSION || header.nr_layers == 0 || header.nr_layers > 4096) {
+		return false;
+	}
+
+	std::vector<quantized_record> records(header.nr_layers);
+
+	if (!infile.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(quantized_record))) {
+		return false;
+	}
+
+	std::vector<quantized_layer> layers;
+
+	for (const quantized_record& record : records) {
+		quantized_layer l;
+		l._type = (layer_t)record.type;
+		l._activation = (activation_t)record.activation;
+		l._stride = record.stride;
+		l._filter_dem = record.filter_dem;
+		l._in_size = { record.in_size[0], record.in_size[1], record.in_size[2] };
+		l._out_size = { record.out_size[0], record.out_size[1], record.out_size[2] };
+		l._output.scale = record.output_scale;
+		l._output.zero_point = record.output_zero_point;
+
+		bool valid = record.type <= (uint32_t)layer_t::FullConnected &&
+			record.activation <= (uint32_t)activation_t::Softmax &&
+			l._in_size._x > 0 && l._in_size._y > 0 && l._in_size._z > 0 &&
+			l._out_size._x > 0 && l._out_size._y > 0 && l._out_size._z > 0 &&
+			l._output.scale > 0.0f && l._output.zero_point >= 0 && l._output.zero_point <= 255 &&
+			(layers.empty() || volume(layers.back()._out_size) == volume(l._in_size));
+
+		// the shapes have to be the ones the layer parameters give
+		if (valid && l._type == layer_t::Convolutional) {
+			valid = l._stride > 0 && l._filter_dem > 0 && l._filter_dem <= l._in_size._x && l._filter_dem <= l._in_size._y &&
+				l._out_size._x == (l._in_size._x - l._filter_dem) / l._stride + 1 &&
+				l._out_size._y == (l._in_size._y - l._filter_dem) / l._stride + 1;
+			l._k = l._filter_dem * l._filter_dem * l._in_size._z;
+		}
+		else if (valid && l._type == layer_t::Pooling) {
+			valid = l._stride > 0 && l._filter_dem > 0 && l._filter_dem <= l._in_size._x && l._filter_dem <= l._in_size._y &&
+				l._out_size._x == (l._in_size._x - l._filter_dem) / l._stride + 1 &&
+				l._out_size._y == (l._in_size._y - l._filter_dem) / l._stride + 1 &&
+				l._out_size._z == l._in_size._z && record.k4 == 0;
+		}
+		else if (valid && l._type == layer_t::FullConnected) {
+			valid = l._out_size._y == 1 && l._out_size._z == 1;
+			l._k = volume(l._in_size);
+		}
+		else if (valid) {
+			valid = volume(l._out_size) == volume(l._in_size) && record.k4 == 0;
+		}
+
+		if (valid && (l._type == layer_t::Convolutional || l._type == layer_t::FullConnected)) {
+			valid = record.k4 == (uint32_t)(l._k + 3) / 4 * 4;
+			l._k4 = record.k4;
+		}
+
+		if (!valid) {
+			return false;
+		}
+
+		layers.push_back(std::move(l));
+	}
+
+	for (quantized_layer& l : layers) {
+		if (l._k4 == 0) {
+			continue;
+		}
+
+		int rows = l.rows();
+		l._weights.resize((size_t)rows * l._k4);
+		l._weight_scales.resize(rows);
+		l._row_sums.resize(rows);
+
+		infile.read(reinterpret_cast<char*>(l._weights.data()), l._weights.size());
+		infile.read(reinterpret_cast<char*>(l._weight_scales.data()), rows * sizeof(float));
+		infile.read(reinterpret_cast<char*>(l._row_sums.data()), rows * sizeof(int32_t));
+
+		if (!infile) {
+			return false;
+		}
+	}
+
+	_layers = std::move(layers);
+	_input.scale = header.input_scale;
+	_input.zero_point = header.input_zero_point;
+	return true;
+}
@@ -0,0 +1,90 @@
+#ifndef SHARPNETQUANTIZEDMODEL_H
+#define SHARPNETQUANTIZEDMODEL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Data/dataset.h"
+#include "Layers/layer.h"
+#include "Learning/activation.h"
+#include "Math/int8.h"
+#include "SharPNetModel.h"
+
+// One layer of a SharPNetQuantizedModel. Convolutions and FullConnected layers
+// keep one row of k4 int8 weights per output channel, each row with a scale of
+// its own; pooling and relu need nothing but their shapes.
+struct quantized_layer
+{
+	layer_t _type;
+	activation_t _activation = activation_t::Relu;
+	int _stride = 0;
+	int _filter_dem = 0;
+	td_size _in_size;
+	td_size _out_size;
+
+	int _k = 0;		// inputs of a row
+	int _k4 = 0;	// _k rounded up to a multiple of 4
+	std::vector<int8_t> _weights;
+	std::vector<float> _weight_scales;
+	std::vector<int32_t> _row_sums;
+
+	// The layer's output as 8 bit, which is the next layer's input
+	quantization _output;
+
+	int rows() const { return _type == layer_t::FullConnected ? _out_size._x : _out_size._z; }
+};
+
+// Buffers of one inference request, planned when the workspace is created
+struct quantized_workspace
+{
+	arena _memory;
+
+	// the 8 bit input of every layer and the output of the last one, which
+	// alternate between two buffers
+	std::vector<uint8_t*> _activations;
+	uint8_t* _columns = nullptr;
+	int32_t* _sums = nullptr;
+	float* _values = nullptr;
+	tensor_view<float> _output;
+};
+
+// Post-training int8 version of a network for serving. The activations between
+// layers are 8 bit unsigned with one scale and zero point per tensor, the
+// weights 8 bit signed with a scale per output channel, and every product is
+// summed exactly in 32 bit, see Math/int8.h. Relu and max pooling run on the 8
+// bit values directly, they commute with the mapping; only the output layer
+// goes back to float. Like SharPNetModel, predict() is reentrant with one
+// workspace per caller. The model always runs in CHW.
+class SharPNetQuantizedModel
+{
+private:
+	std::vector<quantized_layer> _layers;
+	quantization _input;
+
+	void run(const quantized_layer& l, bool last, const uint8_t* in, uint8_t* out, quantization in_mapping,
+		quantized_workspace& workspace) const;
+
+public:
+	SharPNetQuantizedModel() { }
+
+	// Quantizes the weights of model and calibrates the range of every
+	// activation on the first nr_samples samples of calibration, all of them
+	// for 0. A convolution or FullConnected layer directly followed by a relu
+	// takes the relu's range, so the relu costs nothing.
+	SharPNetQuantizedModel(const SharPNetModel& model, const dataset& calibration, size_t nr_samples = 0);
+
+	quantized_workspace create_workspace() const;
+
+	// input may be in any layout, the output is float and in CHW
+	tensor_view<float> predict(tensor_view<float> input, quantized_workspace& workspace) const;
+
+	td_size get_input_size() const { return _layers.front()._in_size; }
+	td_size get_output_size() const { return _layers.back()._out_size; }
+	bool empty() const { return _layers.empty(); }
+
+	// Versioned binary format, see IO/quantized_format.h
+	bool save(std::string filepath) const;
+	bool load(std::string filepath);
+};
+
+#endif